@@ -0,0 +1,889 @@
+/******************************************************************************
+In-process audio outputs: PulseAudio, ALSA and the null/file devices
+******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#ifdef USE_PULSE
+#include <pulse/pulseaudio.h>
+#endif
+#ifdef USE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#include "audio.h"
+#include "conv.h"
+#include "utils.h"
+
+//Less than this still queued counts as the end of the utterance
+#define AUDIO_TAIL_US 50000
+
+enum audio_out {
+  OUT_NONE = 0,
+  OUT_PULSE,
+  OUT_ALSA,
+  OUT_NULL,
+  OUT_FILE,
+  OUT_SINK
+};
+
+static enum audio_out out = OUT_NONE;
+static struct wav_info out_info;
+static struct wav_info out_fixed; //what conv_pcm() turns every segment into
+static bool out_configured = false;
+static int file_fd = -1;
+
+/*
+ * PIPER_SINK started once in raw mode and fed bare S16LE frames. A pipe
+ * can't say how much is still buffered, so playback time is estimated
+ * from the amount written; preemption kills the sink, the next write
+ * starts a new one, as does a sink that died on its own.
+ */
+static char *const *sink_argv = NULL;
+static pid_t sink_pid = -1;
+static int sink_fd = -1;
+static unsigned sink_rate = 0;
+static unsigned sink_channels = 1;
+static double sink_end = 0; //when the audio written so far runs out
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool sink_start(void)
+{
+  int inpipe[2];
+  if(pipe(inpipe) != 0){
+    xcDebug("XLinSpeak: Sink pipe failed: %d\n", errno);
+    return false;
+  }
+  set_cloexec(inpipe[0]);
+  set_cloexec(inpipe[1]);
+  if(!spawn_process(sink_argv, inpipe[0], -1, inpipe, 2, &sink_pid)){
+    xcDebug("XLinSpeak: Sink spawn failed: %d\n", errno);
+    close(inpipe[0]);
+    close(inpipe[1]);
+    sink_pid = -1;
+    return false;
+  }
+  close(inpipe[0]);
+  sink_fd = inpipe[1];
+  sink_end = 0;
+  return true;
+}
+
+static void sink_stop(void)
+{
+  if(sink_fd >= 0){
+    close(sink_fd);
+    sink_fd = -1;
+  }
+  if(sink_pid > 0){
+    kill(sink_pid, SIGTERM);
+    while(waitpid(sink_pid, NULL, 0) < 0 && errno == EINTR){
+    }
+    sink_pid = -1;
+  }
+}
+
+static bool sink_open(const struct wav_info *info)
+{
+  static bool warned = false;
+  if(info->format != 1 || info->bits_per_sample != 16 ||
+     info->sample_rate != sink_rate || info->channels != sink_channels){
+    if(warned){
+      return false;
+    }
+    warned = true;
+    xcDebug("XLinSpeak: Piper delivers %u Hz/%u ch/%u bit, the raw sink expects %u Hz/%u ch/16 bit.\n",
+            info->sample_rate, info->channels, info->bits_per_sample, sink_rate, sink_channels);
+    return false;
+  }
+  return true;
+}
+
+static bool sink_write(const uint8_t *data, size_t len)
+{
+  double now;
+  int attempt;
+  for(attempt = 0; attempt < 2; ++attempt){
+    if(sink_fd < 0 && !sink_start()){
+      return false;
+    }
+    if(write_all(sink_fd, (const char *)data, len)){
+      break;
+    }
+    xcDebug("XLinSpeak: Raw sink went away (%d), restarting it.\n", errno);
+    sink_stop();
+  }
+  if(attempt == 2){
+    return false;
+  }
+  now = now_sec();
+  if(sink_end < now){
+    sink_end = now;
+  }
+  sink_end += (double)len / (2.0 * sink_channels * sink_rate);
+  return true;
+}
+
+static bool sink_playing(void)
+{
+  return sink_end - now_sec() > AUDIO_TAIL_US / 1e6;
+}
+
+//PIPER_SINK_RAW is "rate" or "rate:channels"
+static bool sink_config(const char *val)
+{
+  char *end;
+  unsigned long rate = strtoul(val, &end, 10);
+  unsigned long channels = 1;
+  if(*end == ':'){
+    channels = strtoul(end + 1, &end, 10);
+  }
+  if(*end != '\0' || rate < 1000 || rate > 384000 || channels < 1 || channels > 8){
+    xcDebug("XLinSpeak: Ignoring invalid PIPER_SINK_RAW=%s.\n", val);
+    return false;
+  }
+  sink_rate = (unsigned)rate;
+  sink_channels = (unsigned)channels;
+  return true;
+}
+
+#ifdef USE_PULSE
+/*
+ * pa_stream on a threaded mainloop. Utterances are appended to the same
+ * stream back to back; the end of one is detected from the stream latency
+ * instead of a drain, so the next can be written while the tail plays.
+ * All pa_* calls below run with the mainloop lock held, callbacks only
+ * wake the waiting thread.
+ */
+static pa_threaded_mainloop *pulse_loop = NULL;
+static pa_context *pulse_ctx = NULL;
+static pa_stream *pulse_stream = NULL;
+static pa_sample_spec pulse_spec;
+static unsigned pulse_target_us = 60000;
+static bool pulse_triggered = true;
+static void pulse_signal_cb(void *userdata)
+{
+  (void)userdata;
+  pa_threaded_mainloop_signal(pulse_loop, 0);
+}
+
+static void pulse_context_cb(pa_context *c, void *userdata)
+{
+  (void)c;
+  pulse_signal_cb(userdata);
+}
+
+static void pulse_stream_cb(pa_stream *s, void *userdata)
+{
+  (void)s;
+  pulse_signal_cb(userdata);
+}
+
+static void pulse_request_cb(pa_stream *s, size_t bytes, void *userdata)
+{
+  (void)s;
+  (void)bytes;
+  pulse_signal_cb(userdata);
+}
+
+static void pulse_success_cb(pa_stream *s, int success, void *userdata)
+{
+  (void)s;
+  (void)success;
+  pulse_signal_cb(userdata);
+}
+
+static void pulse_wait_op(pa_operation *op)
+{
+  if(op == NULL){
+    return;
+  }
+  while(pa_operation_get_state(op) == PA_OPERATION_RUNNING){
+    pa_threaded_mainloop_wait(pulse_loop);
+  }
+  pa_operation_unref(op);
+}
+
+static bool pulse_connect(void)
+{
+  pa_context_state_t state;
+
+  pulse_target_us = (unsigned)env_long("PIPER_PULSE_LATENCY_MS", 60, 10, 2000) * 1000;
+  pulse_loop = pa_threaded_mainloop_new();
+  if(pulse_loop == NULL){
+    return false;
+  }
+  pulse_ctx = pa_context_new(pa_threaded_mainloop_get_api(pulse_loop), "XLinSpeak");
+  if(pulse_ctx == NULL){
+    pa_threaded_mainloop_free(pulse_loop);
+    pulse_loop = NULL;
+    return false;
+  }
+  pa_context_set_state_callback(pulse_ctx, pulse_context_cb, NULL);
+  if(pa_threaded_mainloop_start(pulse_loop) < 0){
+    pa_context_unref(pulse_ctx);
+    pa_threaded_mainloop_free(pulse_loop);
+    pulse_ctx = NULL;
+    pulse_loop = NULL;
+    return false;
+  }
+
+  pa_threaded_mainloop_lock(pulse_loop);
+  if(pa_context_connect(pulse_ctx, NULL, PA_CONTEXT_NOFLAGS, NULL) >= 0){
+    while(1){
+      state = pa_context_get_state(pulse_ctx);
+      if(state == PA_CONTEXT_READY || !PA_CONTEXT_IS_GOOD(state)){
+        break;
+      }
+      pa_threaded_mainloop_wait(pulse_loop);
+    }
+  }
+  state = pa_context_get_state(pulse_ctx);
+  pa_threaded_mainloop_unlock(pulse_loop);
+  if(state != PA_CONTEXT_READY){
+    xcDebug("XLinSpeak: Pulse connect failed: %s\n", pa_strerror(pa_context_errno(pulse_ctx)));
+    return false;
+  }
+  return true;
+}
+
+static void pulse_stream_free(void)
+{
+  if(pulse_stream != NULL){
+    pa_stream_set_state_callback(pulse_stream, NULL, NULL);
+    pa_stream_set_write_callback(pulse_stream, NULL, NULL);
+    pa_stream_disconnect(pulse_stream);
+    pa_stream_unref(pulse_stream);
+    pulse_stream = NULL;
+  }
+}
+
+static bool pulse_stream_new(const pa_sample_spec *spec)
+{
+  pa_buffer_attr attr;
+  pa_stream_state_t state;
+
+  pulse_stream = pa_stream_new(pulse_ctx, "Piper", spec, NULL);
+  if(pulse_stream == NULL){
+    return false;
+  }
+  pa_stream_set_state_callback(pulse_stream, pulse_stream_cb, NULL);
+  pa_stream_set_write_callback(pulse_stream, pulse_request_cb, NULL);
+
+  //Small prebuf: the stream starts almost at once and pulse_playing()
+  //triggers whatever is left of a short utterance
+  attr.maxlength = (uint32_t)-1;
+  attr.tlength = (uint32_t)pa_usec_to_bytes(pulse_target_us, spec);
+  attr.prebuf = (uint32_t)pa_usec_to_bytes(pulse_target_us / 4, spec);
+  attr.minreq = (uint32_t)-1;
+  attr.fragsize = (uint32_t)-1;
+  if(pa_stream_connect_playback(pulse_stream, NULL, &attr,
+                                PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING |
+                                PA_STREAM_AUTO_TIMING_UPDATE | PA_STREAM_VARIABLE_RATE,
+                                NULL, NULL) < 0){
+    pulse_stream_free();
+    return false;
+  }
+  while(1){
+    state = pa_stream_get_state(pulse_stream);
+    if(state == PA_STREAM_READY){
+      break;
+    }
+    if(!PA_STREAM_IS_GOOD(state)){
+      pulse_stream_free();
+      return false;
+    }
+    pa_threaded_mainloop_wait(pulse_loop);
+  }
+  pulse_triggered = true;
+  return true;
+}
+
+//A rate change keeps the stream, anything else needs a new one
+static bool pulse_open(const struct wav_info *info)
+{
+  pa_sample_spec spec;
+  bool ok = true;
+
+  if(info->format != 1){
+    xcDebug("XLinSpeak: Pulse only supports PCM WAV from Piper.\n");
+    return false;
+  }
+  if(info->bits_per_sample != 16){
+    xcDebug("XLinSpeak: Pulse only supports 16-bit PCM from Piper.\n");
+    return false;
+  }
+
+  spec.format = PA_SAMPLE_S16LE;
+  spec.rate = info->sample_rate;
+  spec.channels = (uint8_t)info->channels;
+
+  if(!pa_sample_spec_valid(&spec)){
+    xcDebug("XLinSpeak: Invalid Pulse sample spec.\n");
+    return false;
+  }
+
+  pa_threaded_mainloop_lock(pulse_loop);
+  if(pulse_stream != NULL && pa_stream_get_state(pulse_stream) == PA_STREAM_READY &&
+     pulse_spec.channels == spec.channels){
+    if(pulse_spec.rate != spec.rate){
+      pulse_wait_op(pa_stream_update_sample_rate(pulse_stream, spec.rate, pulse_success_cb, NULL));
+    }
+  }else{
+    pulse_stream_free();
+    ok = pulse_stream_new(&spec);
+  }
+  if(ok){
+    pulse_spec = spec;
+  }else{
+    xcDebug("XLinSpeak: Pulse stream failed: %s\n", pa_strerror(pa_context_errno(pulse_ctx)));
+  }
+  pa_threaded_mainloop_unlock(pulse_loop);
+  return ok;
+}
+
+static bool pulse_write(const uint8_t *data, size_t len)
+{
+  bool ok = true;
+
+  pa_threaded_mainloop_lock(pulse_loop);
+  while(len > 0){
+    size_t n;
+    if(pulse_stream == NULL || pa_stream_get_state(pulse_stream) != PA_STREAM_READY){
+      ok = false;
+      break;
+    }
+    n = pa_stream_writable_size(pulse_stream);
+    if(n == (size_t)-1){
+      ok = false;
+      break;
+    }
+    if(n == 0){
+      pa_threaded_mainloop_wait(pulse_loop);
+      continue;
+    }
+    if(n > len){
+      n = len;
+    }
+    if(pa_stream_write(pulse_stream, data, n, NULL, 0, PA_SEEK_RELATIVE) < 0){
+      ok = false;
+      break;
+    }
+    data += n;
+    len -= n;
+  }
+  pulse_triggered = false;
+  if(!ok){
+    xcDebug("XLinSpeak: Pulse write failed: %s\n", pa_strerror(pa_context_errno(pulse_ctx)));
+  }
+  pa_threaded_mainloop_unlock(pulse_loop);
+  return ok;
+}
+
+static bool pulse_playing(void)
+{
+  pa_usec_t lat = 0;
+  int neg = 0;
+  bool res = false;
+
+  pa_threaded_mainloop_lock(pulse_loop);
+  if(pulse_stream == NULL){
+    pa_threaded_mainloop_unlock(pulse_loop);
+    return false;
+  }
+  if(!pulse_triggered){
+    //less than prebuf may be left over from a short utterance
+    pa_operation *op = pa_stream_trigger(pulse_stream, NULL, NULL);
+    if(op != NULL){
+      pa_operation_unref(op);
+    }
+    pulse_triggered = true;
+  }
+  if(pa_stream_get_latency(pulse_stream, &lat, &neg) == 0 && !neg){
+    res = lat >= AUDIO_TAIL_US;
+  }
+  pa_threaded_mainloop_unlock(pulse_loop);
+  return res;
+}
+
+static void pulse_flush(void)
+{
+  pa_threaded_mainloop_lock(pulse_loop);
+  if(pulse_stream != NULL){
+    pulse_wait_op(pa_stream_flush(pulse_stream, pulse_success_cb, NULL));
+  }
+  pa_threaded_mainloop_unlock(pulse_loop);
+}
+
+static bool pulse_latency(unsigned long *usec)
+{
+  pa_usec_t lat;
+  int neg;
+  bool ok = false;
+  pa_threaded_mainloop_lock(pulse_loop);
+  if(pulse_stream != NULL && pa_stream_get_latency(pulse_stream, &lat, &neg) == 0){
+    *usec = neg ? 0 : (unsigned long)lat;
+    ok = true;
+  }
+  pa_threaded_mainloop_unlock(pulse_loop);
+  return ok;
+}
+
+static void pulse_close(void)
+{
+  if(pulse_loop == NULL){
+    return;
+  }
+  pa_threaded_mainloop_lock(pulse_loop);
+  pulse_stream_free();
+  if(pulse_ctx != NULL){
+    pa_context_disconnect(pulse_ctx);
+    pa_context_unref(pulse_ctx);
+    pulse_ctx = NULL;
+  }
+  pa_threaded_mainloop_unlock(pulse_loop);
+  pa_threaded_mainloop_stop(pulse_loop);
+  pa_threaded_mainloop_free(pulse_loop);
+  pulse_loop = NULL;
+}
+#endif
+
+#ifdef USE_ALSA
+/*
+ * One snd_pcm_t stays open for the plugin's lifetime; a format change only
+ * renegotiates the hw params. The stream keeps running from one segment to
+ * the next; only once the player runs out of audio is it drained and
+ * prepared again instead of being left to underrun.
+ */
+static snd_pcm_t *alsa_pcm = NULL;
+static unsigned alsa_period_us = 20000;
+static unsigned alsa_buffer_us = 100000;
+static size_t alsa_frame = 0;
+
+static snd_pcm_format_t alsa_format(const struct wav_info *info)
+{
+  if(info->format == 3 && info->bits_per_sample == 32){
+    return SND_PCM_FORMAT_FLOAT_LE;
+  }
+  if(info->format != 1){
+    return SND_PCM_FORMAT_UNKNOWN;
+  }
+  switch(info->bits_per_sample){
+    case 8:
+      return SND_PCM_FORMAT_U8;
+    case 16:
+      return SND_PCM_FORMAT_S16_LE;
+    case 32:
+      return SND_PCM_FORMAT_S32_LE;
+    default:
+      return SND_PCM_FORMAT_UNKNOWN;
+  }
+}
+
+static bool alsa_open(const char *device)
+{
+  int err;
+  alsa_period_us = (unsigned)env_long("PIPER_ALSA_PERIOD_MS", 20, 1, 1000) * 1000;
+  alsa_buffer_us = (unsigned)env_long("PIPER_ALSA_BUFFER_MS", 100, 2, 5000) * 1000;
+  if(alsa_buffer_us < 2 * alsa_period_us){
+    alsa_buffer_us = 2 * alsa_period_us;
+  }
+  err = snd_pcm_open(&alsa_pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+  if(err < 0){
+    xcDebug("XLinSpeak: Can't open ALSA device %s: %s\n", device, snd_strerror(err));
+    alsa_pcm = NULL;
+    return false;
+  }
+  return true;
+}
+
+static bool alsa_configure(const struct wav_info *info)
+{
+  snd_pcm_hw_params_t *hw;
+  snd_pcm_sw_params_t *sw;
+  snd_pcm_format_t fmt = alsa_format(info);
+  snd_pcm_uframes_t buffer;
+  snd_pcm_uframes_t period;
+  unsigned buffer_us = alsa_buffer_us;
+  unsigned period_us = alsa_period_us;
+  int dir = 0;
+  int err;
+
+  if(fmt == SND_PCM_FORMAT_UNKNOWN){
+    xcDebug("XLinSpeak: Unsupported WAV format %u/%u bits for ALSA.\n",
+            info->format, info->bits_per_sample);
+    return false;
+  }
+  snd_pcm_drop(alsa_pcm);
+
+  snd_pcm_hw_params_alloca(&hw);
+  if((err = snd_pcm_hw_params_any(alsa_pcm, hw)) < 0 ||
+     (err = snd_pcm_hw_params_set_rate_resample(alsa_pcm, hw, 1)) < 0 ||
+     (err = snd_pcm_hw_params_set_access(alsa_pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+     (err = snd_pcm_hw_params_set_format(alsa_pcm, hw, fmt)) < 0 ||
+     (err = snd_pcm_hw_params_set_channels(alsa_pcm, hw, info->channels)) < 0 ||
+     (err = snd_pcm_hw_params_set_rate(alsa_pcm, hw, info->sample_rate, 0)) < 0 ||
+     (err = snd_pcm_hw_params_set_buffer_time_near(alsa_pcm, hw, &buffer_us, &dir)) < 0 ||
+     (err = snd_pcm_hw_params_set_period_time_near(alsa_pcm, hw, &period_us, &dir)) < 0 ||
+     (err = snd_pcm_hw_params(alsa_pcm, hw)) < 0){
+    xcDebug("XLinSpeak: ALSA hw setup failed: %s\n", snd_strerror(err));
+    return false;
+  }
+  snd_pcm_hw_params_get_buffer_size(hw, &buffer);
+  snd_pcm_hw_params_get_period_size(hw, &period, &dir);
+
+  //Start after the first period instead of a full buffer
+  snd_pcm_sw_params_alloca(&sw);
+  if((err = snd_pcm_sw_params_current(alsa_pcm, sw)) < 0 ||
+     (err = snd_pcm_sw_params_set_start_threshold(alsa_pcm, sw, period)) < 0 ||
+     (err = snd_pcm_sw_params_set_avail_min(alsa_pcm, sw, period)) < 0 ||
+     (err = snd_pcm_sw_params(alsa_pcm, sw)) < 0){
+    xcDebug("XLinSpeak: ALSA sw setup failed: %s\n", snd_strerror(err));
+    return false;
+  }
+  if((err = snd_pcm_prepare(alsa_pcm)) < 0){
+    xcDebug("XLinSpeak: ALSA prepare failed: %s\n", snd_strerror(err));
+    return false;
+  }
+  alsa_frame = (size_t)info->channels * (info->bits_per_sample / 8);
+  xcDebug("XLinSpeak: ALSA %u Hz, %u ch, period %lu, buffer %lu frames.\n",
+          info->sample_rate, info->channels, (unsigned long)period, (unsigned long)buffer);
+  return true;
+}
+
+static bool alsa_write(const uint8_t *data, size_t len)
+{
+  snd_pcm_uframes_t frames = len / alsa_frame;
+  while(frames > 0){
+    snd_pcm_sframes_t res = snd_pcm_writei(alsa_pcm, data, frames);
+    if(res < 0){
+      int err = snd_pcm_recover(alsa_pcm, (int)res, 1);
+      if(err < 0){
+        xcDebug("XLinSpeak: ALSA write failed: %s\n", snd_strerror(err));
+        return false;
+      }
+      continue;
+    }
+    data += (size_t)res * alsa_frame;
+    frames -= (snd_pcm_uframes_t)res;
+  }
+  return true;
+}
+
+static bool alsa_playing(void)
+{
+  snd_pcm_sframes_t delay = 0;
+  if(snd_pcm_state(alsa_pcm) == SND_PCM_STATE_RUNNING &&
+     snd_pcm_delay(alsa_pcm, &delay) == 0 &&
+     (uint64_t)(delay > 0 ? delay : 0) * 1000000 / out_info.sample_rate >= AUDIO_TAIL_US){
+    return true;
+  }
+  return false;
+}
+
+static void alsa_idle(void)
+{
+  if(snd_pcm_state(alsa_pcm) == SND_PCM_STATE_RUNNING){
+    snd_pcm_drain(alsa_pcm);
+    snd_pcm_prepare(alsa_pcm);
+  }
+}
+
+static void alsa_flush(void)
+{
+  snd_pcm_drop(alsa_pcm);
+  snd_pcm_prepare(alsa_pcm);
+}
+
+static bool alsa_latency(unsigned long *usec)
+{
+  snd_pcm_sframes_t delay;
+  if(snd_pcm_delay(alsa_pcm, &delay) != 0){
+    return false;
+  }
+  *usec = delay > 0 ? (unsigned long)((uint64_t)delay * 1000000 / out_info.sample_rate) : 0;
+  return true;
+}
+
+static void alsa_close(void)
+{
+  if(alsa_pcm != NULL){
+    snd_pcm_drain(alsa_pcm);
+    snd_pcm_close(alsa_pcm);
+    alsa_pcm = NULL;
+  }
+}
+#endif
+
+//PIPER_OUTPUT_RATE and PIPER_OUTPUT_CHANNELS, the raw sink brings its own
+static void fixed_config(void)
+{
+  out_fixed.format = 1;
+  out_fixed.bits_per_sample = 16;
+  if(out == OUT_SINK){
+    out_fixed.sample_rate = sink_rate;
+    out_fixed.channels = (uint16_t)sink_channels;
+  }else{
+    out_fixed.sample_rate = (uint32_t)env_long("PIPER_OUTPUT_RATE", 22050, 8000, 192000);
+    out_fixed.channels = (uint16_t)env_long("PIPER_OUTPUT_CHANNELS", 1, 1, 8);
+  }
+  xcDebug("XLinSpeak: Output fixed at %u Hz, %u ch (%s conversion).\n",
+          out_fixed.sample_rate, out_fixed.channels, conv_kernel_name());
+}
+
+//PIPER_PULSE wins over PIPER_ALSA, then PIPER_SINK_RAW; null and file: need no audio library
+static bool audio_select(char *const sink[])
+{
+  const char *dev = getenv("PIPER_ALSA");
+  const char *raw = getenv("PIPER_SINK_RAW");
+
+#ifdef USE_PULSE
+  if(env_is_true("PIPER_PULSE")){
+    if(pulse_connect()){
+      out = OUT_PULSE;
+      xcDebug("XLinSpeak: Pulse backend enabled (PIPER_PULSE=1).\n");
+      return true;
+    }
+    pulse_close();
+  }
+#endif
+  if(dev == NULL || *dev == '\0'){
+    if(raw != NULL && *raw != '\0' && sink != NULL && sink_config(raw)){
+      sink_argv = sink;
+      out = OUT_SINK;
+      xcDebug("XLinSpeak: Persistent raw sink %s at %u Hz, %u ch.\n", sink[0], sink_rate, sink_channels);
+      return true;
+    }
+    return false;
+  }
+  if(strcmp(dev, "null") == 0){
+    out = OUT_NULL;
+    xcDebug("XLinSpeak: Audio goes to the null device.\n");
+    return true;
+  }
+  if(strncmp(dev, "file:", 5) == 0){
+    file_fd = open(dev + 5, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(file_fd < 0){
+      xcDebug("XLinSpeak: Can't open %s: %d\n", dev + 5, errno);
+      return false;
+    }
+    out = OUT_FILE;
+    xcDebug("XLinSpeak: Raw audio is appended to %s.\n", dev + 5);
+    return true;
+  }
+#ifdef USE_ALSA
+  if(alsa_open(dev)){
+    out = OUT_ALSA;
+    xcDebug("XLinSpeak: ALSA backend enabled (PIPER_ALSA=%s).\n", dev);
+    return true;
+  }
+#else
+  xcDebug("XLinSpeak: PIPER_ALSA=%s needs a USE_ALSA build, using PIPER_SINK.\n", dev);
+#endif
+  return false;
+}
+
+bool audio_init(char *const sink[])
+{
+  if(!audio_select(sink)){
+    return false;
+  }
+  fixed_config();
+  return true;
+}
+
+void audio_close(void)
+{
+  switch(out){
+    case OUT_PULSE:
+#ifdef USE_PULSE
+      pulse_close();
+#endif
+      break;
+    case OUT_ALSA:
+#ifdef USE_ALSA
+      alsa_close();
+#endif
+      break;
+    case OUT_FILE:
+      close(file_fd);
+      file_fd = -1;
+      break;
+    case OUT_SINK:
+      sink_stop();
+      break;
+    default:
+      break;
+  }
+  out = OUT_NONE;
+  out_configured = false;
+}
+
+bool audio_format(struct wav_info *info)
+{
+  if(out == OUT_NONE){
+    return false;
+  }
+  *info = out_fixed;
+  return true;
+}
+
+//Reconfigures the output only when the format differs from the last one
+bool audio_open(const struct wav_info *info)
+{
+  bool ok = true;
+  if(info->channels == 0 || info->sample_rate == 0 || info->bits_per_sample < 8){
+    xcDebug("XLinSpeak: Invalid WAV header from Piper.\n");
+    return false;
+  }
+  if(out_configured && wav_info_equal(&out_info, info)){
+    return true;
+  }
+  switch(out){
+    case OUT_PULSE:
+#ifdef USE_PULSE
+      ok = pulse_open(info);
+#endif
+      break;
+    case OUT_ALSA:
+#ifdef USE_ALSA
+      ok = alsa_configure(info);
+#endif
+      break;
+    case OUT_SINK:
+      ok = sink_open(info);
+      break;
+    case OUT_NULL:
+    case OUT_FILE:
+      break;
+    default:
+      ok = false;
+      break;
+  }
+  out_configured = ok;
+  if(ok){
+    out_info = *info;
+  }
+  return ok;
+}
+
+//Blocks while the device buffer is full
+bool audio_write(const uint8_t *data, size_t len)
+{
+  switch(out){
+    case OUT_PULSE:
+#ifdef USE_PULSE
+      //a dead stream is replaced on the next audio_open()
+      out_configured = pulse_write(data, len);
+      return out_configured;
+#endif
+      break;
+    case OUT_ALSA:
+#ifdef USE_ALSA
+      return alsa_write(data, len);
+#endif
+      break;
+    case OUT_NULL:
+      return true;
+    case OUT_FILE:
+      return write_all(file_fd, (const char *)data, len);
+    case OUT_SINK:
+      return sink_write(data, len);
+    default:
+      break;
+  }
+  return false;
+}
+
+//True while more than the last few ms of written audio are still queued
+bool audio_playing(void)
+{
+  switch(out){
+    case OUT_PULSE:
+#ifdef USE_PULSE
+      return pulse_playing();
+#endif
+      break;
+    case OUT_ALSA:
+#ifdef USE_ALSA
+      return alsa_playing();
+#endif
+      break;
+    case OUT_SINK:
+      return sink_playing();
+    default:
+      break;
+  }
+  return false;
+}
+
+//Lets the output play out what is queued, called when nothing follows
+void audio_idle(void)
+{
+  switch(out){
+    case OUT_ALSA:
+#ifdef USE_ALSA
+      if(out_configured){
+        alsa_idle();
+      }
+#endif
+      break;
+    default:
+      break;
+  }
+}
+
+//Drops whatever is still queued, used when playback is preempted
+void audio_flush(void)
+{
+  switch(out){
+    case OUT_PULSE:
+#ifdef USE_PULSE
+      pulse_flush();
+#endif
+      break;
+    case OUT_ALSA:
+#ifdef USE_ALSA
+      alsa_flush();
+#endif
+      break;
+    case OUT_SINK:
+      sink_stop();
+      break;
+    default:
+      break;
+  }
+}
+
+//Time until audio written now would be heard, where the output can tell
+bool audio_latency(unsigned long *usec)
+{
+  (void)usec;
+  switch(out){
+    case OUT_PULSE:
+#ifdef USE_PULSE
+      return pulse_latency(usec);
+#endif
+      break;
+    case OUT_ALSA:
+#ifdef USE_ALSA
+      return out_configured && alsa_latency(usec);
+#endif
+      break;
+    default:
+      break;
+  }
+  return false;
+}
@@ -0,0 +1,23 @@
+#ifndef AUDIO__H
+#define AUDIO__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcm.h"
+
+//In-process audio outputs. Without one, play_pcm() pipes WAV to PIPER_SINK.
+bool audio_init(char *const sink[]);
+void audio_close(void);
+
+//The format the output stays at for the whole session
+bool audio_format(struct wav_info *info);
+bool audio_open(const struct wav_info *info);
+bool audio_write(const uint8_t *data, size_t len);
+bool audio_playing(void);
+void audio_idle(void);
+void audio_flush(void);
+bool audio_latency(unsigned long *usec);
+
+#endif
@@ -0,0 +1,247 @@
+/******************************************************************************
+Last rendering of repeated long messages (ATIS, AWOS), so a re-issue that
+changed in one field only synthesizes the segments that differ
+******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bcast.h"
+#include "cache.h"
+
+//Segments kept per message, the rest is always synthesized
+#define BCAST_SEGS 64
+
+struct bcast_seg {
+  unsigned refs; //under bcast.mtx, like everything below
+  bool ready;
+  struct pcm_buf pcm;
+  char *text;    //normalized
+};
+
+struct bcast_render {
+  uint64_t key;
+  unsigned long used;
+  size_t count;
+  struct bcast_seg *segs[BCAST_SEGS];
+  const struct bcast_render *last; //the one being diffed against
+};
+
+static struct {
+  bool ready;
+  unsigned keys;
+  unsigned long tick;
+  struct bcast_render **renders;
+  struct bcast_stats stats;
+  pthread_mutex_t mtx;
+} bcast;
+
+static void seg_unref(struct bcast_seg *seg)
+{
+  if(--seg->refs == 0){
+    pcm_free(&seg->pcm);
+    free(seg->text);
+    free(seg);
+  }
+}
+
+static void render_free(struct bcast_render *r)
+{
+  size_t i;
+  for(i = 0; i < r->count; ++i){
+    seg_unref(r->segs[i]);
+  }
+  free(r);
+}
+
+void bcast_init(unsigned keys)
+{
+  if(bcast.ready || keys == 0){
+    return;
+  }
+  bcast.renders = (struct bcast_render **)calloc(keys, sizeof(*bcast.renders));
+  if(bcast.renders == NULL){
+    return;
+  }
+  bcast.keys = keys;
+  bcast.tick = 0;
+  memset(&bcast.stats, 0, sizeof(bcast.stats));
+  pthread_mutex_init(&bcast.mtx, NULL);
+  bcast.ready = true;
+}
+
+void bcast_close(void)
+{
+  unsigned i;
+  if(!bcast.ready){
+    return;
+  }
+  bcast.ready = false;
+  for(i = 0; i < bcast.keys; ++i){
+    if(bcast.renders[i] != NULL){
+      render_free(bcast.renders[i]);
+    }
+  }
+  free(bcast.renders);
+  bcast.renders = NULL;
+  pthread_mutex_destroy(&bcast.mtx);
+}
+
+struct bcast_render *bcast_begin(uint64_t key)
+{
+  struct bcast_render *r;
+  unsigned i;
+  if(!bcast.ready || key == 0){
+    return NULL;
+  }
+  r = (struct bcast_render *)calloc(1, sizeof(*r));
+  if(r == NULL){
+    return NULL;
+  }
+  r->key = key;
+  //only bcast_end() changes the table, on this same thread
+  for(i = 0; i < bcast.keys; ++i){
+    if(bcast.renders[i] != NULL && bcast.renders[i]->key == key){
+      r->last = bcast.renders[i];
+    }
+  }
+  return r;
+}
+
+struct bcast_seg *bcast_add(struct bcast_render *r, const char *text)
+{
+  struct bcast_seg *seg = NULL;
+  size_t i;
+
+  if(r == NULL || r->count == BCAST_SEGS){
+    return NULL;
+  }
+  for(i = 0; r->last != NULL && i < r->last->count && seg == NULL; ++i){
+    if(cache_norm_equal(r->last->segs[i]->text, text)){
+      seg = r->last->segs[i];
+    }
+  }
+  if(seg == NULL){
+    seg = (struct bcast_seg *)calloc(1, sizeof(*seg));
+    if(seg == NULL){
+      return NULL;
+    }
+    seg->text = cache_norm_dup(text);
+    if(seg->text == NULL){
+      free(seg);
+      return NULL;
+    }
+  }
+  pthread_mutex_lock(&bcast.mtx);
+  seg->refs += 2;
+  pthread_mutex_unlock(&bcast.mtx);
+  r->segs[r->count++] = seg;
+  return seg;
+}
+
+void bcast_end(struct bcast_render *r, bool complete)
+{
+  struct bcast_render *old = NULL;
+  unsigned slot = 0;
+  unsigned i;
+
+  if(r == NULL){
+    return;
+  }
+  pthread_mutex_lock(&bcast.mtx);
+  //one segment messages are left to the phrase caches
+  if(!complete || r->count < 2){
+    render_free(r);
+    pthread_mutex_unlock(&bcast.mtx);
+    return;
+  }
+  for(i = 0; i < bcast.keys; ++i){
+    if(bcast.renders[i] == NULL || bcast.renders[i]->key == r->key){
+      slot = i;
+      break;
+    }
+    if(bcast.renders[i]->used < bcast.renders[slot]->used){
+      slot = i;
+    }
+  }
+  old = bcast.renders[slot];
+  r->used = ++bcast.tick;
+  r->last = NULL;
+  bcast.renders[slot] = r;
+  if(old != NULL){
+    render_free(old);
+  }
+  pthread_mutex_unlock(&bcast.mtx);
+}
+
+bool bcast_get(struct bcast_seg *seg, struct pcm_buf *out)
+{
+  bool res = false;
+  if(seg == NULL){
+    return false;
+  }
+  pthread_mutex_lock(&bcast.mtx);
+  if(seg->ready){
+    out->info = seg->pcm.info;
+    out->len = seg->pcm.len;
+    out->data = (uint8_t *)malloc(seg->pcm.len ? seg->pcm.len : 1);
+    if(out->data != NULL){
+      memcpy(out->data, seg->pcm.data, seg->pcm.len);
+      bcast.stats.reused += 1;
+      res = true;
+    }
+  }
+  pthread_mutex_unlock(&bcast.mtx);
+  return res;
+}
+
+void bcast_put(struct bcast_seg *seg, const struct pcm_buf *pcm)
+{
+  uint8_t *data;
+  if(seg == NULL){
+    return;
+  }
+  data = (uint8_t *)malloc(pcm->len ? pcm->len : 1);
+  if(data == NULL){
+    return;
+  }
+  memcpy(data, pcm->data, pcm->len);
+  pthread_mutex_lock(&bcast.mtx);
+  bcast.stats.rendered += 1;
+  //a segment carried over while still in synthesis may be rendered twice
+  if(!seg->ready){
+    seg->pcm.info = pcm->info;
+    seg->pcm.len = pcm->len;
+    seg->pcm.data = data;
+    seg->ready = true;
+    data = NULL;
+  }
+  pthread_mutex_unlock(&bcast.mtx);
+  free(data);
+}
+
+void bcast_release(struct bcast_seg *seg)
+{
+  if(seg == NULL){
+    return;
+  }
+  pthread_mutex_lock(&bcast.mtx);
+  seg_unref(seg);
+  pthread_mutex_unlock(&bcast.mtx);
+}
+
+void bcast_get_stats(struct bcast_stats *st)
+{
+  unsigned i;
+  memset(st, 0, sizeof(*st));
+  if(!bcast.ready){
+    return;
+  }
+  pthread_mutex_lock(&bcast.mtx);
+  *st = bcast.stats;
+  st->renders = 0;
+  for(i = 0; i < bcast.keys; ++i){
+    st->renders += bcast.renders[i] != NULL;
+  }
+  pthread_mutex_unlock(&bcast.mtx);
+}
@@ -0,0 +1,43 @@
+#ifndef BCAST__H
+#define BCAST__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcm.h"
+
+struct bcast_stats {
+  unsigned long reused;   //segments played from the last rendering
+  unsigned long rendered; //segments that had to be synthesized
+  size_t renders;         //long messages kept
+};
+
+//Audio of one segment, shared by the renderings it appears in
+struct bcast_seg;
+//A rendering being built, see bcast_begin()
+struct bcast_render;
+
+//Keeps the last rendering of up to keys long messages, 0 turns it off
+void bcast_init(unsigned keys);
+void bcast_close(void);
+
+/*
+ * Rendering a message with the same key as an earlier one: each segment
+ * added gets the audio of an unchanged segment of the last rendering, or a
+ * new empty one to fill. bcast_end() replaces the last rendering if the
+ * message was complete. Single threaded; NULL renders and segments are
+ * no-ops, so callers need no checks.
+ */
+struct bcast_render *bcast_begin(uint64_t key);
+//The caller gets a reference to release
+struct bcast_seg *bcast_add(struct bcast_render *r, const char *text);
+void bcast_end(struct bcast_render *r, bool complete);
+
+//Copies the audio of seg, false if it isn't rendered yet
+bool bcast_get(struct bcast_seg *seg, struct pcm_buf *out);
+void bcast_put(struct bcast_seg *seg, const struct pcm_buf *pcm);
+void bcast_release(struct bcast_seg *seg);
+void bcast_get_stats(struct bcast_stats *st);
+
+#endif
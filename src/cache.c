@@ -0,0 +1,299 @@
+/******************************************************************************
+Bounded LRU cache of synthesized PCM, keyed by normalized text and voice
+******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "utils.h"
+
+#define CACHE_BUCKETS 1024
+
+struct cache_entry {
+  uint64_t key;
+  char *text; //normalized
+  struct pcm_buf pcm;
+  size_t cost;
+  struct cache_entry *next; //bucket chain
+  struct cache_entry *lru_prev;
+  struct cache_entry *lru_next;
+};
+
+static struct {
+  bool ready;
+  size_t budget;
+  struct cache_entry *buckets[CACHE_BUCKETS];
+  struct cache_entry *lru_head; //most recently used
+  struct cache_entry *lru_tail;
+  struct cache_stats stats;
+  pthread_mutex_t mtx;
+} cache;
+
+//Walks text with whitespace runs collapsed and both ends trimmed
+struct norm_iter {
+  const char *p;
+};
+
+static void norm_begin(struct norm_iter *it, const char *text)
+{
+  it->p = text;
+  while(*it->p && isspace((unsigned char)*it->p)){
+    ++it->p;
+  }
+}
+
+static int norm_next(struct norm_iter *it)
+{
+  if(*it->p == '\0'){
+    return -1;
+  }
+  if(isspace((unsigned char)*it->p)){
+    while(*it->p && isspace((unsigned char)*it->p)){
+      ++it->p;
+    }
+    if(*it->p == '\0'){
+      return -1;
+    }
+    return ' ';
+  }
+  return (unsigned char)*it->p++;
+}
+
+char *cache_norm_dup(const char *text)
+{
+  struct norm_iter it;
+  size_t len = 0;
+  char *res = (char *)malloc(strlen(text) + 1);
+  int c;
+  if(res == NULL){
+    return NULL;
+  }
+  norm_begin(&it, text);
+  while((c = norm_next(&it)) >= 0){
+    res[len++] = (char)c;
+  }
+  res[len] = '\0';
+  return res;
+}
+
+bool cache_norm_equal(const char *norm, const char *text)
+{
+  struct norm_iter it;
+  int c;
+  norm_begin(&it, text);
+  while((c = norm_next(&it)) >= 0){
+    if(*norm++ != (char)c){
+      return false;
+    }
+  }
+  return *norm == '\0';
+}
+
+//voice identifies whatever else shapes the audio, e.g. the Piper command
+uint64_t cache_key(uint64_t voice, const char *text)
+{
+  struct norm_iter it;
+  uint64_t h = voice;
+  int c;
+  norm_begin(&it, text);
+  while((c = norm_next(&it)) >= 0){
+    uint8_t b = (uint8_t)c;
+    h = fnv1a64(h, &b, 1);
+  }
+  return h;
+}
+
+static void lru_unlink(struct cache_entry *e)
+{
+  if(e->lru_prev != NULL){
+    e->lru_prev->lru_next = e->lru_next;
+  }else{
+    cache.lru_head = e->lru_next;
+  }
+  if(e->lru_next != NULL){
+    e->lru_next->lru_prev = e->lru_prev;
+  }else{
+    cache.lru_tail = e->lru_prev;
+  }
+  e->lru_prev = NULL;
+  e->lru_next = NULL;
+}
+
+static void lru_push_front(struct cache_entry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = cache.lru_head;
+  if(cache.lru_head != NULL){
+    cache.lru_head->lru_prev = e;
+  }
+  cache.lru_head = e;
+  if(cache.lru_tail == NULL){
+    cache.lru_tail = e;
+  }
+}
+
+static void entry_free(struct cache_entry *e)
+{
+  pcm_free(&e->pcm);
+  free(e->text);
+  free(e);
+}
+
+static void entry_remove(struct cache_entry *e)
+{
+  struct cache_entry **pp = &cache.buckets[e->key % CACHE_BUCKETS];
+  while(*pp != NULL && *pp != e){
+    pp = &(*pp)->next;
+  }
+  if(*pp == e){
+    *pp = e->next;
+  }
+  lru_unlink(e);
+  cache.stats.entries -= 1;
+  cache.stats.bytes -= e->cost;
+  entry_free(e);
+}
+
+static struct cache_entry *entry_find(uint64_t key, const char *text)
+{
+  struct cache_entry *e;
+  for(e = cache.buckets[key % CACHE_BUCKETS]; e != NULL; e = e->next){
+    if(e->key == key && cache_norm_equal(e->text, text)){
+      return e;
+    }
+  }
+  return NULL;
+}
+
+bool cache_init(size_t budget)
+{
+  if(cache.ready){
+    return true;
+  }
+  memset(&cache.buckets, 0, sizeof(cache.buckets));
+  memset(&cache.stats, 0, sizeof(cache.stats));
+  cache.lru_head = NULL;
+  cache.lru_tail = NULL;
+  cache.budget = budget;
+  cache.stats.budget = budget;
+  if(budget == 0){
+    return false;
+  }
+  pthread_mutex_init(&cache.mtx, NULL);
+  cache.ready = true;
+  return true;
+}
+
+void cache_close(void)
+{
+  if(!cache.ready){
+    return;
+  }
+  cache.ready = false;
+  while(cache.lru_head != NULL){
+    entry_remove(cache.lru_head);
+  }
+  pthread_mutex_destroy(&cache.mtx);
+}
+
+bool cache_get(uint64_t key, const char *text, struct pcm_buf *out)
+{
+  struct cache_entry *e;
+  bool res = false;
+
+  if(!cache.ready){
+    return false;
+  }
+  pthread_mutex_lock(&cache.mtx);
+  e = entry_find(key, text);
+  if(e != NULL){
+    out->info = e->pcm.info;
+    out->len = e->pcm.len;
+    out->data = (uint8_t *)malloc(e->pcm.len ? e->pcm.len : 1);
+    if(out->data != NULL){
+      memcpy(out->data, e->pcm.data, e->pcm.len);
+      lru_unlink(e);
+      lru_push_front(e);
+      cache.stats.hits += 1;
+      res = true;
+    }
+  }else{
+    cache.stats.misses += 1;
+  }
+  pthread_mutex_unlock(&cache.mtx);
+  return res;
+}
+
+bool cache_has(uint64_t key, const char *text)
+{
+  bool res;
+  if(!cache.ready){
+    return false;
+  }
+  pthread_mutex_lock(&cache.mtx);
+  res = entry_find(key, text) != NULL;
+  pthread_mutex_unlock(&cache.mtx);
+  return res;
+}
+
+void cache_put(uint64_t key, const char *text, const struct pcm_buf *pcm)
+{
+  struct cache_entry *e;
+  size_t cost;
+
+  if(!cache.ready || pcm == NULL || pcm->len == 0){
+    return;
+  }
+  cost = pcm->len + strlen(text) + sizeof(*e);
+  if(cost > cache.budget){
+    return;
+  }
+
+  e = (struct cache_entry *)calloc(1, sizeof(*e));
+  if(e == NULL){
+    return;
+  }
+  e->key = key;
+  e->text = cache_norm_dup(text);
+  e->pcm.info = pcm->info;
+  e->pcm.len = pcm->len;
+  e->pcm.data = (uint8_t *)malloc(pcm->len);
+  e->cost = cost;
+  if(e->text == NULL || e->pcm.data == NULL){
+    entry_free(e);
+    return;
+  }
+  memcpy(e->pcm.data, pcm->data, pcm->len);
+
+  pthread_mutex_lock(&cache.mtx);
+  {
+    struct cache_entry *old = entry_find(key, text);
+    if(old != NULL){
+      entry_remove(old);
+    }
+  }
+  while(cache.stats.bytes + cost > cache.budget && cache.lru_tail != NULL){
+    entry_remove(cache.lru_tail);
+    cache.stats.evictions += 1;
+  }
+  e->next = cache.buckets[key % CACHE_BUCKETS];
+  cache.buckets[key % CACHE_BUCKETS] = e;
+  lru_push_front(e);
+  cache.stats.entries += 1;
+  cache.stats.bytes += cost;
+  pthread_mutex_unlock(&cache.mtx);
+}
+
+void cache_get_stats(struct cache_stats *st)
+{
+  if(!cache.ready){
+    memset(st, 0, sizeof(*st));
+    st->budget = cache.budget;
+    return;
+  }
+  pthread_mutex_lock(&cache.mtx);
+  *st = cache.stats;
+  pthread_mutex_unlock(&cache.mtx);
+}
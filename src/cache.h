@@ -0,0 +1,32 @@
+#ifndef CACHE__H
+#define CACHE__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcm.h"
+
+struct cache_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  size_t entries;
+  size_t bytes;
+  size_t budget;
+};
+
+bool cache_init(size_t budget);
+void cache_close(void);
+
+uint64_t cache_key(uint64_t voice, const char *text);
+//Text with whitespace runs collapsed and both ends trimmed, as keyed
+char *cache_norm_dup(const char *text);
+bool cache_norm_equal(const char *norm, const char *text);
+bool cache_get(uint64_t key, const char *text, struct pcm_buf *out);
+//Like cache_get() without the copy, the LRU order or the stats
+bool cache_has(uint64_t key, const char *text);
+void cache_put(uint64_t key, const char *text, const struct pcm_buf *pcm);
+void cache_get_stats(struct cache_stats *st);
+
+#endif
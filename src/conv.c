@@ -0,0 +1,589 @@
+/******************************************************************************
+Sample format, channel and rate conversion towards the fixed output format
+******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+  #define CONV_X86 1
+#endif
+
+#include "conv.h"
+
+/*
+ * Resampling is a windowed sinc polyphase filter: CONV_PHASES rows of
+ * CONV_TAPS coefficients, the output sample interpolated between the two
+ * rows around its fractional position. Positions advance in 32.32 fixed
+ * point, so any pair of rates works without reducing their ratio. Planes
+ * handed to the resampler carry CONV_HALF zero samples on both sides.
+ */
+#define CONV_TAPS 32
+#define CONV_HALF (CONV_TAPS / 2)
+#define CONV_PHASES 256
+#define CONV_BANKS 4
+#define CONV_KAISER_BETA 8.0
+//Cutoff relative to the lower Nyquist frequency
+#define CONV_ROLLOFF 0.92
+
+struct conv_kernels {
+  const char *name;
+  void (*s16_to_f32)(const int16_t *in, float *out, size_t n);
+  void (*f32_to_s16)(const float *in, int16_t *out, size_t n);
+  void (*resample)(const float *in, float *out, size_t out_len, uint64_t step, const float *coef);
+};
+
+struct conv_bank {
+  uint32_t in_rate;
+  uint32_t out_rate;
+  float *coef; //CONV_PHASES + 1 rows
+};
+
+static struct conv_bank banks[CONV_BANKS];
+static int bank_count = 0;
+static pthread_mutex_t bank_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static const struct conv_kernels *kern = NULL;
+
+static void s16_to_f32_scalar(const int16_t *in, float *out, size_t n)
+{
+  size_t i;
+  for(i = 0; i < n; ++i){
+    out[i] = in[i] * (1.0f / 32768.0f);
+  }
+}
+
+static void f32_to_s16_scalar(const float *in, int16_t *out, size_t n)
+{
+  size_t i;
+  for(i = 0; i < n; ++i){
+    float v = in[i];
+    v = v > 1.0f ? 1.0f : (v < -1.0f ? -1.0f : v);
+    v *= 32767.0f;
+    out[i] = (int16_t)(v >= 0.0f ? v + 0.5f : v - 0.5f);
+  }
+}
+
+static void resample_scalar(const float *in, float *out, size_t out_len, uint64_t step, const float *coef)
+{
+  uint64_t t = 0;
+  size_t j;
+  int k;
+  for(j = 0; j < out_len; ++j, t += step){
+    const float *x = in + (t >> 32) - (CONV_HALF - 1);
+    const float *a = coef + (((unsigned)(t >> 24) & (CONV_PHASES - 1)) * CONV_TAPS);
+    const float *b = a + CONV_TAPS;
+    float frac = (float)(t & 0xFFFFFF) * (1.0f / 16777216.0f);
+    float da = 0.0f;
+    float db = 0.0f;
+    for(k = 0; k < CONV_TAPS; ++k){
+      da += x[k] * a[k];
+      db += x[k] * b[k];
+    }
+    out[j] = da + frac * (db - da);
+  }
+}
+
+static const struct conv_kernels kernels_scalar = {
+  "scalar", s16_to_f32_scalar, f32_to_s16_scalar, resample_scalar
+};
+
+#ifdef CONV_X86
+__attribute__((target("sse2")))
+static void s16_to_f32_sse2(const int16_t *in, float *out, size_t n)
+{
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8){
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+  s16_to_f32_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void f32_to_s16_sse2(const float *in, int16_t *out, size_t n)
+{
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 minus_one = _mm_set1_ps(-1.0f);
+  const __m128 scale = _mm_set1_ps(32767.0f);
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8){
+    __m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), minus_one), one);
+    __m128 b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i + 4), minus_one), one);
+    __m128i ia = _mm_cvtps_epi32(_mm_mul_ps(a, scale));
+    __m128i ib = _mm_cvtps_epi32(_mm_mul_ps(b, scale));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(ia, ib));
+  }
+  f32_to_s16_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static float hsum_sse2(__m128 v)
+{
+  __m128 sh = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+  v = _mm_add_ps(v, sh);
+  sh = _mm_movehl_ps(sh, v);
+  v = _mm_add_ss(v, sh);
+  return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2")))
+static void resample_sse2(const float *in, float *out, size_t out_len, uint64_t step, const float *coef)
+{
+  uint64_t t = 0;
+  size_t j;
+  int k;
+  for(j = 0; j < out_len; ++j, t += step){
+    const float *x = in + (t >> 32) - (CONV_HALF - 1);
+    const float *a = coef + (((unsigned)(t >> 24) & (CONV_PHASES - 1)) * CONV_TAPS);
+    const float *b = a + CONV_TAPS;
+    float frac = (float)(t & 0xFFFFFF) * (1.0f / 16777216.0f);
+    __m128 va = _mm_setzero_ps();
+    __m128 vb = _mm_setzero_ps();
+    float da, db;
+    for(k = 0; k < CONV_TAPS; k += 4){
+      __m128 vx = _mm_loadu_ps(x + k);
+      va = _mm_add_ps(va, _mm_mul_ps(vx, _mm_load_ps(a + k)));
+      vb = _mm_add_ps(vb, _mm_mul_ps(vx, _mm_load_ps(b + k)));
+    }
+    da = hsum_sse2(va);
+    db = hsum_sse2(vb);
+    out[j] = da + frac * (db - da);
+  }
+}
+
+static const struct conv_kernels kernels_sse2 = {
+  "sse2", s16_to_f32_sse2, f32_to_s16_sse2, resample_sse2
+};
+
+__attribute__((target("avx2,fma")))
+static void s16_to_f32_avx2(const int16_t *in, float *out, size_t n)
+{
+  const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8){
+    __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+  s16_to_f32_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void f32_to_s16_avx2(const float *in, int16_t *out, size_t n)
+{
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 minus_one = _mm256_set1_ps(-1.0f);
+  const __m256 scale = _mm256_set1_ps(32767.0f);
+  size_t i = 0;
+  for(; i + 16 <= n; i += 16){
+    __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i), minus_one), one);
+    __m256 b = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i + 8), minus_one), one);
+    __m256i ia = _mm256_cvtps_epi32(_mm256_mul_ps(a, scale));
+    __m256i ib = _mm256_cvtps_epi32(_mm256_mul_ps(b, scale));
+    //packs works per 128 bit lane, put the quadwords back in order
+    __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(ia, ib), 0xD8);
+    _mm256_storeu_si256((__m256i *)(out + i), p);
+  }
+  f32_to_s16_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void resample_avx2(const float *in, float *out, size_t out_len, uint64_t step, const float *coef)
+{
+  uint64_t t = 0;
+  size_t j;
+  int k;
+  for(j = 0; j < out_len; ++j, t += step){
+    const float *x = in + (t >> 32) - (CONV_HALF - 1);
+    const float *a = coef + (((unsigned)(t >> 24) & (CONV_PHASES - 1)) * CONV_TAPS);
+    const float *b = a + CONV_TAPS;
+    __m256 frac = _mm256_set1_ps((float)(t & 0xFFFFFF) * (1.0f / 16777216.0f));
+    __m256 va = _mm256_setzero_ps();
+    __m256 vb = _mm256_setzero_ps();
+    __m256 v;
+    __m128 s;
+    for(k = 0; k < CONV_TAPS; k += 8){
+      __m256 vx = _mm256_loadu_ps(x + k);
+      va = _mm256_fmadd_ps(vx, _mm256_load_ps(a + k), va);
+      vb = _mm256_fmadd_ps(vx, _mm256_load_ps(b + k), vb);
+    }
+    //interpolating the sums equals interpolating the rows
+    v = _mm256_fmadd_ps(frac, _mm256_sub_ps(vb, va), va);
+    s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    out[j] = _mm_cvtss_f32(s);
+  }
+}
+
+static const struct conv_kernels kernels_avx2 = {
+  "avx2", s16_to_f32_avx2, f32_to_s16_avx2, resample_avx2
+};
+#endif
+
+static void kernels_pick(void)
+{
+  kern = &kernels_scalar;
+#ifdef CONV_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+    kern = &kernels_avx2;
+  }else if(__builtin_cpu_supports("sse2")){
+    kern = &kernels_sse2;
+  }
+#endif
+}
+
+const char *conv_kernel_name(void)
+{
+  pthread_once(&kernels_once, kernels_pick);
+  return kern->name;
+}
+
+static double bessel_i0(double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  int k;
+  for(k = 1; k < 64; ++k){
+    double q = x / (2.0 * k);
+    term *= q * q;
+    sum += term;
+    if(term < sum * 1e-12){
+      break;
+    }
+  }
+  return sum;
+}
+
+static float *bank_make(uint32_t in_rate, uint32_t out_rate)
+{
+  double fc = 0.5 * CONV_ROLLOFF * (out_rate < in_rate ? (double)out_rate / in_rate : 1.0);
+  double norm = bessel_i0(CONV_KAISER_BETA);
+  float *coef = (float *)aligned_alloc(32, (CONV_PHASES + 1) * CONV_TAPS * sizeof(float));
+  int p, k;
+  if(coef == NULL){
+    return NULL;
+  }
+  for(p = 0; p <= CONV_PHASES; ++p){
+    float *row = coef + p * CONV_TAPS;
+    double d = (double)p / CONV_PHASES;
+    double sum = 0.0;
+    for(k = 0; k < CONV_TAPS; ++k){
+      double x = k - (CONV_HALF - 1) - d;
+      double r = x / CONV_HALF;
+      double w = r * r < 1.0 ? bessel_i0(CONV_KAISER_BETA * sqrt(1.0 - r * r)) / norm : 0.0;
+      double s = x == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * x) / (M_PI * x);
+      row[k] = (float)(s * w);
+      sum += s * w;
+    }
+    //unity DC gain in every phase
+    for(k = 0; k < CONV_TAPS; ++k){
+      row[k] = (float)(row[k] / sum);
+    }
+  }
+  return coef;
+}
+
+//Banks are built once per rate pair and kept until conv_close(). Once the
+//table is full, further pairs get a private bank the caller has to free.
+static float *bank_get(uint32_t in_rate, uint32_t out_rate, bool *owned)
+{
+  float *res = NULL;
+  int i;
+  *owned = false;
+  pthread_mutex_lock(&bank_mtx);
+  for(i = 0; i < bank_count; ++i){
+    if(banks[i].in_rate == in_rate && banks[i].out_rate == out_rate){
+      res = banks[i].coef;
+      break;
+    }
+  }
+  if(res == NULL){
+    res = bank_make(in_rate, out_rate);
+    if(res != NULL && bank_count < CONV_BANKS){
+      banks[bank_count].in_rate = in_rate;
+      banks[bank_count].out_rate = out_rate;
+      banks[bank_count].coef = res;
+      ++bank_count;
+    }else{
+      *owned = true;
+    }
+  }
+  pthread_mutex_unlock(&bank_mtx);
+  return res;
+}
+
+//Decodes sample idx of the interleaved payload
+static float sample_at(const struct pcm_buf *pcm, size_t idx)
+{
+  const uint8_t *p = pcm->data;
+  if(pcm->info.format == 3){
+    float v;
+    memcpy(&v, p + idx * 4, 4);
+    return v;
+  }
+  switch(pcm->info.bits_per_sample){
+    case 8:
+      return (p[idx] - 128) * (1.0f / 128.0f);
+    case 16:
+      return (int16_t)(p[idx * 2] | (p[idx * 2 + 1] << 8)) * (1.0f / 32768.0f);
+    case 24:
+      return (int32_t)(((uint32_t)p[idx * 3] << 8) | ((uint32_t)p[idx * 3 + 1] << 16) |
+                       ((uint32_t)p[idx * 3 + 2] << 24)) * (1.0f / 2147483648.0f);
+    default:
+      return (int32_t)((uint32_t)p[idx * 4] | ((uint32_t)p[idx * 4 + 1] << 8) |
+                       ((uint32_t)p[idx * 4 + 2] << 16) | ((uint32_t)p[idx * 4 + 3] << 24)) *
+             (1.0f / 2147483648.0f);
+  }
+}
+
+static bool format_supported(const struct wav_info *info)
+{
+  if(info->format == 3){
+    return info->bits_per_sample == 32;
+  }
+  return info->format == 1 &&
+         (info->bits_per_sample == 8 || info->bits_per_sample == 16 ||
+          info->bits_per_sample == 24 || info->bits_per_sample == 32);
+}
+
+//Decodes the interleaved payload into mono or per output channel planes
+static void decode_planes(const struct pcm_buf *pcm, float *raw, float *planes, size_t plane_len, unsigned out_ch)
+{
+  unsigned in_ch = pcm->info.channels;
+  size_t frames = plane_len - 2 * CONV_HALF;
+  size_t i;
+  unsigned c;
+
+  if(pcm->info.format == 1 && pcm->info.bits_per_sample == 16){
+    kern->s16_to_f32((const int16_t *)pcm->data, raw, frames * in_ch);
+  }else{
+    for(i = 0; i < frames * in_ch; ++i){
+      raw[i] = sample_at(pcm, i);
+    }
+  }
+  for(c = 0; c < out_ch; ++c){
+    float *plane = planes + c * plane_len + CONV_HALF;
+    if(out_ch == 1 && in_ch > 1){
+      float scale = 1.0f / in_ch;
+      for(i = 0; i < frames; ++i){
+        float sum = 0.0f;
+        unsigned k;
+        for(k = 0; k < in_ch; ++k){
+          sum += raw[i * in_ch + k];
+        }
+        plane[i] = sum * scale;
+      }
+    }else if(in_ch == 1){
+      memcpy(plane, raw, frames * sizeof(float));
+    }else{
+      unsigned src = c % in_ch;
+      for(i = 0; i < frames; ++i){
+        plane[i] = raw[i * in_ch + src];
+      }
+    }
+  }
+}
+
+bool conv_pcm(struct pcm_buf *pcm, const struct wav_info *to)
+{
+  const struct wav_info *from = &pcm->info;
+  unsigned in_ch = from->channels;
+  unsigned out_ch = to->channels;
+  size_t frames, out_frames, plane_len, i;
+  unsigned c;
+  float *raw, *planes, *chan, *mixed;
+  int16_t *res;
+  float *coef = NULL;
+  bool owned = false;
+  uint64_t step;
+
+  if(from->format == 1 && from->bits_per_sample == 16 &&
+     from->sample_rate == to->sample_rate && from->channels == to->channels){
+    return true;
+  }
+  if(!format_supported(from) || in_ch == 0 || out_ch == 0 ||
+     from->sample_rate == 0 || to->sample_rate == 0){
+    return false;
+  }
+  pthread_once(&kernels_once, kernels_pick);
+
+  frames = pcm->len / (in_ch * (from->bits_per_sample / 8));
+  out_frames = (size_t)((uint64_t)frames * to->sample_rate / from->sample_rate);
+  step = ((uint64_t)from->sample_rate << 32) / to->sample_rate;
+  if(from->sample_rate != to->sample_rate){
+    coef = bank_get(from->sample_rate, to->sample_rate, &owned);
+    if(coef == NULL){
+      return false;
+    }
+  }
+
+  plane_len = frames + 2 * CONV_HALF;
+  raw = (float *)malloc(frames * in_ch * sizeof(float) + 1);
+  planes = (float *)calloc(plane_len * out_ch, sizeof(float));
+  chan = (float *)malloc(out_frames * sizeof(float) + 1);
+  mixed = (float *)malloc(out_frames * out_ch * sizeof(float) + 1);
+  res = (int16_t *)malloc(out_frames * out_ch * sizeof(int16_t) + 1);
+  if(raw != NULL && planes != NULL && chan != NULL && mixed != NULL && res != NULL){
+    decode_planes(pcm, raw, planes, plane_len, out_ch);
+    for(c = 0; c < out_ch; ++c){
+      const float *plane = planes + c * plane_len + CONV_HALF;
+      float *dst = out_ch == 1 ? mixed : chan;
+      if(coef != NULL){
+        kern->resample(plane, dst, out_frames, step, coef);
+      }else{
+        memcpy(dst, plane, out_frames * sizeof(float));
+      }
+      if(out_ch > 1){
+        for(i = 0; i < out_frames; ++i){
+          mixed[i * out_ch + c] = chan[i];
+        }
+      }
+    }
+    kern->f32_to_s16(mixed, res, out_frames * out_ch);
+
+    free(pcm->data);
+    pcm->data = (uint8_t *)res;
+    pcm->len = out_frames * out_ch * sizeof(int16_t);
+    pcm->info.format = 1;
+    pcm->info.channels = (uint16_t)out_ch;
+    pcm->info.sample_rate = to->sample_rate;
+    pcm->info.bits_per_sample = 16;
+    res = NULL;
+  }
+  free(raw);
+  free(planes);
+  free(chan);
+  free(mixed);
+  if(owned){
+    free(coef);
+  }
+  if(res != NULL){
+    free(res);
+    return false;
+  }
+  return true;
+}
+
+void conv_close(void)
+{
+  int i;
+  pthread_mutex_lock(&bank_mtx);
+  for(i = 0; i < bank_count; ++i){
+    free(banks[i].coef);
+    banks[i].coef = NULL;
+  }
+  bank_count = 0;
+  pthread_mutex_unlock(&bank_mtx);
+}
+
+#ifdef BENCH_CONV
+/*
+ * Samples per second through every kernel the CPU supports. Build with
+ * "make bench_conv", run "./bench_conv".
+ */
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_SAMPLES (1 << 20)
+#define BENCH_ROUNDS 20
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_print(const char *what, double t0, size_t samples)
+{
+  printf("  %-22s %8.1f Msamples/s\n", what, samples * (double)BENCH_ROUNDS / (bench_now() - t0) / 1e6);
+}
+
+static void bench_resample(const struct conv_kernels *k, const float *plane, float *out,
+                           uint32_t in_rate, uint32_t out_rate)
+{
+  bool owned;
+  float *coef = bank_get(in_rate, out_rate, &owned);
+  size_t out_len = (size_t)((uint64_t)BENCH_SAMPLES * out_rate / in_rate);
+  uint64_t step = ((uint64_t)in_rate << 32) / out_rate;
+  char what[32];
+  double t0;
+  int r;
+  if(coef == NULL){
+    return;
+  }
+  t0 = bench_now();
+  for(r = 0; r < BENCH_ROUNDS; ++r){
+    k->resample(plane, out, out_len, step, coef);
+  }
+  snprintf(what, sizeof(what), "resample %u->%u", in_rate, out_rate);
+  bench_print(what, t0, out_len);
+  if(owned){
+    free(coef);
+  }
+}
+
+static void bench_kernels(const struct conv_kernels *k, const int16_t *s16, float *f32,
+                          int16_t *back, float *plane, float *out)
+{
+  double t0;
+  int r;
+  printf("%s\n", k->name);
+  t0 = bench_now();
+  for(r = 0; r < BENCH_ROUNDS; ++r){
+    k->s16_to_f32(s16, f32, BENCH_SAMPLES);
+  }
+  bench_print("s16 -> f32", t0, BENCH_SAMPLES);
+  t0 = bench_now();
+  for(r = 0; r < BENCH_ROUNDS; ++r){
+    k->f32_to_s16(f32, back, BENCH_SAMPLES);
+  }
+  bench_print("f32 -> s16", t0, BENCH_SAMPLES);
+  bench_resample(k, plane, out, 16000, 22050);
+  bench_resample(k, plane, out, 22050, 16000);
+  bench_resample(k, plane, out, 22050, 48000);
+}
+
+int main(void)
+{
+  int16_t *s16 = (int16_t *)malloc(BENCH_SAMPLES * sizeof(int16_t));
+  int16_t *back = (int16_t *)malloc(BENCH_SAMPLES * sizeof(int16_t));
+  float *f32 = (float *)malloc(BENCH_SAMPLES * sizeof(float));
+  float *plane = (float *)calloc(BENCH_SAMPLES + 2 * CONV_HALF, sizeof(float));
+  float *out = (float *)malloc(BENCH_SAMPLES * 3 * sizeof(float));
+  size_t i;
+
+  if(s16 == NULL || back == NULL || f32 == NULL || plane == NULL || out == NULL){
+    return 1;
+  }
+  for(i = 0; i < BENCH_SAMPLES; ++i){
+    s16[i] = (int16_t)(sin(i * 0.05) * 20000.0);
+    plane[CONV_HALF + i] = s16[i] / 32768.0f;
+  }
+  printf("dispatch picks %s\n", conv_kernel_name());
+  bench_kernels(&kernels_scalar, s16, f32, back, plane + CONV_HALF, out);
+#ifdef CONV_X86
+  if(__builtin_cpu_supports("sse2")){
+    bench_kernels(&kernels_sse2, s16, f32, back, plane + CONV_HALF, out);
+  }
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+    bench_kernels(&kernels_avx2, s16, f32, back, plane + CONV_HALF, out);
+  }
+#endif
+  conv_close();
+  free(s16);
+  free(back);
+  free(f32);
+  free(plane);
+  free(out);
+  return 0;
+}
+#endif
@@ -0,0 +1,15 @@
+#ifndef CONV__H
+#define CONV__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcm.h"
+
+//Converts pcm in place to 16-bit PCM at to->sample_rate and to->channels
+bool conv_pcm(struct pcm_buf *pcm, const struct wav_info *to);
+const char *conv_kernel_name(void);
+void conv_close(void);
+
+#endif
@@ -0,0 +1,267 @@
+/******************************************************************************
+Usage counts of spoken phrases, kept across sessions for cache prewarming
+******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "freq.h"
+#include "cache.h"
+#include "utils.h"
+
+#define FREQ_MAGIC "XLinSpeak phrases 2"
+//Version 1 files counted whole uses
+#define FREQ_MAGIC_1 "XLinSpeak phrases 1"
+//Counts are kept in 1/FREQ_ONE uses, so the decay can round without getting stuck
+#define FREQ_ONE 16
+#define FREQ_BUCKETS 1024
+//Phrases tracked; a new one replaces the least frequent, the oldest of them
+#define FREQ_MAX 4096
+
+struct freq_entry {
+  uint64_t hash;
+  int prio;
+  unsigned long count; //in 1/FREQ_ONE uses
+  unsigned long seen; //freq.tick when last noted, 0 for earlier sessions
+  char *text; //normalized
+  struct freq_entry *next;
+};
+
+static struct {
+  bool ready;
+  char path[PATH_MAX];
+  struct freq_entry *buckets[FREQ_BUCKETS];
+  size_t entries;
+  unsigned long tick;
+  pthread_mutex_t mtx;
+} freq;
+
+static uint64_t freq_hash(int prio, const char *norm)
+{
+  uint64_t h = fnv1a64(FNV1A64_INIT, &prio, sizeof(prio));
+  return fnv1a64(h, norm, strlen(norm));
+}
+
+static struct freq_entry *freq_find(uint64_t hash, int prio, const char *norm)
+{
+  struct freq_entry *e;
+  for(e = freq.buckets[hash % FREQ_BUCKETS]; e != NULL; e = e->next){
+    if(e->hash == hash && e->prio == prio && strcmp(e->text, norm) == 0){
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void freq_evict(void)
+{
+  struct freq_entry **victim = NULL;
+  size_t b;
+  for(b = 0; b < FREQ_BUCKETS; ++b){
+    struct freq_entry **pp;
+    for(pp = &freq.buckets[b]; *pp != NULL; pp = &(*pp)->next){
+      if(victim == NULL || (*pp)->count < (*victim)->count ||
+         ((*pp)->count == (*victim)->count && (*pp)->seen < (*victim)->seen)){
+        victim = pp;
+      }
+    }
+  }
+  if(victim != NULL){
+    struct freq_entry *e = *victim;
+    *victim = e->next;
+    free(e->text);
+    free(e);
+    freq.entries -= 1;
+  }
+}
+
+//Takes ownership of norm
+static void freq_add(int prio, char *norm, unsigned long count, unsigned long seen)
+{
+  uint64_t hash = freq_hash(prio, norm);
+  struct freq_entry *e = freq_find(hash, prio, norm);
+  if(e != NULL){
+    e->count += count;
+    e->seen = seen;
+    free(norm);
+    return;
+  }
+  if(freq.entries == FREQ_MAX){
+    freq_evict();
+  }
+  e = (struct freq_entry *)malloc(sizeof(*e));
+  if(e == NULL){
+    free(norm);
+    return;
+  }
+  e->hash = hash;
+  e->prio = prio;
+  e->count = count;
+  e->seen = seen;
+  e->text = norm;
+  e->next = freq.buckets[hash % FREQ_BUCKETS];
+  freq.buckets[hash % FREQ_BUCKETS] = e;
+  freq.entries += 1;
+}
+
+//"count prio text" per line
+static void freq_load(FILE *f)
+{
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  unsigned long scale = 1;
+  if(getline(&line, &cap, f) < 0){
+    free(line);
+    return;
+  }
+  if(strcmp(line, FREQ_MAGIC_1 "\n") == 0){
+    scale = FREQ_ONE;
+  }else if(strcmp(line, FREQ_MAGIC "\n") != 0){
+    free(line);
+    return;
+  }
+  while((len = getline(&line, &cap, f)) > 0){
+    unsigned long count;
+    int prio;
+    int pos = 0;
+    char *norm;
+    if(line[len - 1] == '\n'){
+      line[len - 1] = '\0';
+    }
+    if(sscanf(line, "%lu %d %n", &count, &prio, &pos) != 2 || pos == 0 ||
+       prio < 0 || prio >= SPEECH_PRIO_COUNT || line[pos] == '\0'){
+      continue;
+    }
+    //older sessions count for less: 1/8 off, rounded up, so a phrase said
+    //once per session settles at 8 uses and one no longer said goes away
+    count *= scale;
+    count -= (count + 7) / 8;
+    if(count == 0){
+      continue;
+    }
+    norm = cache_norm_dup(line + pos);
+    if(norm != NULL){
+      freq_add(prio, norm, count, 0);
+    }
+  }
+  free(line);
+}
+
+bool freq_init(const char *path)
+{
+  FILE *f;
+  if(freq.ready || strlen(path) >= sizeof(freq.path)){
+    return freq.ready;
+  }
+  strcpy(freq.path, path);
+  memset(freq.buckets, 0, sizeof(freq.buckets));
+  freq.entries = 0;
+  freq.tick = 0;
+  f = fopen(path, "r");
+  if(f != NULL){
+    freq_load(f);
+    fclose(f);
+  }
+  pthread_mutex_init(&freq.mtx, NULL);
+  freq.ready = true;
+  return true;
+}
+
+void freq_close(void)
+{
+  char tmp[PATH_MAX + 8];
+  FILE *f;
+  size_t b;
+
+  if(!freq.ready){
+    return;
+  }
+  freq.ready = false;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", freq.path);
+  f = fopen(tmp, "w");
+  if(f != NULL){
+    fputs(FREQ_MAGIC "\n", f);
+  }
+  for(b = 0; b < FREQ_BUCKETS; ++b){
+    while(freq.buckets[b] != NULL){
+      struct freq_entry *e = freq.buckets[b];
+      freq.buckets[b] = e->next;
+      if(f != NULL && e->count > 0){
+        fprintf(f, "%lu %d %s\n", e->count, e->prio, e->text);
+      }
+      free(e->text);
+      free(e);
+    }
+  }
+  freq.entries = 0;
+  if(f != NULL){
+    if(fclose(f) == 0){
+      rename(tmp, freq.path);
+    }else{
+      xcDebug("XLinSpeak: Couldn't save %s.\n", freq.path);
+      remove(tmp);
+    }
+  }
+  pthread_mutex_destroy(&freq.mtx);
+}
+
+void freq_note(int prio, const char *text)
+{
+  char *norm;
+  if(!freq.ready){
+    return;
+  }
+  norm = cache_norm_dup(text);
+  if(norm == NULL || *norm == '\0'){
+    free(norm);
+    return;
+  }
+  pthread_mutex_lock(&freq.mtx);
+  freq_add(prio, norm, FREQ_ONE, ++freq.tick);
+  pthread_mutex_unlock(&freq.mtx);
+}
+
+static int freq_cmp(const void *a, const void *b)
+{
+  const struct freq_entry *x = *(const struct freq_entry *const *)a;
+  const struct freq_entry *y = *(const struct freq_entry *const *)b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+size_t freq_top(struct freq_phrase out[], size_t max, unsigned long min_count)
+{
+  struct freq_entry **all;
+  size_t b, n = 0, i, res = 0;
+
+  if(!freq.ready){
+    return 0;
+  }
+  pthread_mutex_lock(&freq.mtx);
+  all = (struct freq_entry **)malloc((freq.entries + 1) * sizeof(*all));
+  if(all != NULL){
+    struct freq_entry *e;
+    for(b = 0; b < FREQ_BUCKETS; ++b){
+      for(e = freq.buckets[b]; e != NULL; e = e->next){
+        if(e->count >= min_count * FREQ_ONE){
+          all[n++] = e;
+        }
+      }
+    }
+    qsort(all, n, sizeof(*all), freq_cmp);
+    for(i = 0; i < n && res < max; ++i){
+      out[res].text = strdup(all[i]->text);
+      if(out[res].text == NULL){
+        break;
+      }
+      out[res].prio = all[i]->prio;
+      out[res].count = all[i]->count / FREQ_ONE;
+      res += 1;
+    }
+    free(all);
+  }
+  pthread_mutex_unlock(&freq.mtx);
+  return res;
+}
@@ -0,0 +1,22 @@
+#ifndef FREQ__H
+#define FREQ__H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct freq_phrase {
+  int prio;
+  unsigned long count; //uses, earlier sessions weighing less
+  char *text; //normalized, owned by the caller
+};
+
+//Loads the counts saved at path by earlier sessions, decayed by 1/8
+bool freq_init(const char *path);
+//Saves the counts back to where they were loaded from
+void freq_close(void);
+
+void freq_note(int prio, const char *text);
+//The most frequent phrases seen at least min_count times, most frequent first
+size_t freq_top(struct freq_phrase out[], size_t max, unsigned long min_count);
+
+#endif
@@ -3,10 +3,24 @@
 #include <stdbool.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <string.h>
 #include "len.h"
 #include "utils.h"
 
-extern uint8_t trampoline1;
+#ifndef MAP_FIXED_NOREPLACE
+  #define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define HOOK_SLOT 128
+#define ARENA_SIZE 4096
+#define ARENA_SLOTS (ARENA_SIZE / HOOK_SLOT)
+#define ARENA_MAX 8
+//Arena placement must leave room for the slot offsets inside the 2 GB reach
+#define NEAR_RANGE 0x7FF00000L
+#define NEAR_STEP 0x100000L
+
+#define PATCH_NEAR 5  //jmp rel32
+#define PATCH_FAR 13  //push rax; mov rax, imm64; push rax; ret
 
 
 const intptr_t mask = (intptr_t)~(4095L);
@@ -37,75 +51,6 @@ bool change_range_prot(void *addr, size_t len, bool wr_prot)
   return res == 0;
 }
 
-extern void *hook1;
-extern void *hook2;
-
-
-int hook_proc(void *proc_addr, int copy_bytes, 
-              void *hook_addr, uint8_t *trampoline)
-{
-  if(proc_addr == NULL){
-    return 1;
-  }
-  uint8_t *proc_start = (uint8_t *)proc_addr;
-  int i;
-  //Copy enough off the function start, so
-  //  we can hook it
-  for(i = 0; i < copy_bytes; ++i){
-    trampoline[i] = proc_start[i];
-  }
-
-  //Make code writeable
-  if(!change_range_prot(proc_addr, copy_bytes, true)){
-    xcDebug("XLinSpeak: Can't unprotect proc range.\n");
-    return -1;
-  }
-#if __x86_64__
-  // "Jump" to the hook
-  // The hook jump sequence looks like this:
-  //   push rax ; will be ballanced later!
-  //   mov rax, hook_addr
-  //   push rax
-  //   ret
-  proc_start[0] = 0x50; //push rax
-  proc_start[1] = 0x48; //mov rax, imm64
-  proc_start[2] = 0xb8;
-  *(uint64_t *)(&proc_start[3]) = (uint64_t)hook_addr;
-  proc_start[11] = 0x50; //push rax
-  proc_start[12] = 0xC3; //ret
-
-  intptr_t tmp = (intptr_t)proc_start + i;
-  // Trampoline has the following layout:
-  //   ... ;instructions copied from the begining
-  //       ; of the hooked functions
-  //   push low_dword(func_rest) ; but actually 
-  //                             ;pushes 8 bytes!
-  //   mov [esp + 4] high_dword(func_rest)
-  //   ret
-  trampoline[i] = 0x68; //push ...
-  *(uint32_t *)(&trampoline[i + 1]) = tmp & 0xFFFFFFFF;
-  *(uint32_t *)(&trampoline[i + 5]) = 0x042444C7; //mov ...
-  *(uint32_t *)(&trampoline[i + 9]) = tmp >> 32;
-  trampoline[i + 13] = 0xC3; //ret
-
-  return i + 14;
-#else
-  // "Jump" to the hook
-  // Need 6 bytes...
-  proc_start[0] = 0xE9; //jump rel addr32
-  *(uint32_t *)(&proc_start[1]) = (uint32_t)hook_addr - (uint32_t)proc_start - 5;
-  //Make code read only again
-  if(!change_range_prot(proc_addr, 5, false)){
-    xcDebug("XLinSpeak: Can't reprotect proc range.\n");
-    return -1;
-  }
-
-  trampoline[i] = 0xE9;
-  *(uint32_t *)(&trampoline[i + 1]) = ((uint32_t)proc_start + i) - (uint32_t)&trampoline[i + 5];
-  return i + 5;
-#endif
-}
-
 void kuk0(void *this, char **str, int dummy1, int dummy2)
 {
   (void) this;
@@ -119,51 +64,219 @@ void kuk0(void *this, char **str, int dummy1, int dummy2)
 void kuk1(void *this, char **str, int type, int i)
 {
   (void) this;
-  (void) str;
-  (void) type;
   (void) i;
   //xcDebug("XLinSpeak: %s\n", *str);
-  speech_say(*str);
+  speech_say_typed(*str, SPEECH_SRC_RADIO, type);
+}
+
+static char *libcxx_string(char *str)
+{
+  //Different functions pass different style strings
+  if(*(uint8_t*)str & 1){
+    return *(char **)(str+16);
+  }
+  return str + 1;
 }
 
 //Mimicks XP11's spch_class::SPEECH_speakstring(std::__1::basic_string<char, std::__1::char_traits<char>, std::__1::allocator<char> >, speech_type, int)
-// and XP12's spch_class::SPEECH_synth_non_radio(std::__1::basic_string<char, std::__1::char_traits<char>, std::__1::allocator<char> >, speech_type, int)
 void kuk2(void *this, char *str, int type, int i)
 {
   (void) this;
-  (void) str;
-  (void) type;
   (void) i;
 
-  char *ptr;
-  //Different functions pass different style strings
-  if(*(uint8_t*)str & 1){
-    ptr = *(char **)(str+16);
-  }else{
-    ptr = str + 1;
-  }
+  char *ptr = libcxx_string(str);
   //xcDebug("XLinSpeak: >>>%s<<<\n", ptr);
-  speech_say(ptr);
+  speech_say_typed(ptr, SPEECH_SRC_RADIO, type);
 }
 
-int get_hook_space(void *ptr)
+//Mimicks XP12's spch_class::SPEECH_synth_non_radio(std::__1::basic_string<char, std::__1::char_traits<char>, std::__1::allocator<char> >, speech_type, int)
+void kuk3(void *this, char *str, int type, int i)
 {
-  int safe;
+  (void) this;
+  (void) i;
+
+  char *ptr = libcxx_string(str);
+  speech_say_typed(ptr, SPEECH_SRC_NON_RADIO, type);
+}
+
+//Indexed by the hook id from ptrs[], each thunk calls through its own entry
+static void *hook_handlers[] = {
+  (void *)kuk1,
+  (void *)kuk2,
+  (void *)kuk0,
+  (void *)kuk3,
+};
+
+#define HOOK_IDS ((int)(sizeof(hook_handlers) / sizeof(hook_handlers[0])))
+
 #if __x86_64__
-  safe = 13;
-#else
-  safe = 5;
-#endif
+struct arena{
+  uint8_t *base;
+  int used;
+};
+
+static struct arena arenas[ARENA_MAX];
+static int arena_count = 0;
+
+static bool is_near(const uint8_t *a, const uint8_t *b)
+{
+  intptr_t d = (intptr_t)a - (intptr_t)b;
+  return (d < NEAR_RANGE) && (d > -NEAR_RANGE);
+}
+
+//Probes for a free page within rel32 reach of target, outwards from it
+static uint8_t *arena_map_near(uint8_t *target)
+{
+  uintptr_t center = (uintptr_t)target & ~(uintptr_t)(NEAR_STEP - 1);
+  uintptr_t dist;
+  int side;
+  for(dist = NEAR_STEP; dist < (uintptr_t)NEAR_RANGE; dist += NEAR_STEP){
+    for(side = 0; side < 2; ++side){
+      uintptr_t hint;
+      void *p;
+      if(side == 0){
+        if(center < dist + NEAR_STEP){
+          continue;
+        }
+        hint = center - dist;
+      }else{
+        hint = center + dist;
+      }
+      p = mmap((void *)hint, ARENA_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+      if(p == MAP_FAILED){
+        continue;
+      }
+      if(is_near((uint8_t *)p, target) && is_near((uint8_t *)p + ARENA_SIZE, target)){
+        return (uint8_t *)p;
+      }
+      //kernels without MAP_FIXED_NOREPLACE take the address as a mere hint
+      munmap(p, ARENA_SIZE);
+    }
+  }
+  return NULL;
+}
+
+//Returns a writable slot, near tells whether it is within rel32 reach of target
+static uint8_t *slot_alloc(uint8_t *target, bool *near)
+{
+  struct arena *a = NULL;
+  int i;
+  for(i = 0; i < arena_count; ++i){
+    if((arenas[i].used < ARENA_SLOTS) &&
+       is_near(arenas[i].base, target) && is_near(arenas[i].base + ARENA_SIZE, target)){
+      a = &arenas[i];
+      break;
+    }
+  }
+  if(a != NULL){
+    //Thunks of earlier hooks in this page are live, so it stays executable
+    //while the new slot is written
+    if(mprotect(a->base, ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC) != 0){
+      xcDebug("XLinSpeak: Can't unprotect hook arena (%d).\n", errno);
+      return NULL;
+    }
+    *near = true;
+    return a->base + HOOK_SLOT * a->used++;
+  }
+  if(arena_count == ARENA_MAX){
+    xcDebug("XLinSpeak: Out of hook arenas.\n");
+    return NULL;
+  }
+  uint8_t *base = arena_map_near(target);
+  *near = (base != NULL);
+  if(base == NULL){
+    xcDebug("XLinSpeak: No free page within 2GB of %p, using a far hook.\n", (void *)target);
+    void *p = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED){
+      xcDebug("XLinSpeak: Can't allocate hook arena (%d).\n", errno);
+      return NULL;
+    }
+    base = (uint8_t *)p;
+  }
+  a = &arenas[arena_count++];
+  a->base = base;
+  a->used = 1;
+  return base;
+}
+
+static void slot_seal(uint8_t *slot)
+{
+  if(mprotect(get_page_start(slot), ARENA_SIZE, PROT_READ | PROT_EXEC) != 0){
+    xcDebug("XLinSpeak: Can't protect hook arena (%d).\n", errno);
+  }
+}
+
+//Emits an absolute or rel32 jump, returns its length
+static int emit_jump(uint8_t *at, uint8_t *to, bool near)
+{
+  if(near){
+    int32_t rel = (int32_t)((intptr_t)to - (intptr_t)(at + 5));
+    at[0] = 0xE9; //jmp rel32
+    memcpy(at + 1, &rel, 4);
+    return 5;
+  }
+  uint64_t abs = (uint64_t)(uintptr_t)to;
+  at[0] = 0xFF; //jmp [rip + 0]
+  at[1] = 0x25;
+  memset(at + 2, 0, 4);
+  memcpy(at + 6, &abs, 8);
+  return 14;
+}
+
+/*
+ * Slot layout:
+ *   pop rax                 ; entry of the far patch, which pushed rax
+ *   thunk:                  ; entry of the near patch
+ *     push rdi .. r11, rax  ; 9 pushes keep the ABI stack alignment
+ *     mov rax, &hook_handlers[id]
+ *     call [rax]
+ *     pop rax, r11 .. rdi
+ *     jmp trampoline
+ *   trampoline:
+ *     ...                   ; instructions displaced by the patch
+ *     jmp proc + copy
+ */
+static uint8_t *emit_slot(uint8_t *slot, int id, uint8_t *proc, int copy, bool near)
+{
+  static const uint8_t save[] = {0x57, 0x56, 0x52, 0x51, 0x41, 0x50, 0x41, 0x51,
+                                 0x41, 0x52, 0x41, 0x53, 0x50};
+  static const uint8_t restore[] = {0x58, 0x41, 0x5B, 0x41, 0x5A, 0x41, 0x59,
+                                    0x41, 0x58, 0x59, 0x5A, 0x5E, 0x5F};
+  uint64_t handler = (uint64_t)(uintptr_t)&hook_handlers[id];
+  uint8_t *p = slot;
+  uint8_t *thunk;
+  uint8_t *trampoline;
+
+  *p++ = 0x58; //pop rax
+  thunk = p;
+  memcpy(p, save, sizeof(save));
+  p += sizeof(save);
+  *p++ = 0x48; //mov rax, imm64
+  *p++ = 0xB8;
+  memcpy(p, &handler, 8);
+  p += 8;
+  *p++ = 0xFF; //call [rax]
+  *p++ = 0x10;
+  memcpy(p, restore, sizeof(restore));
+  p += sizeof(restore);
+  trampoline = p + 5;
+  p += emit_jump(p, trampoline, true);
+  memcpy(p, proc, copy);
+  p += copy;
+  emit_jump(p, proc + copy, near);
+  return thunk;
+}
+
+//Length of the whole instructions covering at least safe bytes at ptr
+int get_hook_space(void *ptr, int safe)
+{
   uint8_t *current = (uint8_t *)ptr;
   int d = 0;
   int tmp;
   int i;
   do{
-    #if __x86_64__
     tmp = read_instruction64(current);
-    #else
-    tmp = read_instruction32(current);
-    #endif
     xcDebug("XLinSpeak: %p: %d\n", (void*)current, tmp);
     for(i = 0; i < tmp; ++i){
       xcDebug("XLinSpeak:   %02X\n", current[i]);
@@ -178,39 +291,67 @@ int get_hook_space(void *ptr)
   return d;
 }
 
-void *kuk = NULL;
-
 bool hook(void *proceduura, int n)
 {
-  switch(n){
-    case 0:
-      kuk = (void*)kuk1;
-      break;
-    case 1:
-      kuk = (void*)kuk2;
-      break;
-    case 2:
-      kuk = (void*)kuk0;
-      break;
-    default:
-      kuk = NULL;
-      break;
-  }
+  uint8_t *proc = (uint8_t *)proceduura;
+  uint8_t *slot;
+  uint8_t *thunk;
+  bool near;
+  int patch;
+  int copy;
+  int i;
 
-  int copy = get_hook_space(proceduura);
-  if(copy <= 0){
+  if((proc == NULL) || (n < 0) || (n >= HOOK_IDS)){
     return false;
   }
-
-  if(!change_range_prot(&trampoline1, 128, true)){
-    xcDebug("XLinSpeak: Can't unprotect buffer!\n");
+  slot = slot_alloc(proc, &near);
+  if(slot == NULL){
     return false;
   }
+  patch = near ? PATCH_NEAR : PATCH_FAR;
+  copy = get_hook_space(proc, patch);
+  //the slot has room for 32 displaced bytes
+  if((copy <= 0) || (copy > 32)){
+    slot_seal(slot);
+    return false;
+  }
+  thunk = emit_slot(slot, n, proc, copy, near);
+  slot_seal(slot);
 
-  if(hook_proc(proceduura, copy, &hook1, &trampoline1) != 0){
-    return true;
+  //Make code writeable
+  if(!change_range_prot(proc, copy, true)){
+    xcDebug("XLinSpeak: Can't unprotect proc range.\n");
+    return false;
   }
+  if(near){
+    emit_jump(proc, thunk, true);
+  }else{
+    uint64_t abs = (uint64_t)(uintptr_t)slot;
+    proc[0] = 0x50; //push rax, popped again at the slot start
+    proc[1] = 0x48; //mov rax, imm64
+    proc[2] = 0xB8;
+    memcpy(proc + 3, &abs, 8);
+    proc[11] = 0x50; //push rax
+    proc[12] = 0xC3; //ret
+  }
+  for(i = patch; i < copy; ++i){
+    proc[i] = 0xCC; //never executed, the trampoline jumps past them
+  }
+  //Make code read only again
+  if(!change_range_prot(proc, copy, false)){
+    xcDebug("XLinSpeak: Can't reprotect proc range.\n");
+  }
+  xcDebug("XLinSpeak: Hook %d: %p -> %p, %d byte patch.\n", n, (void *)proc, (void *)thunk, patch);
+  return true;
+}
+#else
+//The thunks and patches are x86-64 code
+bool hook(void *proceduura, int n)
+{
+  (void)proceduura;
+  (void)n;
+  (void)hook_handlers;
+  xcDebug("XLinSpeak: Hooking is only implemented for x86-64.\n");
   return false;
 }
-
-
+#endif
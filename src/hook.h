@@ -4,6 +4,7 @@
   #include <stdbool.h>
   
   bool hook(void *proceduura, int n);
+  void speech_set_cache_dir(const char *dir);
   bool speech_init(void);
   void speech_test(void);
   void speech_close(void);
@@ -0,0 +1,524 @@
+/******************************************************************************
+Spells out aviation shorthand (FL350, RWY 27L, 121.5, KJFK) the way it is
+spoken, before text is queued for synthesis
+******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "norm.h"
+#include "norm_lex.h"
+
+//Letter and digit runs one word may consist of
+#define NORM_PARTS 8
+
+struct norm_out {
+  char *buf;
+  size_t len;
+  size_t cap;
+  bool ok;
+};
+
+//A run of letters, or of digits with the . and , between them
+struct norm_part {
+  const char *p;
+  size_t len;
+  bool digits;
+};
+
+//Words around the one being spelled out
+struct norm_ctx {
+  const char *prev; //NULL unless only blanks separate it
+  size_t prev_len;
+  const char *next; //the rest of the text
+  bool mixed_case;
+};
+
+//A four letter word in capitals is only read as an ICAO identifier next to
+//one of these, so callouts like PULL UP or SINK RATE stay words
+static const char *const icao_before[] = {
+  "to", "at", "from", "for", "into", "via", "over", "direct", "destination", "alternate",
+  "leaving", "departing", NULL
+};
+
+static const char *const icao_after[] = {
+  "departure", "approach", "tower", "ground", "center", "centre", "clearance", "delivery",
+  "atis", "information", "airport", "metar", NULL
+};
+
+//A number after these is in degrees, 15C is not runway 15 center
+static const char *const temperature_words[] = {
+  "temperature", "temp", "dewpoint", "point", "dew", NULL
+};
+
+static const char *const digit_words[10] = {
+  "zero", "one", "two", "three", "four", "five", "six", "seven", "eight", "nine"
+};
+
+static const char *const letter_words[26] = {
+  "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel", "india",
+  "juliet", "kilo", "lima", "mike", "november", "oscar", "papa", "quebec", "romeo",
+  "sierra", "tango", "uniform", "victor", "whiskey", "x-ray", "yankee", "zulu"
+};
+
+static void put(struct norm_out *o, const char *s, size_t n)
+{
+  if(!o->ok){
+    return;
+  }
+  if(o->len + n + 1 > o->cap){
+    size_t ncap = o->cap * 2 + n + 1;
+    char *tmp = (char *)realloc(o->buf, ncap);
+    if(tmp == NULL){
+      o->ok = false;
+      return;
+    }
+    o->buf = tmp;
+    o->cap = ncap;
+  }
+  memcpy(o->buf + o->len, s, n);
+  o->len += n;
+  o->buf[o->len] = '\0';
+}
+
+//Words after the first of a spelled out word get a space in front
+static void put_word(struct norm_out *o, const char *s, bool *first)
+{
+  if(!*first){
+    put(o, " ", 1);
+  }
+  put(o, s, strlen(s));
+  *first = false;
+}
+
+static const struct norm_entry *lex_find(const char *word, size_t len, unsigned where)
+{
+  char key[NORM_KEY_MAX + 1];
+  const struct norm_entry *e;
+  bool caps = true;
+  size_t i;
+
+  if(len == 0 || len > NORM_KEY_MAX){
+    return NULL;
+  }
+  for(i = 0; i < len; ++i){
+    caps = caps && !islower((unsigned char)word[i]);
+    key[i] = (char)tolower((unsigned char)word[i]);
+  }
+  e = &norm_lex[norm_hash(key, len, norm_disp[norm_hash(key, len, 0) % NORM_LEX_BUCKETS]) %
+                NORM_LEX_SIZE];
+  if(e->key == NULL || strncmp(e->key, key, len) != 0 || e->key[len] != '\0' ||
+     !(e->flags & where) || ((e->flags & NORM_CAPS) && !caps)){
+    return NULL;
+  }
+  return e;
+}
+
+static bool all_upper(const char *p, size_t len)
+{
+  size_t i;
+  for(i = 0; i < len; ++i){
+    if(!isupper((unsigned char)p[i])){
+      return false;
+    }
+  }
+  return true;
+}
+
+static void put_spelled(struct norm_out *o, const char *p, size_t len, bool *first)
+{
+  size_t i;
+  for(i = 0; i < len; ++i){
+    unsigned char c = (unsigned char)p[i];
+    if(isdigit(c)){
+      put_word(o, digit_words[c - '0'], first);
+    }else if(isupper(c)){
+      put_word(o, letter_words[c - 'A'], first);
+    }else if(c == '.'){
+      put_word(o, "point", first);
+    }
+  }
+}
+
+//Altitudes such as 5000 or 11500 feet read as "one one thousand five hundred"
+static bool put_altitude(struct norm_out *o, const char *p, size_t len, bool *first)
+{
+  unsigned long val = 0;
+  size_t i, digits = 0;
+  for(i = 0; i < len; ++i){
+    if(p[i] == '.' || p[i] == ':'){
+      return false;
+    }
+    if(p[i] != ','){
+      val = val * 10 + (unsigned long)(p[i] - '0');
+      digits += 1;
+    }
+  }
+  if(p[0] == '0' || digits > 5 || val < 100 || val % 100 != 0){
+    return false;
+  }
+  if(val >= 1000){
+    char thousands[8];
+    size_t n = 0;
+    unsigned long t;
+    for(t = val / 1000; t > 0; t /= 10){
+      thousands[n++] = (char)('0' + t % 10);
+    }
+    while(n > 0){
+      put_word(o, digit_words[thousands[--n] - '0'], first);
+    }
+    put_word(o, "thousand", first);
+  }
+  if((val / 100) % 10 != 0){
+    put_word(o, digit_words[(val / 100) % 10], first);
+    put_word(o, "hundred", first);
+  }
+  return true;
+}
+
+static bool word_in(const char *w, size_t len, const char *const list[])
+{
+  size_t i;
+  for(i = 0; w != NULL && list[i] != NULL; ++i){
+    if(strlen(list[i]) == len && strncasecmp(w, list[i], len) == 0){
+      return true;
+    }
+  }
+  return false;
+}
+
+//The letters of the word after p, if only blanks come first
+static size_t next_word(const char *p, const char **w)
+{
+  size_t n = 0;
+  while(*p == ' '){
+    ++p;
+  }
+  while(isalpha((unsigned char)p[n])){
+    ++n;
+  }
+  *w = p;
+  return n;
+}
+
+static bool feet_follow(const char *p)
+{
+  const char *w;
+  size_t n = next_word(p, &w);
+  return (n == 2 && strncasecmp(w, "ft", 2) == 0) || (n == 4 && strncasecmp(w, "feet", 4) == 0);
+}
+
+static bool icao_ident(const char *p, size_t len, const struct norm_ctx *ctx)
+{
+  const char *w;
+  size_t n;
+  if(len != 4 || !ctx->mixed_case || !all_upper(p, len)){
+    return false;
+  }
+  n = next_word(ctx->next, &w);
+  return word_in(ctx->prev, ctx->prev_len, icao_before) || word_in(w, n, icao_after);
+}
+
+//Runway sides only follow 1 to 36 that isn't a temperature, zulu only a time
+static bool suffix_fits(const struct norm_entry *e, const struct norm_part *num,
+                        const struct norm_ctx *ctx)
+{
+  unsigned long val = 0;
+  size_t digits = 0;
+  bool plain = true;
+  size_t i;
+  for(i = 0; i < num->len; ++i){
+    if(isdigit((unsigned char)num->p[i])){
+      val = val * 10 + (unsigned long)(num->p[i] - '0');
+      digits += 1;
+    }else{
+      plain = false;
+    }
+  }
+  if(e->flags & NORM_RUNWAY){
+    return plain && digits <= 2 && val >= 1 && val <= 36 &&
+           !word_in(ctx->prev, ctx->prev_len, temperature_words);
+  }
+  if(e->flags & NORM_TIME){
+    return digits == 4 || digits == 6;
+  }
+  return true;
+}
+
+static void put_number(struct norm_out *o, const struct norm_part *num, bool feet, bool *first)
+{
+  if(!feet || !put_altitude(o, num->p, num->len, first)){
+    put_spelled(o, num->p, num->len, first);
+  }
+}
+
+static size_t split_word(const char *p, size_t len, struct norm_part parts[])
+{
+  size_t n = 0;
+  size_t i = 0;
+  while(i < len){
+    bool digits = isdigit((unsigned char)p[i]) != 0;
+    size_t j = i;
+    while(j < len && (digits ? !isalpha((unsigned char)p[j]) : isalpha((unsigned char)p[j]) != 0)){
+      ++j;
+    }
+    if(n == NORM_PARTS){
+      return 0;
+    }
+    parts[n].p = p + i;
+    parts[n].len = j - i;
+    parts[n].digits = digits;
+    n += 1;
+    i = j;
+  }
+  return n;
+}
+
+//One word of letters, digits and the . , inside numbers
+static void norm_word(struct norm_out *o, const char *p, size_t len, const struct norm_ctx *ctx)
+{
+  struct norm_part parts[NORM_PARTS];
+  size_t n = split_word(p, len, parts);
+  const struct norm_entry *e;
+  const struct norm_entry *suffix = NULL;
+  bool misplaced = false;
+  bool first = true;
+  size_t i;
+
+  if(n == 1 && !parts[0].digits){
+    e = lex_find(p, len, NORM_WORD);
+    if(e != NULL){
+      put(o, e->spoken, strlen(e->spoken));
+    }else if(icao_ident(p, len, ctx)){
+      put_spelled(o, p, len, &first);
+    }else{
+      put(o, p, len);
+    }
+    return;
+  }
+  if(n == 0){
+    put(o, p, len);
+    return;
+  }
+  //FL350, 27L, 250KT, 1230Z
+  if(n <= 3){
+    size_t num = parts[0].digits ? 0 : 1;
+    e = num == 1 ? lex_find(parts[0].p, parts[0].len, NORM_PREFIX) : NULL;
+    if(num + 2 == n){
+      suffix = lex_find(parts[num + 1].p, parts[num + 1].len, NORM_SUFFIX);
+      //a suffix out of its place is left as written
+      if(suffix != NULL && !suffix_fits(suffix, &parts[num], ctx)){
+        suffix = NULL;
+        misplaced = true;
+      }
+    }
+    if(parts[num].digits && (num == 0 || e != NULL) && (num + 1 == n || suffix != NULL || misplaced)){
+      if(e != NULL){
+        put_word(o, e->spoken, &first);
+      }
+      put_number(o, &parts[num], suffix != NULL ? strcmp(suffix->key, "ft") == 0 : feet_follow(ctx->next),
+                 &first);
+      if(suffix != NULL){
+        put_word(o, suffix->spoken, &first);
+      }else if(misplaced){
+        put(o, " ", 1);
+        put(o, parts[num + 1].p, parts[num + 1].len);
+      }
+      return;
+    }
+  }
+  //Callsigns and other codes such as N123AB are read character by character
+  for(i = 0; i < n; ++i){
+    if(!parts[i].digits && !all_upper(parts[i].p, parts[i].len)){
+      put(o, p, len);
+      return;
+    }
+  }
+  put_spelled(o, p, len, &first);
+}
+
+//The colon of a time such as 10:30 or 9:05Z, with at most two digits before it
+static bool time_colon(const char *text, size_t i, size_t start)
+{
+  const char *m = text + i + 1;
+  size_t j;
+  if(i == start || i - start > 2 || !isdigit((unsigned char)m[0]) ||
+     !isdigit((unsigned char)m[1]) || isdigit((unsigned char)m[2])){
+    return false;
+  }
+  for(j = start; j < i; ++j){
+    if(!isdigit((unsigned char)text[j])){
+      return false;
+    }
+  }
+  return atoi(text + start) < 24 && m[0] < '6';
+}
+
+static bool in_word(const char *text, size_t i, size_t start)
+{
+  unsigned char c = (unsigned char)text[i];
+  if(isalnum(c)){
+    return true;
+  }
+  if(c == ':'){
+    return time_colon(text, i, start);
+  }
+  return (c == '.' || c == ',') && i > start && isdigit((unsigned char)text[i - 1]) &&
+         isdigit((unsigned char)text[i + 1]);
+}
+
+char *norm_text(const char *text)
+{
+  struct norm_out o = {NULL, 0, 0, true};
+  struct norm_ctx ctx = {NULL, 0, NULL, false};
+  size_t len = strlen(text);
+  size_t i = 0;
+
+  for(i = 0; i < len && !ctx.mixed_case; ++i){
+    ctx.mixed_case = islower((unsigned char)text[i]) != 0;
+  }
+  put(&o, "", 0);
+  i = 0;
+  while(i < len && o.ok){
+    size_t start = i;
+    if(!isalnum((unsigned char)text[i])){
+      while(i < len && !isalnum((unsigned char)text[i])){
+        ctx.prev = text[i] == ' ' ? ctx.prev : NULL;
+        ++i;
+      }
+      put(&o, text + start, i - start);
+      continue;
+    }
+    while(i < len && in_word(text, i, start)){
+      ++i;
+    }
+    ctx.next = text + i;
+    norm_word(&o, text + start, i - start, &ctx);
+    ctx.prev = text + start;
+    ctx.prev_len = i - start;
+  }
+  if(!o.ok){
+    free(o.buf);
+    return NULL;
+  }
+  return o.buf;
+}
+
+#ifdef BENCH_NORM
+/*
+ * Throughput of norm_text() over typical ATC strings. Build with
+ * "make bench_norm", run "./bench_norm".
+ */
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_ROUNDS 200000
+
+static const char *const bench_lines[] = {
+  "Speedbird 123, climb and maintain FL350.",
+  "N123AB, RWY 27L, cleared for takeoff, wind 270 at 5 KT.",
+  "Contact KJFK departure on 121.5, squawk 4512.",
+  "Descend and maintain 11,500 ft, QNH 1013.",
+  "Information Bravo, 1230Z, wind 090 at 12KT, visibility 10SM, BKN 2500, temperature 15.",
+  "Delta four five six, turn left heading 090, vectors ILS RWY 4R.",
+  "Traffic, two o'clock, 3 miles, opposite direction, 1000 feet below.",
+  "Cleared to land runway two seven left."
+};
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+  size_t lines = sizeof(bench_lines) / sizeof(bench_lines[0]);
+  size_t bytes = 0;
+  size_t out_bytes = 0;
+  size_t i;
+  double t0, t;
+  int r;
+
+  for(i = 0; i < lines; ++i){
+    char *s = norm_text(bench_lines[i]);
+    printf("  %s\n  -> %s\n", bench_lines[i], s != NULL ? s : "(null)");
+    free(s);
+  }
+  t0 = bench_now();
+  for(r = 0; r < BENCH_ROUNDS; ++r){
+    for(i = 0; i < lines; ++i){
+      char *s = norm_text(bench_lines[i]);
+      bytes += strlen(bench_lines[i]);
+      out_bytes += s != NULL ? strlen(s) : 0;
+      free(s);
+    }
+  }
+  t = bench_now() - t0;
+  printf("norm_text: %.1f MB/s in, %.1f MB/s out, %.0f ns/line\n",
+         bytes / t / 1e6, out_bytes / t / 1e6, t * 1e9 / ((double)BENCH_ROUNDS * lines));
+  return 0;
+}
+#endif
+
+#ifdef TEST_NORM
+/*
+ * Expected spoken forms, run by "make test".
+ */
+#include <stdio.h>
+
+static const char *const test_cases[][2] = {
+  //GPWS callouts stay words, so they still classify as warnings
+  {"Warning: PULL UP", "Warning: PULL UP"},
+  {"Caution, SINK RATE", "Caution, SINK RATE"},
+  {"BANK ANGLE, BANK ANGLE", "BANK ANGLE, BANK ANGLE"},
+  {"Too low, TERRAIN", "Too low, TERRAIN"},
+  {"PULL UP", "PULL UP"},
+  //ICAO identifiers next to a word that names a place
+  {"Contact KJFK departure.", "Contact kilo juliet foxtrot kilo departure."},
+  {"Cleared to EGLL via the LAM3A arrival.",
+   "Cleared to echo golf lima lima via the lima alpha mike three alpha arrival."},
+  {"Direct LFPG", "Direct lima foxtrot papa golf"},
+  {"Report LEFT base", "Report LEFT base"},
+  //Shorthand and numbers
+  {"Climb FL350.", "Climb flight level three five zero."},
+  {"RWY 27L, wind 270 at 5 KT.", "runway two seven left, wind two seven zero at five knots."},
+  {"Tower 121.5", "Tower one two one point five"},
+  {"Descend 11,500 ft", "Descend one one thousand five hundred feet"},
+  {"N123AB, hold short", "november one two three alpha bravo, hold short"},
+  {"Time 1230Z", "Time one two three zero zulu"},
+  //Runway sides only after a runway number, times with a colon read as digits
+  {"Temperature 15C, dewpoint 10C", "Temperature one five C, dewpoint one zero C"},
+  {"Runway 36R, 40L", "Runway three six right, four zero L"},
+  {"Expect departure at 10:30Z", "Expect departure at one zero three zero zulu"},
+  {"ETA 9:05", "E T A nine zero five"},
+  {"Ratio 3:1", "Ratio three:one"},
+  {"2nd in line", "2nd in line"}
+};
+
+int main(void)
+{
+  size_t count = sizeof(test_cases) / sizeof(test_cases[0]);
+  size_t i;
+  int failed = 0;
+
+  for(i = 0; i < count; ++i){
+    char *s = norm_text(test_cases[i][0]);
+    char *again = s != NULL ? norm_text(s) : NULL;
+    if(s == NULL || strcmp(s, test_cases[i][1]) != 0){
+      printf("  FAIL \"%s\"\n    got      \"%s\"\n    expected \"%s\"\n", test_cases[i][0],
+             s != NULL ? s : "(null)", test_cases[i][1]);
+      failed += 1;
+    }else if(again == NULL || strcmp(again, s) != 0){
+      printf("  FAIL \"%s\" changes again: \"%s\"\n", s, again != NULL ? again : "(null)");
+      failed += 1;
+    }
+    free(s);
+    free(again);
+  }
+  printf("  norm_text: %lu of %lu cases passed.\n", (unsigned long)(count - failed), (unsigned long)count);
+  return failed != 0;
+}
+#endif
@@ -0,0 +1,44 @@
+#ifndef NORM__H
+#define NORM__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//Longest lexicon key
+#define NORM_KEY_MAX 15
+
+//Where a lexicon entry applies
+#define NORM_WORD   1 //as a word of its own
+#define NORM_PREFIX 2 //running into a number, as FL in FL350
+#define NORM_SUFFIX 4 //after a number, as L in 27L
+#define NORM_CAPS   8 //only when written in capitals
+#define NORM_RUNWAY 16 //as a suffix only after a runway number, 1 to 36
+#define NORM_TIME   32 //as a suffix only after a time, hhmm or ddhhmm
+
+struct norm_entry {
+  const char *key; //lower case
+  const char *spoken;
+  unsigned flags;
+};
+
+//Shared with normgen, which lays out the lexicon with it at build time
+static inline uint32_t norm_hash(const char *key, size_t len, uint32_t seed)
+{
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  size_t i;
+  for(i = 0; i < len; ++i){
+    h ^= (uint8_t)key[i];
+    h *= 16777619u;
+  }
+  h ^= h >> 15;
+  h *= 0x2c1b3c6du;
+  h ^= h >> 12;
+  return h;
+}
+
+//Spoken form of text: abbreviations, numbers, codes and ICAO identifiers
+//written out in words. Idempotent. NULL if out of memory.
+char *norm_text(const char *text);
+
+#endif
@@ -0,0 +1,236 @@
+/******************************************************************************
+Build time generator of norm_lex.h: lays out the lexicon of norm.tab as a
+minimal perfect hash (hash and displace), so a lookup is two hashes and one
+compare. Run by make as "./normgen norm.tab norm_lex.h".
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "norm.h"
+
+#define GEN_MAX 1024
+//Largest displacement tried before the table is grown
+#define GEN_DISP_MAX 65535
+
+struct gen_entry {
+  char key[NORM_KEY_MAX + 1];
+  char *spoken;
+  unsigned flags;
+  unsigned bucket;
+};
+
+static struct gen_entry entries[GEN_MAX];
+static unsigned entry_count;
+
+static bool parse_flags(const char *s, unsigned *flags)
+{
+  *flags = 0;
+  for(; *s; ++s){
+    switch(*s){
+      case 'w': *flags |= NORM_WORD; break;
+      case 'p': *flags |= NORM_PREFIX; break;
+      case 's': *flags |= NORM_SUFFIX; break;
+      case 'c': *flags |= NORM_CAPS; break;
+      case 'r': *flags |= NORM_RUNWAY; break;
+      case 't': *flags |= NORM_TIME; break;
+      default: return false;
+    }
+  }
+  return (*flags & (NORM_WORD | NORM_PREFIX | NORM_SUFFIX)) != 0;
+}
+
+//"key flags spoken..." per line, # starts a comment
+static bool load(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  char line[512];
+  unsigned lineno = 0;
+  bool ok = true;
+
+  if(f == NULL){
+    fprintf(stderr, "normgen: can't open %s\n", path);
+    return false;
+  }
+  while(ok && fgets(line, sizeof(line), f) != NULL){
+    char key[64], flags[16];
+    int pos = 0;
+    char *spoken;
+    size_t i, len;
+    ++lineno;
+    if(sscanf(line, " %63s", key) != 1 || key[0] == '#'){
+      continue;
+    }
+    if(sscanf(line, " %63s %15s %n", key, flags, &pos) != 2 || pos == 0 ||
+       strlen(key) > NORM_KEY_MAX || entry_count == GEN_MAX){
+      fprintf(stderr, "normgen: %s:%u: bad entry\n", path, lineno);
+      ok = false;
+      break;
+    }
+    spoken = line + pos;
+    len = strcspn(spoken, "\r\n");
+    while(len > 0 && isspace((unsigned char)spoken[len - 1])){
+      --len;
+    }
+    spoken[len] = '\0';
+    if(len == 0 || strpbrk(spoken, "\"\\") != NULL ||
+       !parse_flags(flags, &entries[entry_count].flags)){
+      fprintf(stderr, "normgen: %s:%u: bad entry\n", path, lineno);
+      ok = false;
+      break;
+    }
+    for(i = 0; key[i]; ++i){
+      key[i] = (char)tolower((unsigned char)key[i]);
+    }
+    for(i = 0; i < entry_count; ++i){
+      if(strcmp(entries[i].key, key) == 0){
+        fprintf(stderr, "normgen: %s:%u: duplicate key %s\n", path, lineno, key);
+        ok = false;
+      }
+    }
+    strcpy(entries[entry_count].key, key);
+    entries[entry_count].spoken = strdup(spoken);
+    entry_count += 1;
+  }
+  fclose(f);
+  return ok && entry_count > 0;
+}
+
+//Places bucket b into slot, false if one of its keys collides
+static bool place(unsigned b, unsigned disp, unsigned size, int slot[], int taken[])
+{
+  unsigned i, n = 0;
+  for(i = 0; i < entry_count; ++i){
+    if(entries[i].bucket == b){
+      unsigned s = norm_hash(entries[i].key, strlen(entries[i].key), disp) % size;
+      if(slot[s] >= 0){
+        break;
+      }
+      slot[s] = (int)i;
+      taken[n++] = (int)s;
+    }
+  }
+  if(i == entry_count){
+    return true;
+  }
+  while(n > 0){
+    slot[taken[--n]] = -1;
+  }
+  return false;
+}
+
+static bool build(unsigned size, unsigned buckets, int slot[], unsigned disp[])
+{
+  unsigned bucket_size[GEN_MAX] = {0};
+  int taken[GEN_MAX];
+  unsigned order[GEN_MAX];
+  unsigned i, j;
+
+  for(i = 0; i < size; ++i){
+    slot[i] = -1;
+  }
+  for(i = 0; i < entry_count; ++i){
+    entries[i].bucket = norm_hash(entries[i].key, strlen(entries[i].key), 0) % buckets;
+    bucket_size[entries[i].bucket] += 1;
+  }
+  //biggest buckets first, while the table is still empty
+  for(i = 0; i < buckets; ++i){
+    order[i] = i;
+  }
+  for(i = 1; i < buckets; ++i){
+    unsigned b = order[i];
+    for(j = i; j > 0 && bucket_size[order[j - 1]] < bucket_size[b]; --j){
+      order[j] = order[j - 1];
+    }
+    order[j] = b;
+  }
+  for(i = 0; i < buckets; ++i){
+    unsigned b = order[i];
+    disp[b] = 0;
+    if(bucket_size[b] == 0){
+      continue;
+    }
+    for(disp[b] = 1; disp[b] <= GEN_DISP_MAX; ++disp[b]){
+      if(place(b, disp[b], size, slot, taken)){
+        break;
+      }
+    }
+    if(disp[b] > GEN_DISP_MAX){
+      return false;
+    }
+  }
+  return true;
+}
+
+static void write_flags(FILE *f, unsigned flags)
+{
+  static const char *const names[] = {"NORM_WORD", "NORM_PREFIX", "NORM_SUFFIX", "NORM_CAPS",
+                                      "NORM_RUNWAY", "NORM_TIME"};
+  const char *sep = "";
+  unsigned i;
+  for(i = 0; i < sizeof(names) / sizeof(names[0]); ++i){
+    if(flags & (1u << i)){
+      fprintf(f, "%s%s", sep, names[i]);
+      sep = " | ";
+    }
+  }
+}
+
+static bool write_table(const char *path, unsigned size, unsigned buckets,
+                        const int slot[], const unsigned disp[])
+{
+  FILE *f = fopen(path, "w");
+  unsigned i;
+  if(f == NULL){
+    fprintf(stderr, "normgen: can't create %s\n", path);
+    return false;
+  }
+  fprintf(f, "//Generated by normgen from norm.tab, do not edit\n");
+  fprintf(f, "#ifndef NORM_LEX__H\n#define NORM_LEX__H\n\n#include \"norm.h\"\n\n");
+  fprintf(f, "#define NORM_LEX_SIZE %uu\n#define NORM_LEX_BUCKETS %uu\n\n", size, buckets);
+  fprintf(f, "static const uint16_t norm_disp[NORM_LEX_BUCKETS] = {");
+  for(i = 0; i < buckets; ++i){
+    fprintf(f, "%s%u", i % 16 ? ", " : (i ? ",\n  " : "\n  "), disp[i]);
+  }
+  fprintf(f, "\n};\n\nstatic const struct norm_entry norm_lex[NORM_LEX_SIZE] = {\n");
+  for(i = 0; i < size; ++i){
+    if(slot[i] < 0){
+      fprintf(f, "  {NULL, NULL, 0},\n");
+      continue;
+    }
+    fprintf(f, "  {\"%s\", \"%s\", ", entries[slot[i]].key, entries[slot[i]].spoken);
+    write_flags(f, entries[slot[i]].flags);
+    fprintf(f, "},\n");
+  }
+  fprintf(f, "};\n\n#endif\n");
+  if(fclose(f) != 0){
+    remove(path);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  static int slot[2 * GEN_MAX];
+  static unsigned disp[GEN_MAX];
+  unsigned size;
+
+  if(argc != 3){
+    fprintf(stderr, "usage: normgen norm.tab norm_lex.h\n");
+    return 1;
+  }
+  if(!load(argv[1])){
+    return 1;
+  }
+  //Minimal if it works out, a few spare slots otherwise
+  for(size = entry_count; size < 2 * entry_count; ++size){
+    unsigned buckets = (entry_count + 1) / 2;
+    if(build(size, buckets, slot, disp)){
+      return write_table(argv[2], size, buckets, slot, disp) ? 0 : 1;
+    }
+  }
+  fprintf(stderr, "normgen: no perfect hash found\n");
+  return 1;
+}
@@ -0,0 +1,269 @@
+/******************************************************************************
+WAV parsing and in-memory PCM buffers
+******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "pcm.h"
+
+static bool read_exact(int fd, void *buf, size_t len)
+{
+  size_t off = 0;
+  while(off < len){
+    ssize_t res = read(fd, (uint8_t *)buf + off, len - off);
+    if(res < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return false;
+    }
+    if(res == 0){
+      return false;
+    }
+    off += (size_t)res;
+  }
+  return true;
+}
+
+static bool skip_bytes(int fd, size_t len)
+{
+  uint8_t tmp[512];
+  while(len > 0){
+    size_t chunk = len > sizeof(tmp) ? sizeof(tmp) : len;
+    if(!read_exact(fd, tmp, chunk)){
+      return false;
+    }
+    len -= chunk;
+  }
+  return true;
+}
+
+static uint16_t le16(const uint8_t *p)
+{
+  return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+  return (uint32_t)p[0] |
+         ((uint32_t)p[1] << 8) |
+         ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+bool wav_info_equal(const struct wav_info *a, const struct wav_info *b)
+{
+  return a->format == b->format && a->channels == b->channels &&
+         a->sample_rate == b->sample_rate && a->bits_per_sample == b->bits_per_sample;
+}
+
+bool wav_read_header(int fd, struct wav_info *info)
+{
+  uint8_t hdr[12];
+  bool got_fmt = false;
+  bool got_data = false;
+
+  if(!read_exact(fd, hdr, sizeof(hdr))){
+    return false;
+  }
+  if(memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0){
+    return false;
+  }
+
+  while(!got_data){
+    uint8_t chunk[8];
+    uint32_t size;
+    if(!read_exact(fd, chunk, sizeof(chunk))){
+      return false;
+    }
+    size = le32(chunk + 4);
+
+    if(memcmp(chunk, "fmt ", 4) == 0){
+      uint8_t fmt[16];
+      if(size < 16){
+        return false;
+      }
+      if(!read_exact(fd, fmt, 16)){
+        return false;
+      }
+      info->format = le16(fmt + 0);
+      info->channels = le16(fmt + 2);
+      info->sample_rate = le32(fmt + 4);
+      info->bits_per_sample = le16(fmt + 14);
+      got_fmt = true;
+      if(size > 16){
+        if(!skip_bytes(fd, size - 16)){
+          return false;
+        }
+      }
+      if(size & 1){
+        if(!skip_bytes(fd, 1)){
+          return false;
+        }
+      }
+    }else if(memcmp(chunk, "data", 4) == 0){
+      got_data = true;
+    }else{
+      if(!skip_bytes(fd, size)){
+        return false;
+      }
+      if(size & 1){
+        if(!skip_bytes(fd, 1)){
+          return false;
+        }
+      }
+    }
+  }
+
+  return got_fmt;
+}
+
+//Canonical 44 byte header, used when handing buffered audio to a WAV sink
+void wav_make_header(uint8_t hdr[44], const struct wav_info *info, size_t data_len)
+{
+  uint32_t block = (uint32_t)info->channels * (info->bits_per_sample / 8);
+  uint32_t len = data_len > 0xFFFFFFFFu - 36 ? 0xFFFFFFFFu - 36 : (uint32_t)data_len;
+
+  memcpy(hdr, "RIFF", 4);
+  put32(hdr + 4, 36 + len);
+  memcpy(hdr + 8, "WAVE", 4);
+  memcpy(hdr + 12, "fmt ", 4);
+  put32(hdr + 16, 16);
+  put16(hdr + 20, info->format);
+  put16(hdr + 22, info->channels);
+  put32(hdr + 24, info->sample_rate);
+  put32(hdr + 28, info->sample_rate * block);
+  put16(hdr + 32, (uint16_t)block);
+  put16(hdr + 34, info->bits_per_sample);
+  memcpy(hdr + 36, "data", 4);
+  put32(hdr + 40, len);
+}
+
+//Reads a whole WAV stream (header included) from fd into pcm
+bool pcm_read_fd(int fd, struct pcm_buf *pcm)
+{
+  struct stat st;
+  size_t cap = 65536;
+
+  memset(pcm, 0, sizeof(*pcm));
+  if(!wav_read_header(fd, &pcm->info)){
+    return false;
+  }
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+    cap = (size_t)st.st_size;
+  }
+  pcm->data = (uint8_t *)malloc(cap);
+  if(pcm->data == NULL){
+    return false;
+  }
+  while(1){
+    ssize_t res;
+    if(pcm->len == cap){
+      uint8_t *tmp = (uint8_t *)realloc(pcm->data, cap * 2);
+      if(tmp == NULL){
+        pcm_free(pcm);
+        return false;
+      }
+      pcm->data = tmp;
+      cap *= 2;
+    }
+    res = read(fd, pcm->data + pcm->len, cap - pcm->len);
+    if(res < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      pcm_free(pcm);
+      return false;
+    }
+    if(res == 0){
+      break;
+    }
+    pcm->len += (size_t)res;
+  }
+  return true;
+}
+
+void pcm_free(struct pcm_buf *pcm)
+{
+  if(pcm == NULL){
+    return;
+  }
+  free(pcm->data);
+  pcm->data = NULL;
+  pcm->len = 0;
+}
+
+bool pcm_split_tail(struct pcm_buf *pcm, size_t frames, struct pcm_buf *tail)
+{
+  size_t frame = (size_t)pcm->info.channels * (pcm->info.bits_per_sample / 8);
+  size_t len = frames * frame;
+  if(frame == 0 || len == 0 || len > pcm->len){
+    return false;
+  }
+  tail->data = (uint8_t *)malloc(len);
+  if(tail->data == NULL){
+    return false;
+  }
+  tail->info = pcm->info;
+  tail->len = len;
+  pcm->len -= len;
+  memcpy(tail->data, pcm->data + pcm->len, len);
+  return true;
+}
+
+//Linear crossfade from tail into the start of pcm, both 16-bit
+bool pcm_crossfade(struct pcm_buf *pcm, const struct pcm_buf *tail)
+{
+  int16_t *dst = (int16_t *)pcm->data;
+  const int16_t *src = (const int16_t *)tail->data;
+  size_t channels = pcm->info.channels;
+  size_t frames = tail->len / (2 * channels);
+  size_t i, c;
+  if(pcm->info.format != 1 || pcm->info.bits_per_sample != 16 || channels == 0 ||
+     !wav_info_equal(&pcm->info, &tail->info) || tail->len > pcm->len){
+    return false;
+  }
+  for(i = 0; i < frames; ++i){
+    for(c = 0; c < channels; ++c){
+      size_t k = i * channels + c;
+      dst[k] = (int16_t)((src[k] * (int32_t)(frames - i) + dst[k] * (int32_t)i) / (int32_t)frames);
+    }
+  }
+  return true;
+}
+
+bool pcm_append(struct pcm_buf *pcm, const struct pcm_buf *more)
+{
+  uint8_t *data;
+  if(pcm->data != NULL && !wav_info_equal(&pcm->info, &more->info)){
+    return false;
+  }
+  data = (uint8_t *)realloc(pcm->data, pcm->len + more->len + 1);
+  if(data == NULL){
+    return false;
+  }
+  if(pcm->data == NULL){
+    pcm->info = more->info;
+  }
+  memcpy(data + pcm->len, more->data, more->len);
+  pcm->data = data;
+  pcm->len += more->len;
+  return true;
+}
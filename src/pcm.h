@@ -0,0 +1,35 @@
+#ifndef PCM__H
+#define PCM__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct wav_info {
+  uint16_t format;
+  uint16_t channels;
+  uint32_t sample_rate;
+  uint16_t bits_per_sample;
+};
+
+//Decoded audio of one utterance, data holds the WAV payload as is
+struct pcm_buf {
+  struct wav_info info;
+  uint8_t *data;
+  size_t len;
+};
+
+//Field by field, the struct has padding memcmp() would look at
+bool wav_info_equal(const struct wav_info *a, const struct wav_info *b);
+bool wav_read_header(int fd, struct wav_info *info);
+void wav_make_header(uint8_t hdr[44], const struct wav_info *info, size_t data_len);
+
+bool pcm_read_fd(int fd, struct pcm_buf *pcm);
+void pcm_free(struct pcm_buf *pcm);
+//Moves the last frames of pcm into tail
+bool pcm_split_tail(struct pcm_buf *pcm, size_t frames, struct pcm_buf *tail);
+bool pcm_crossfade(struct pcm_buf *pcm, const struct pcm_buf *tail);
+//Same format only; an empty pcm takes the format of more
+bool pcm_append(struct pcm_buf *pcm, const struct pcm_buf *more);
+
+#endif
@@ -0,0 +1,346 @@
+/******************************************************************************
+Synthesis workers: per worker queues with stealing, delivery in submission order
+******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "pool.h"
+#include "utils.h"
+
+//Upper bound of outstanding jobs, a power of two
+#define POOL_SLOTS 64
+
+/*
+ * A job goes to the least loaded worker of its voice. Idle workers take
+ * the oldest job of a busy sibling with the same voice, so the segment
+ * playback waits for runs first. Jobs take tens of milliseconds at least,
+ * one mutex for all queues costs nothing next to that. The worker that
+ * completes the oldest outstanding job delivers it and every completed
+ * job behind it; the others just mark theirs done.
+ */
+enum slot_state {
+  SLOT_FREE = 0,
+  SLOT_QUEUED,
+  SLOT_RUNNING,
+  SLOT_DONE
+};
+
+struct pool_slot {
+  struct pool_job job;
+  enum slot_state state;
+};
+
+//Sequence numbers of the jobs waiting for one worker, oldest first
+struct pool_queue {
+  unsigned long seq[POOL_SLOTS];
+  unsigned head;
+  unsigned count;
+};
+
+struct pool_worker {
+  pthread_t thread;
+  bool started;
+  int voice;
+  bool pinned;
+  cpu_set_t cpus;
+  struct pool_queue queue;
+};
+
+static struct {
+  bool ready;
+  bool stop;
+  bool delivering;
+  unsigned workers;
+  unsigned window;
+  unsigned next_worker;
+  unsigned long issued;
+  unsigned long delivered;
+  struct pool_worker worker[POOL_WORKERS_MAX];
+  struct pool_slot slots[POOL_SLOTS];
+  struct pool_ops ops;
+  struct pool_stats stats;
+  pthread_mutex_t mtx;
+  pthread_cond_t work_cv;
+  pthread_cond_t space_cv;
+} pool;
+
+static void queue_put(struct pool_queue *q, unsigned long seq)
+{
+  q->seq[(q->head + q->count) % POOL_SLOTS] = seq;
+  q->count += 1;
+}
+
+static unsigned long queue_take(struct pool_queue *q)
+{
+  unsigned long seq = q->seq[q->head];
+  q->head = (q->head + 1) % POOL_SLOTS;
+  q->count -= 1;
+  return seq;
+}
+
+//Own queue first, then the oldest job queued for a sibling
+static bool pool_take(unsigned w, unsigned long *seq)
+{
+  struct pool_worker *victim = NULL;
+  unsigned i;
+  if(pool.worker[w].queue.count > 0){
+    *seq = queue_take(&pool.worker[w].queue);
+    return true;
+  }
+  for(i = 0; i < pool.workers; ++i){
+    struct pool_worker *pw = &pool.worker[i];
+    if(i == w || pw->voice != pool.worker[w].voice || pw->queue.count == 0){
+      continue;
+    }
+    if(victim == NULL || pw->queue.seq[pw->queue.head] < victim->queue.seq[victim->queue.head]){
+      victim = pw;
+    }
+  }
+  if(victim == NULL){
+    return false;
+  }
+  *seq = queue_take(&victim->queue);
+  pool.stats.stolen += 1;
+  return true;
+}
+
+//Called with pool.mtx held
+static void pool_deliver(void)
+{
+  if(pool.delivering){
+    return;
+  }
+  pool.delivering = true;
+  while(pool.delivered != pool.issued){
+    struct pool_slot *s = &pool.slots[pool.delivered % POOL_SLOTS];
+    struct pool_job job;
+    if(s->state != SLOT_DONE){
+      break;
+    }
+    job = s->job;
+    s->state = SLOT_FREE;
+    pool.delivered += 1;
+    pthread_mutex_unlock(&pool.mtx);
+    pool.ops.deliver(&job);
+    pthread_mutex_lock(&pool.mtx);
+    pthread_cond_broadcast(&pool.space_cv);
+  }
+  pool.delivering = false;
+}
+
+static void *pool_worker(void *arg)
+{
+  unsigned w = (unsigned)(uintptr_t)arg;
+  struct pool_worker *pw = &pool.worker[w];
+
+  if(pw->pinned){
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(pw->cpus), &pw->cpus);
+    if(err != 0){
+      xcDebug("XLinSpeak: Couldn't pin synthesis worker %u: %d\n", w, err);
+    }
+  }
+  if(pool.ops.start != NULL){
+    pool.ops.start(w);
+  }
+  pthread_mutex_lock(&pool.mtx);
+  while(1){
+    unsigned long seq = 0;
+    struct pool_slot *s;
+    while(!pool.stop && !pool_take(w, &seq)){
+      pthread_cond_wait(&pool.work_cv, &pool.mtx);
+    }
+    if(pool.stop){
+      break;
+    }
+    s = &pool.slots[seq % POOL_SLOTS];
+    s->state = SLOT_RUNNING;
+    pthread_mutex_unlock(&pool.mtx);
+    pool.ops.run(w, &s->job);
+    pthread_mutex_lock(&pool.mtx);
+    s->state = SLOT_DONE;
+    pool_deliver();
+  }
+  pthread_mutex_unlock(&pool.mtx);
+  if(pool.ops.stop != NULL){
+    pool.ops.stop(w);
+  }
+  return NULL;
+}
+
+//"0-1,2,3": one CPU set per entry, false if the list doesn't parse
+static bool parse_affinity(const char *spec, cpu_set_t sets[], unsigned *count)
+{
+  const char *p = spec;
+  *count = 0;
+  while(*p && *count < POOL_WORKERS_MAX){
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    long cpu;
+    if(end == p || first < 0 || first >= CPU_SETSIZE){
+      return false;
+    }
+    if(*end == '-'){
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if(end == p || last < first || last >= CPU_SETSIZE){
+        return false;
+      }
+    }
+    if(*end == ','){
+      ++end;
+    }else if(*end != '\0'){
+      return false;
+    }
+    CPU_ZERO(&sets[*count]);
+    for(cpu = first; cpu <= last; ++cpu){
+      CPU_SET(cpu, &sets[*count]);
+    }
+    *count += 1;
+    p = end;
+  }
+  return true;
+}
+
+static void pool_join(void)
+{
+  unsigned i;
+  pthread_mutex_lock(&pool.mtx);
+  pool.stop = true;
+  pthread_cond_broadcast(&pool.work_cv);
+  pthread_cond_broadcast(&pool.space_cv);
+  pthread_mutex_unlock(&pool.mtx);
+  for(i = 0; i < pool.workers; ++i){
+    if(pool.worker[i].started){
+      pthread_join(pool.worker[i].thread, NULL);
+      pool.worker[i].started = false;
+    }
+  }
+}
+
+bool pool_init(unsigned workers, const int voice[], const char *affinity,
+               const struct pool_ops *ops)
+{
+  cpu_set_t sets[POOL_WORKERS_MAX];
+  unsigned nsets = 0;
+  unsigned i;
+
+  if(pool.ready || workers == 0 || workers > POOL_WORKERS_MAX){
+    return false;
+  }
+  memset(&pool, 0, sizeof(pool));
+  pool.workers = workers;
+  pool.window = workers * 2 + 2 < POOL_SLOTS ? workers * 2 + 2 : POOL_SLOTS;
+  pool.ops = *ops;
+  if(affinity != NULL && *affinity != '\0' && !parse_affinity(affinity, sets, &nsets)){
+    xcDebug("XLinSpeak: Ignoring invalid CPU list '%s'.\n", affinity);
+    nsets = 0;
+  }
+  pthread_mutex_init(&pool.mtx, NULL);
+  pthread_cond_init(&pool.work_cv, NULL);
+  pthread_cond_init(&pool.space_cv, NULL);
+  for(i = 0; i < workers; ++i){
+    struct pool_worker *pw = &pool.worker[i];
+    pw->voice = voice[i];
+    if(nsets > 0){
+      pw->cpus = sets[i % nsets];
+      pw->pinned = true;
+    }
+  }
+  for(i = 0; i < workers; ++i){
+    if(pthread_create(&pool.worker[i].thread, NULL, pool_worker, (void *)(uintptr_t)i) != 0){
+      xcDebug("XLinSpeak: Couldn't start synthesis worker %u.\n", i);
+      pool_join();
+      pthread_mutex_destroy(&pool.mtx);
+      pthread_cond_destroy(&pool.work_cv);
+      pthread_cond_destroy(&pool.space_cv);
+      return false;
+    }
+    pool.worker[i].started = true;
+  }
+  pool.ready = true;
+  return true;
+}
+
+bool pool_submit(int voice, void *data)
+{
+  struct pool_worker *target = NULL;
+  struct pool_slot *s;
+  unsigned i;
+
+  if(!pool.ready){
+    return false;
+  }
+  pthread_mutex_lock(&pool.mtx);
+  while(!pool.stop && pool.issued - pool.delivered >= pool.window){
+    pthread_cond_wait(&pool.space_cv, &pool.mtx);
+  }
+  for(i = 0; i < pool.workers && !pool.stop; ++i){
+    struct pool_worker *pw = &pool.worker[(pool.next_worker + i) % pool.workers];
+    if(pw->voice == voice && (target == NULL || pw->queue.count < target->queue.count)){
+      target = pw;
+    }
+  }
+  if(target == NULL){
+    pthread_mutex_unlock(&pool.mtx);
+    return false;
+  }
+  pool.next_worker = (pool.next_worker + 1) % pool.workers;
+  s = &pool.slots[pool.issued % POOL_SLOTS];
+  s->job.seq = pool.issued;
+  s->job.voice = voice;
+  s->job.data = data;
+  s->state = SLOT_QUEUED;
+  queue_put(&target->queue, pool.issued);
+  pool.issued += 1;
+  pool.stats.jobs += 1;
+  pthread_cond_broadcast(&pool.work_cv);
+  pthread_mutex_unlock(&pool.mtx);
+  return true;
+}
+
+void pool_close(void)
+{
+  unsigned long seq;
+  if(!pool.ready){
+    return;
+  }
+  pool_join();
+  for(seq = pool.delivered; seq != pool.issued; ++seq){
+    if(pool.ops.drop != NULL){
+      pool.ops.drop(&pool.slots[seq % POOL_SLOTS].job);
+    }
+  }
+  pool.delivered = pool.issued;
+  pthread_mutex_destroy(&pool.mtx);
+  pthread_cond_destroy(&pool.work_cv);
+  pthread_cond_destroy(&pool.space_cv);
+  pool.ready = false;
+}
+
+unsigned long pool_pending(void)
+{
+  unsigned long n;
+  if(!pool.ready){
+    return 0;
+  }
+  pthread_mutex_lock(&pool.mtx);
+  n = pool.issued - pool.delivered;
+  pthread_mutex_unlock(&pool.mtx);
+  return n;
+}
+
+void pool_get_stats(struct pool_stats *st)
+{
+  if(!pool.ready){
+    *st = pool.stats;
+    return;
+  }
+  pthread_mutex_lock(&pool.mtx);
+  *st = pool.stats;
+  pthread_mutex_unlock(&pool.mtx);
+}
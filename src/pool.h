@@ -0,0 +1,42 @@
+#ifndef POOL__H
+#define POOL__H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define POOL_WORKERS_MAX 16
+
+struct pool_job {
+  unsigned long seq; //submission order
+  int voice;         //only workers of this voice run the job
+  void *data;
+};
+
+struct pool_ops {
+  void (*start)(unsigned worker); //on the worker thread, before its first job
+  void (*stop)(unsigned worker);  //on the worker thread, after its last job
+  void (*run)(unsigned worker, struct pool_job *job);
+  //Called in submission order, one job at a time, from whichever worker
+  //completed the oldest outstanding job
+  void (*deliver)(struct pool_job *job);
+  //Jobs still outstanding when the pool closes
+  void (*drop)(struct pool_job *job);
+};
+
+struct pool_stats {
+  unsigned long jobs;
+  unsigned long stolen;
+};
+
+//voice[i] is the voice of worker i. affinity is a comma separated list of
+//CPU sets ("0-1,2,3"), worker i is pinned to set i modulo their count.
+bool pool_init(unsigned workers, const int voice[], const char *affinity,
+               const struct pool_ops *ops);
+//Blocks while too many jobs are outstanding; false once the pool closes
+bool pool_submit(int voice, void *data);
+void pool_close(void);
+//Jobs submitted but not delivered yet
+unsigned long pool_pending(void);
+void pool_get_stats(struct pool_stats *st);
+
+#endif
@@ -1,6 +1,7 @@
 /******************************************************************************
 Searches current executable for given functions 
 ******************************************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -9,6 +10,11 @@ Searches current executable for given functions
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <link.h>
 
 #include "sec.h"
 #include "utils.h"
@@ -111,113 +117,109 @@ struct symbols_info{
   uint8_t *symbol_table;
   char    *strings;
   size_t   size;
+  size_t   strings_size;
   int      bits;
+  uint8_t *map; //whole executable, read only
+  size_t   map_size;
 }symbols_info;
 
 static char exe[2048];
 
-static uint8_t *read_section(FILE *f, size_t offset, size_t size)
+static double now_ms(void)
 {
-  uint8_t *ptr = (uint8_t *)malloc(size);
-  if(ptr == NULL){
-    xcDebug("XLinSpeak: Couldn't malloc %lud bytes.\n", (long unsigned int)size);
-    return NULL;
-  }
-  if(fseek(f, offset, SEEK_SET) != 0){
-    xcDebug("XLinSpeak: Problem seeking to the section pos (%luX\n)\n", (long unsigned int)offset);
-    free(ptr);
-    return NULL;
-  }
-  if(fread(ptr, 1, size, f) != size){
-    xcDebug("XLinSpeak: Couldn't read the whole section(offset: %luX, length: %lud\n).\n", (long unsigned int)offset, (long unsigned int)size);
-    free(ptr);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+//Returns pointer to the given file range inside the mapping, NULL when out of bounds
+static uint8_t *map_range(uint64_t offset, uint64_t size)
+{
+  if((offset > symbols_info.map_size) || (size > symbols_info.map_size - offset)){
+    xcDebug("XLinSpeak: Range outside of the file (offset: %luX, length: %lud).\n", (long unsigned int)offset, (long unsigned int)size);
     return NULL;
   }
-  return ptr;
+  return symbols_info.map + offset;
 }
 
 
-static bool parse_elf(FILE *f)
+static bool parse_elf(void)
 {
-  struct commonELF_header eh;
-  struct ELF32_header eh32;
-  struct ELF64_header eh64;
-  struct SECTION32_header sh32;
-  struct SECTION64_header sh64;
+  struct commonELF_header *eh;
+  struct ELF32_header *eh32;
+  struct ELF64_header *eh64;
+  struct SECTION32_header *sh32;
+  struct SECTION64_header *sh64;
   uint32_t i;
-  uint32_t link = 0;
 
-  if(fread(&eh, sizeof(eh), 1, f) != 1){
+  eh = (struct commonELF_header *)map_range(0, sizeof(*eh));
+  if((eh == NULL) || (eh->magic != 0x464C457F)){
     xcDebug("XLinSpeak: Can't read common ELF header!\n");
     return false;
   }
 
-  if(eh.bitness == 1){ //32 bit
+  if(eh->bitness == 1){ //32 bit
     symbols_info.bits = 32;
-    if(fread(&eh32, sizeof(eh32), 1, f) != 1){
+    eh32 = (struct ELF32_header *)map_range(sizeof(*eh), sizeof(*eh32));
+    if(eh32 == NULL){
       xcDebug("XLinSpeak: Can't read 32bit ELF header!\n");
       return false;
     }
-    xcDebug("XLinSpeak: Entry point: 0x%08X\n", eh32.entry_point);
-    xcDebug("XLinSpeak: Flags: %08X\n", eh32.flags);
-    xcDebug("XLinSpeak: Section headers entries: %d\n", eh32.sht_entries);
-
-    //skip over program header tables
-    long anchor = eh32.section_header_table_pos;
-    for(i = 0; i < eh32.sht_entries; ++i){
-      fseek(f, anchor + i * eh32.sht_entry_size, SEEK_SET);
-      if(fread(&sh32, sizeof(sh32), 1, f) != 1){
+    xcDebug("XLinSpeak: Entry point: 0x%08X\n", eh32->entry_point);
+    xcDebug("XLinSpeak: Flags: %08X\n", eh32->flags);
+    xcDebug("XLinSpeak: Section headers entries: %d\n", eh32->sht_entries);
+
+    for(i = 0; i < eh32->sht_entries; ++i){
+      sh32 = (struct SECTION32_header *)map_range(eh32->section_header_table_pos + (uint64_t)i * eh32->sht_entry_size, sizeof(*sh32));
+      if(sh32 == NULL){
         xcDebug("XLinSpeak: Problem reading section header\n");
         return false;
       }
-      //xcDebug("XLinSpeak: Section offset: %08X\n", sh32.offset);
-      switch(sh32.type){
-        case SHT_SYMTAB:
-          symbols_info.symbol_table = read_section(f, sh32.offset, sh32.size);
-          symbols_info.size = sh32.size;
-	  link = sh32.link;
-          break;
-        case SHT_STRTAB:
-	  if(link == i){
-            symbols_info.strings = (char *)read_section(f, sh32.offset, sh32.size);
-	  }
-        default:
-          break;
+      if(sh32->type == SHT_SYMTAB){
+        struct SECTION32_header *str32;
+        str32 = (struct SECTION32_header *)map_range(eh32->section_header_table_pos + (uint64_t)sh32->link * eh32->sht_entry_size, sizeof(*str32));
+        if((sh32->link >= eh32->sht_entries) || (str32 == NULL) || (str32->type != SHT_STRTAB)){
+          xcDebug("XLinSpeak: Symtab without string table.\n");
+          return false;
+        }
+        symbols_info.symbol_table = map_range(sh32->offset, sh32->size);
+        symbols_info.size = sh32->size;
+        symbols_info.strings = (char *)map_range(str32->offset, str32->size);
+        symbols_info.strings_size = str32->size;
+        break;
       }
     }
   }else{ //64 bit
-    if(fread(&eh64, sizeof(eh64), 1, f) != 1){
+    eh64 = (struct ELF64_header *)map_range(sizeof(*eh), sizeof(*eh64));
+    if(eh64 == NULL){
       xcDebug("XLinSpeak: Can't read 64bit ELF header!\n");
       return false;
     }
     symbols_info.bits = 64;
-    xcDebug("XLinSpeak: Entry point: 0x%08luX\n", (long unsigned int)eh64.entry_point);
-    xcDebug("XLinSpeak: Flags: %08X\n", eh64.flags);
-    xcDebug("XLinSpeak: Section headers entries: %d\n", eh64.sht_entries);
-
-    //skip over program header tables
-    long anchor = eh64.section_header_table_pos;
-    for(i = 0; i < eh64.sht_entries; ++i){
-      fseek(f, anchor + i * eh64.sht_entry_size, SEEK_SET);
-      if(fread(&sh64, sizeof(sh64), 1, f) != 1){
+    xcDebug("XLinSpeak: Entry point: 0x%08luX\n", (long unsigned int)eh64->entry_point);
+    xcDebug("XLinSpeak: Flags: %08X\n", eh64->flags);
+    xcDebug("XLinSpeak: Section headers entries: %d\n", eh64->sht_entries);
+
+    for(i = 0; i < eh64->sht_entries; ++i){
+      sh64 = (struct SECTION64_header *)map_range(eh64->section_header_table_pos + (uint64_t)i * eh64->sht_entry_size, sizeof(*sh64));
+      if(sh64 == NULL){
         xcDebug("XLinSpeak: Problem reading section header\n");
         return false;
       }
-      //xcDebug("XLinSpeak: Section offset: %08lX\n", (long unsigned int)sh64.offset);
-      switch(sh64.type){
-        case SHT_SYMTAB:
-          symbols_info.symbol_table = read_section(f, sh64.offset, sh64.size);
-          symbols_info.size = sh64.size;
-	  link = sh64.link;
-          xcDebug("XLinSpeak: Symtab @ %lX\n", (long unsigned int)sh64.offset);
-          break;
-        case SHT_STRTAB:
-	  if(link == i){
-            symbols_info.strings = (char *)read_section(f, sh64.offset, sh64.size);
-            xcDebug("XLinSpeak: Stringtab @ %lX\n", (long unsigned int)sh64.offset);
-	  }
-        default:
-          break;
+      if(sh64->type == SHT_SYMTAB){
+        struct SECTION64_header *str64;
+        str64 = (struct SECTION64_header *)map_range(eh64->section_header_table_pos + (uint64_t)sh64->link * eh64->sht_entry_size, sizeof(*str64));
+        if((sh64->link >= eh64->sht_entries) || (str64 == NULL) || (str64->type != SHT_STRTAB)){
+          xcDebug("XLinSpeak: Symtab without string table.\n");
+          return false;
+        }
+        symbols_info.symbol_table = map_range(sh64->offset, sh64->size);
+        symbols_info.size = sh64->size;
+        symbols_info.strings = (char *)map_range(str64->offset, str64->size);
+        symbols_info.strings_size = str64->size;
+        xcDebug("XLinSpeak: Symtab @ %lX\n", (long unsigned int)sh64->offset);
+        xcDebug("XLinSpeak: Stringtab @ %lX\n", (long unsigned int)str64->offset);
+        break;
       }
     }
   }
@@ -225,26 +227,58 @@ static bool parse_elf(FILE *f)
   return true;
 }
 
+//Maps the executable read only; the symbol and string tables are used in place
 bool locate_tables(void)
 {
+  double start = now_ms();
   pid_t pid = getpid();
+  struct stat st;
+  void *map;
   snprintf(exe, sizeof(exe), "/proc/%d/exe", (int)pid);
-  FILE *f = fopen(exe, "r");
-  if(f == NULL){
-    perror("Open: ");
+  int fd = open(exe, O_RDONLY | O_CLOEXEC);
+  if(fd < 0){
+    xcDebug("XLinSpeak: Can't open %s (%s).\n", exe, strerror(errno));
     return false;
   }
-  if(!parse_elf(f)){
+  if((fstat(fd, &st) != 0) || (st.st_size <= 0)){
+    xcDebug("XLinSpeak: Can't stat %s.\n", exe);
+    close(fd);
+    return false;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    xcDebug("XLinSpeak: Can't map %s (%s).\n", exe, strerror(errno));
+    return false;
+  }
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+  symbols_info.map = (uint8_t *)map;
+  symbols_info.map_size = (size_t)st.st_size;
+
+  if(!parse_elf()){
     xcDebug("XLinSpeak: Can't parse elf.\n");
+    release_tables();
     return false;
   }
-  if((symbols_info.symbol_table== NULL) || (symbols_info.strings == NULL)){
+  if((symbols_info.symbol_table== NULL) || (symbols_info.strings == NULL) ||
+     (symbols_info.strings_size == 0) || (symbols_info.strings[symbols_info.strings_size - 1] != '\0')){
     xcDebug("XLinSpeak: Problem loading tables.\n");
+    release_tables();
     return false;
   }
+  xcDebug("XLinSpeak: Symbol tables loaded in %.2f ms.\n", now_ms() - start);
   return true;
 }
 
+//Drops the mapping; nothing in it is needed once the hook targets are resolved
+void release_tables(void)
+{
+  if(symbols_info.map != NULL){
+    munmap(symbols_info.map, symbols_info.map_size);
+  }
+  memset(&symbols_info, 0, sizeof(symbols_info));
+}
+
 
 struct symbol32{
   uint32_t name;
@@ -265,6 +299,71 @@ struct symbol64{
 }__attribute__((packed));
 
 
+//Target names hashed into a small open addressing table, so each symbol
+//costs one pass over its name and (almost always) a single probe
+struct target{
+  uint64_t hash;
+  size_t len;
+  int idx; //into ptrs, -1 for an empty slot
+};
+
+struct target_table{
+  struct target *slots;
+  unsigned mask;
+};
+
+static bool targets_build(struct target_table *t, const struct function_ptrs *ptrs, int funcs)
+{
+  unsigned size = 8;
+  int j;
+  while(size < (unsigned)funcs * 2){
+    size <<= 1;
+  }
+  t->slots = (struct target *)malloc(size * sizeof(struct target));
+  if(t->slots == NULL){
+    return false;
+  }
+  t->mask = size - 1;
+  for(j = 0; j < (int)size; ++j){
+    t->slots[j].idx = -1;
+  }
+  for(j = 0; j < funcs; ++j){
+    size_t len = strlen(ptrs[j].name);
+    uint64_t hash = fnv1a64(FNV1A64_INIT, ptrs[j].name, len);
+    unsigned pos = (unsigned)hash & t->mask;
+    while(t->slots[pos].idx >= 0){
+      pos = (pos + 1) & t->mask;
+    }
+    t->slots[pos].hash = hash;
+    t->slots[pos].len = len;
+    t->slots[pos].idx = j;
+  }
+  return true;
+}
+
+//Returns index into ptrs of the (still unresolved) target called name, or -1
+static int targets_match(const struct target_table *t, const struct function_ptrs *ptrs, const char *name)
+{
+  const uint8_t *p = (const uint8_t *)name;
+  uint64_t hash = FNV1A64_INIT;
+  size_t len;
+  unsigned pos;
+
+  while(*p){
+    hash ^= *p++;
+    hash *= 0x100000001b3ULL;
+  }
+  len = (size_t)(p - (const uint8_t *)name);
+  for(pos = (unsigned)hash & t->mask; t->slots[pos].idx >= 0; pos = (pos + 1) & t->mask){
+    const struct target *tg = &t->slots[pos];
+    if((tg->hash == hash) && (tg->len == len) && (ptrs[tg->idx].address == 0) &&
+       (memcmp(name, ptrs[tg->idx].name, len) == 0)){
+      return tg->idx;
+    }
+  }
+  return -1;
+}
+
 bool find_functions(struct function_ptrs *ptrs, int funcs)
 {
   xcDebug("XLinSpeak: %d functions to check.\n", funcs);
@@ -272,48 +371,201 @@ bool find_functions(struct function_ptrs *ptrs, int funcs)
     xcDebug("XLinSpeak: Load tables first.\n");
     return false;
   }
+  struct target_table targets;
+  double start = now_ms();
   long i;
+  long records;
   int j;
-  bool res = false;
+  int found = 0;
+  for(j = 0; j < funcs; ++j){
+    if(ptrs[j].address != 0){
+      ++found;
+    }
+  }
+  if(!targets_build(&targets, ptrs, funcs)){
+    xcDebug("XLinSpeak: Couldn't allocate the symbol lookup table.\n");
+    return false;
+  }
   if(symbols_info.bits == 32){
     struct symbol32 *sym_ptr = (struct symbol32 *) (symbols_info.symbol_table);
-    long records = symbols_info.size / sizeof(struct symbol32);
-    //xcDebug("XLinSpeak: Size: %lud, len: %lud, rec: %ld\n", (long unsigned int)symbols_info.size, (long unsigned int)sizeof(struct symbol32), records);
-    for(i = 0; i < records; ++i){
-      if((sym_ptr[i].name != 0) && ((sym_ptr[i].info & 0x0f) == ST_FUNC) && (sym_ptr[i].size > 0)){
+    records = symbols_info.size / sizeof(struct symbol32);
+    for(i = 0; (i < records) && (found < funcs); ++i){
+      if((sym_ptr[i].name != 0) && (sym_ptr[i].name < symbols_info.strings_size) && ((sym_ptr[i].info & 0x0f) == ST_FUNC) && (sym_ptr[i].size > 0)){
         char *name = sym_ptr[i].name + symbols_info.strings;
-        for(j = 0; j < funcs; ++j){
-          if((ptrs[j].address == 0) && (strcmp(name, ptrs[j].name) == 0)){
-            ptrs[j].address = (uint64_t)sym_ptr[i].value;
-            xcDebug("XLinSpeak: Symbol %s -> %08X\n", name, sym_ptr[i].value);
-	    res = true;
-	    break;
-          }
+        if((j = targets_match(&targets, ptrs, name)) >= 0){
+          ptrs[j].address = (uint64_t)sym_ptr[i].value;
+          xcDebug("XLinSpeak: Symbol %s -> %08X\n", name, sym_ptr[i].value);
+          ++found;
         }
       }
     }
   }else{
     struct symbol64 *sym_ptr = (struct symbol64 *) (symbols_info.symbol_table);
-    long records = symbols_info.size / sizeof(struct symbol64);
-    //xcDebug("XLinSpeak: Size: %lud, len: %lud, rec: %ld\n", (long unsigned int)symbols_info.size, (long unsigned int)sizeof(struct symbol64), records);
-    for(i = 0; i < records; ++i){
-      //xcDebug("XLinSpeak: addr: %lX, str: %X\n", sym_ptr[i].value, sym_ptr[i].name);
-      if((sym_ptr[i].name != 0) && ((sym_ptr[i].info & 0x0f) == ST_FUNC) && (sym_ptr[i].size > 0)){
+    records = symbols_info.size / sizeof(struct symbol64);
+    for(i = 0; (i < records) && (found < funcs); ++i){
+      if((sym_ptr[i].name != 0) && (sym_ptr[i].name < symbols_info.strings_size) && ((sym_ptr[i].info & 0x0f) == ST_FUNC) && (sym_ptr[i].size > 0)){
         char *name = sym_ptr[i].name + symbols_info.strings;
-        for(j = 0; j < funcs; ++j){
-          if((ptrs[j].address == 0) && (strcmp(name, ptrs[j].name) == 0)){
-            ptrs[j].address = (uint64_t)sym_ptr[i].value;
-            xcDebug("XLinSpeak: Symbol %s -> %lX\n", name, (long unsigned int)sym_ptr[i].value);
-	    res = true;
-	    break;
-          }
+        if((j = targets_match(&targets, ptrs, name)) >= 0){
+          ptrs[j].address = (uint64_t)sym_ptr[i].value;
+          xcDebug("XLinSpeak: Symbol %s -> %lX\n", name, (long unsigned int)sym_ptr[i].value);
+          ++found;
         }
       }
     }
   }
+  free(targets.slots);
+  xcDebug("XLinSpeak: Resolved %d of %d functions, scanned %ld of %ld symbols in %.2f ms.\n",
+          found, funcs, i, records, now_ms() - start);
+  return found > 0;
+}
+
+#define ADDR_CACHE_MAGIC "XLinSpeak address cache 1"
+#define NT_GNU_BUILD_ID 3
+
+struct build_id{
+  char *hex;
+  size_t len;
+  bool found;
+};
+
+//The main executable is always reported first
+static int build_id_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+  struct build_id *id = (struct build_id *)data;
+  int i;
+  (void)size;
+  for(i = 0; (i < info->dlpi_phnum) && !id->found; ++i){
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    const uint8_t *p, *end;
+    if(ph->p_type != PT_NOTE){
+      continue;
+    }
+    p = (const uint8_t *)(info->dlpi_addr + ph->p_vaddr);
+    end = p + ph->p_memsz;
+    while(p + sizeof(ElfW(Nhdr)) <= end){
+      const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)p;
+      const uint8_t *name = p + sizeof(*nh);
+      const uint8_t *desc = name + ((nh->n_namesz + 3) & ~3u);
+      if(desc + nh->n_descsz > end){
+        break;
+      }
+      if((nh->n_type == NT_GNU_BUILD_ID) && (nh->n_namesz == 4) && (memcmp(name, "GNU", 4) == 0) &&
+         (nh->n_descsz > 0) && (nh->n_descsz * 2 < id->len)){
+        uint32_t j;
+        for(j = 0; j < nh->n_descsz; ++j){
+          snprintf(id->hex + j * 2, 3, "%02x", desc[j]);
+        }
+        id->found = true;
+        break;
+      }
+      p = desc + ((nh->n_descsz + 3) & ~3u);
+    }
+  }
+  return 1;
+}
+
+static bool exe_build_id(char *hex, size_t len)
+{
+  struct build_id id = {.hex = hex, .len = len, .found = false};
+  dl_iterate_phdr(build_id_cb, &id);
+  return id.found;
+}
+
+static bool addr_cache_parse(FILE *f, const char *id, const struct function_ptrs *ptrs, int funcs, uint64_t *addrs)
+{
+  char line[1024];
+  char name[1024];
+  unsigned long long addr;
+  int found = 0;
+  int j;
+
+  if((fgets(line, sizeof(line), f) == NULL) || (strcmp(line, ADDR_CACHE_MAGIC "\n") != 0)){
+    return false;
+  }
+  if((fgets(line, sizeof(line), f) == NULL) || (strncmp(line, "build-id ", 9) != 0) ||
+     (strlen(line + 9) != strlen(id) + 1) || (strncmp(line + 9, id, strlen(id)) != 0)){
+    xcDebug("XLinSpeak: Executable changed, rebuilding address cache.\n");
+    return false;
+  }
+  while(fgets(line, sizeof(line), f) != NULL){
+    if(sscanf(line, "%llx %1023s", &addr, name) != 2){
+      return false;
+    }
+    for(j = 0; j < funcs; ++j){
+      if(strcmp(name, ptrs[j].name) == 0){
+        addrs[j] = (uint64_t)addr;
+        ++found;
+        break;
+      }
+    }
+  }
+  //otherwise the plugin looks for a different set of functions now
+  return found == funcs;
+}
+
+//Fills in ptrs from the cache file if it was written for this very executable
+bool addr_cache_load(const char *path, struct function_ptrs *ptrs, int funcs)
+{
+  double start = now_ms();
+  char id[128];
+  uint64_t *addrs;
+  int j;
+  bool res;
+
+  if(!exe_build_id(id, sizeof(id))){
+    xcDebug("XLinSpeak: Executable has no build-id, address cache not used.\n");
+    return false;
+  }
+  FILE *f = fopen(path, "r");
+  if(f == NULL){
+    return false;
+  }
+  addrs = (uint64_t *)calloc(funcs, sizeof(uint64_t));
+  if(addrs == NULL){
+    fclose(f);
+    return false;
+  }
+  res = addr_cache_parse(f, id, ptrs, funcs, addrs);
+  fclose(f);
+  if(res){
+    for(j = 0; j < funcs; ++j){
+      ptrs[j].address = addrs[j];
+    }
+    xcDebug("XLinSpeak: Addresses taken from %s in %.2f ms.\n", path, now_ms() - start);
+  }
+  free(addrs);
   return res;
 }
 
+//Written to a temporary file and renamed, so a crash never leaves half a cache
+void addr_cache_store(const char *path, const struct function_ptrs *ptrs, int funcs)
+{
+  char id[128];
+  char tmp[2048];
+  int j;
+  bool ok;
+
+  if(!exe_build_id(id, sizeof(id))){
+    return;
+  }
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  FILE *f = fopen(tmp, "w");
+  if(f == NULL){
+    xcDebug("XLinSpeak: Can't write address cache %s (%s).\n", tmp, strerror(errno));
+    return;
+  }
+  fprintf(f, ADDR_CACHE_MAGIC "\nbuild-id %s\n", id);
+  for(j = 0; j < funcs; ++j){
+    fprintf(f, "%llx %s\n", (unsigned long long)ptrs[j].address, ptrs[j].name);
+  }
+  ok = (fflush(f) == 0) && !ferror(f);
+  ok = (fclose(f) == 0) && ok;
+  if(!ok || (rename(tmp, path) != 0)){
+    xcDebug("XLinSpeak: Can't write address cache %s.\n", path);
+    unlink(tmp);
+  }
+}
+
 /*
 int main(int argc, char *argv[])
 {
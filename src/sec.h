@@ -9,6 +9,7 @@ extern "C" {
 #endif
 
 bool locate_tables(void);
+void release_tables(void);
 
 struct function_ptrs{
   const char *name;
@@ -18,6 +19,9 @@ struct function_ptrs{
 
 bool find_functions(struct function_ptrs *ptrs, int funcs);
 
+bool addr_cache_load(const char *path, struct function_ptrs *ptrs, int funcs);
+void addr_cache_store(const char *path, const struct function_ptrs *ptrs, int funcs);
+
 #ifdef __cplusplus
 }
 #endif
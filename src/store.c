@@ -0,0 +1,806 @@
+/******************************************************************************
+Persistent phrase cache: mmap'd index over append-only ADPCM data files
+******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "cache.h"
+#include "utils.h"
+
+#define STORE_MAGIC "XLinSpeak pcm 1"
+//Index slots, a power of two. Compaction keeps at most half of them.
+#define STORE_SLOTS 16384
+//Data files open at once: the current one and those being compacted
+#define STORE_FILES 8
+#define STORE_CHANNELS_MAX 8
+#define RECORD_MAGIC 0x4d435058U
+
+/*
+ * The index is an open addressing table in a shared mapping of the index
+ * file, so opening the store reads nothing but the pages lookups touch.
+ * Slots point into data.<n> files that are only ever appended to. When the
+ * files outgrow the budget, the most recently used entries that fit 3/4 of
+ * it are moved into a fresh file on a background thread and the old files
+ * are deleted. Records repeat their key and text, so a slot left pointing
+ * at garbage by a crash costs a miss and nothing else.
+ */
+struct store_slot {
+  uint64_t key;  //0 for never used
+  uint64_t voice;
+  uint64_t off;
+  uint64_t used; //store clock at the last hit
+  uint32_t file; //0 for a deleted entry
+  uint32_t len;
+};
+
+struct store_header {
+  char magic[16];
+  uint32_t slots;
+  uint32_t filled; //slots holding an entry or a deleted one
+  uint32_t file_first;
+  uint32_t file_cur; //appended to
+  uint64_t clock;
+  uint64_t live_bytes;
+};
+
+enum record_codec {
+  CODEC_RAW = 0,
+  CODEC_ADPCM //IMA ADPCM, 4 bits per 16-bit sample
+};
+
+//Followed by the normalized text with its NUL and the coded audio
+struct record_header {
+  uint32_t magic;
+  uint32_t text_len;
+  uint64_t key;
+  uint64_t voice;
+  uint32_t sample_rate;
+  uint16_t format;
+  uint16_t channels;
+  uint16_t bits_per_sample;
+  uint16_t codec;
+  uint32_t pcm_len;
+  uint32_t data_len;
+};
+
+struct store_file {
+  uint32_t id;
+  int fd;
+  uint64_t size;
+};
+
+static struct {
+  bool ready;
+  bool stop;
+  bool compact;
+  int index_fd;
+  size_t map_len;
+  struct store_header *hdr;
+  struct store_slot *slots;
+  struct store_file files[STORE_FILES];
+  unsigned nfiles;
+  size_t budget;
+  char dir[PATH_MAX - 32];
+  struct store_stats stats;
+  pthread_t thread;
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+} store = {.index_fd = -1};
+
+static const int8_t adpcm_index[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int16_t adpcm_step[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+  11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+  32767
+};
+
+struct adpcm_state {
+  int pred;
+  int index;
+};
+
+static int adpcm_apply(struct adpcm_state *st, int nib)
+{
+  int step = adpcm_step[st->index];
+  int diff = step >> 3;
+  if(nib & 4){
+    diff += step;
+  }
+  if(nib & 2){
+    diff += step >> 1;
+  }
+  if(nib & 1){
+    diff += step >> 2;
+  }
+  st->pred += (nib & 8) ? -diff : diff;
+  if(st->pred > 32767){
+    st->pred = 32767;
+  }else if(st->pred < -32768){
+    st->pred = -32768;
+  }
+  st->index += adpcm_index[nib];
+  if(st->index < 0){
+    st->index = 0;
+  }else if(st->index > 88){
+    st->index = 88;
+  }
+  return st->pred;
+}
+
+//The encoder tracks the decoder exactly, so errors don't accumulate
+static int adpcm_nibble(struct adpcm_state *st, int sample)
+{
+  int step = adpcm_step[st->index];
+  int diff = sample - st->pred;
+  int nib = 0;
+  if(diff < 0){
+    nib = 8;
+    diff = -diff;
+  }
+  if(diff >= step){
+    nib |= 4;
+    diff -= step;
+  }
+  step >>= 1;
+  if(diff >= step){
+    nib |= 2;
+    diff -= step;
+  }
+  step >>= 1;
+  if(diff >= step){
+    nib |= 1;
+  }
+  adpcm_apply(st, nib);
+  return nib;
+}
+
+//n interleaved samples, two per byte, low nibble first
+static void adpcm_encode(const int16_t *in, size_t n, unsigned channels, uint8_t *out)
+{
+  struct adpcm_state st[STORE_CHANNELS_MAX];
+  size_t i;
+  memset(st, 0, sizeof(st));
+  memset(out, 0, (n + 1) / 2);
+  for(i = 0; i < n; ++i){
+    out[i / 2] |= (uint8_t)(adpcm_nibble(&st[i % channels], in[i]) << ((i & 1) * 4));
+  }
+}
+
+static void adpcm_decode(const uint8_t *in, size_t n, unsigned channels, int16_t *out)
+{
+  struct adpcm_state st[STORE_CHANNELS_MAX];
+  size_t i;
+  memset(st, 0, sizeof(st));
+  for(i = 0; i < n; ++i){
+    out[i] = (int16_t)adpcm_apply(&st[i % channels], (in[i / 2] >> ((i & 1) * 4)) & 15);
+  }
+}
+
+static uint8_t *record_make(uint64_t voice, uint64_t key, const char *text,
+                            const struct pcm_buf *pcm, uint32_t *len)
+{
+  struct record_header rh;
+  char *norm;
+  uint8_t *rec;
+  size_t size;
+
+  if(pcm->len > UINT32_MAX / 2){
+    return NULL;
+  }
+  norm = cache_norm_dup(text);
+  if(norm == NULL){
+    return NULL;
+  }
+  memset(&rh, 0, sizeof(rh));
+  rh.magic = RECORD_MAGIC;
+  rh.text_len = (uint32_t)strlen(norm) + 1;
+  rh.key = key;
+  rh.voice = voice;
+  rh.sample_rate = pcm->info.sample_rate;
+  rh.format = pcm->info.format;
+  rh.channels = pcm->info.channels;
+  rh.bits_per_sample = pcm->info.bits_per_sample;
+  rh.pcm_len = (uint32_t)pcm->len;
+  if(rh.format == 1 && rh.bits_per_sample == 16 && rh.channels > 0 &&
+     rh.channels <= STORE_CHANNELS_MAX && pcm->len % 2 == 0){
+    rh.codec = CODEC_ADPCM;
+    rh.data_len = (uint32_t)((pcm->len / 2 + 1) / 2);
+  }else{
+    rh.codec = CODEC_RAW;
+    rh.data_len = rh.pcm_len;
+  }
+  size = sizeof(rh) + rh.text_len + rh.data_len;
+  rec = (uint8_t *)malloc(size);
+  if(rec == NULL){
+    free(norm);
+    return NULL;
+  }
+  memcpy(rec, &rh, sizeof(rh));
+  memcpy(rec + sizeof(rh), norm, rh.text_len);
+  if(rh.codec == CODEC_ADPCM){
+    adpcm_encode((const int16_t *)pcm->data, pcm->len / 2, rh.channels, rec + sizeof(rh) + rh.text_len);
+  }else{
+    memcpy(rec + sizeof(rh) + rh.text_len, pcm->data, pcm->len);
+  }
+  free(norm);
+  *len = (uint32_t)size;
+  return rec;
+}
+
+static bool record_decode(const uint8_t *rec, uint32_t len, uint64_t voice, uint64_t key,
+                          const char *text, struct pcm_buf *out)
+{
+  struct record_header rh;
+  const char *norm;
+  const uint8_t *data;
+
+  if(len < sizeof(rh)){
+    return false;
+  }
+  memcpy(&rh, rec, sizeof(rh));
+  if(rh.magic != RECORD_MAGIC || rh.key != key || rh.voice != voice || rh.text_len == 0 ||
+     (uint64_t)sizeof(rh) + rh.text_len + rh.data_len != len){
+    return false;
+  }
+  norm = (const char *)rec + sizeof(rh);
+  data = rec + sizeof(rh) + rh.text_len;
+  if(norm[rh.text_len - 1] != '\0' || !cache_norm_equal(norm, text)){
+    return false;
+  }
+  if(rh.codec == CODEC_ADPCM){
+    if(rh.bits_per_sample != 16 || rh.channels == 0 || rh.channels > STORE_CHANNELS_MAX ||
+       rh.pcm_len % 2 != 0 || rh.data_len != (rh.pcm_len / 2 + 1) / 2){
+      return false;
+    }
+  }else if(rh.codec != CODEC_RAW || rh.data_len != rh.pcm_len){
+    return false;
+  }
+  out->data = (uint8_t *)malloc(rh.pcm_len ? rh.pcm_len : 1);
+  if(out->data == NULL){
+    return false;
+  }
+  if(rh.codec == CODEC_ADPCM){
+    adpcm_decode(data, rh.pcm_len / 2, rh.channels, (int16_t *)out->data);
+  }else{
+    memcpy(out->data, data, rh.pcm_len);
+  }
+  out->info.format = rh.format;
+  out->info.channels = rh.channels;
+  out->info.sample_rate = rh.sample_rate;
+  out->info.bits_per_sample = rh.bits_per_sample;
+  out->len = rh.pcm_len;
+  return true;
+}
+
+static struct store_file *file_get(uint32_t id)
+{
+  unsigned i;
+  for(i = 0; i < store.nfiles; ++i){
+    if(store.files[i].id == id){
+      return &store.files[i];
+    }
+  }
+  return NULL;
+}
+
+static struct store_file *file_open(uint32_t id)
+{
+  struct store_file *f;
+  struct stat st;
+  char path[PATH_MAX];
+  int fd;
+
+  if(store.nfiles == STORE_FILES){
+    return NULL;
+  }
+  snprintf(path, sizeof(path), "%s/data.%u", store.dir, id);
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(fd < 0){
+    xcDebug("XLinSpeak: Can't open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if(fstat(fd, &st) != 0){
+    close(fd);
+    return NULL;
+  }
+  f = &store.files[store.nfiles++];
+  f->id = id;
+  f->fd = fd;
+  f->size = (uint64_t)st.st_size;
+  store.stats.bytes += f->size;
+  return f;
+}
+
+static void file_remove(uint32_t id)
+{
+  struct store_file *f = file_get(id);
+  char path[PATH_MAX];
+  if(f == NULL){
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/data.%u", store.dir, id);
+  unlink(path);
+  close(f->fd);
+  store.stats.bytes -= f->size;
+  *f = store.files[--store.nfiles];
+}
+
+//Deleted data files a reset or a crash left behind
+static void dir_clear(void)
+{
+  DIR *d = opendir(store.dir);
+  struct dirent *de;
+  if(d == NULL){
+    return;
+  }
+  while((de = readdir(d)) != NULL){
+    if(strncmp(de->d_name, "data.", 5) == 0){
+      unlinkat(dirfd(d), de->d_name, 0);
+    }
+  }
+  closedir(d);
+}
+
+static uint64_t slot_key(uint64_t key)
+{
+  return key != 0 ? key : 1;
+}
+
+static struct store_slot *slot_find(uint64_t voice, uint64_t key)
+{
+  uint32_t mask = STORE_SLOTS - 1;
+  uint32_t i = (uint32_t)key & mask;
+  uint32_t n;
+  for(n = 0; n < STORE_SLOTS; ++n, i = (i + 1) & mask){
+    struct store_slot *s = &store.slots[i];
+    if(s->key == 0){
+      return NULL;
+    }
+    if(s->key == key && s->voice == voice && s->file != 0){
+      return s;
+    }
+  }
+  return NULL;
+}
+
+//First deleted or unused slot of key's chain
+static struct store_slot *slot_free(uint64_t key)
+{
+  uint32_t mask = STORE_SLOTS - 1;
+  uint32_t i = (uint32_t)key & mask;
+  uint32_t n;
+  for(n = 0; n < STORE_SLOTS; ++n, i = (i + 1) & mask){
+    struct store_slot *s = &store.slots[i];
+    if(s->key == 0 || s->file == 0){
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static void slot_delete(struct store_slot *s)
+{
+  store.hdr->live_bytes -= s->len;
+  store.stats.entries -= 1;
+  s->file = 0;
+}
+
+//Reinserts the live entries, dropping the deleted ones off the chains
+static void index_rebuild(void)
+{
+  struct store_slot *live = (struct store_slot *)malloc(STORE_SLOTS * sizeof(*live));
+  uint32_t i, n = 0;
+  if(live == NULL){
+    return;
+  }
+  for(i = 0; i < STORE_SLOTS; ++i){
+    if(store.slots[i].key != 0 && store.slots[i].file != 0){
+      live[n++] = store.slots[i];
+    }
+  }
+  memset(store.slots, 0, STORE_SLOTS * sizeof(*live));
+  store.hdr->filled = n;
+  for(i = 0; i < n; ++i){
+    *slot_free(live[i].key) = live[i];
+  }
+  free(live);
+}
+
+static bool index_open(void)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  bool fresh;
+  void *map;
+
+  snprintf(path, sizeof(path), "%s/index", store.dir);
+  store.map_len = sizeof(struct store_header) + STORE_SLOTS * sizeof(struct store_slot);
+  store.index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(store.index_fd < 0){
+    xcDebug("XLinSpeak: Can't open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  if(flock(store.index_fd, LOCK_EX | LOCK_NB) != 0){
+    xcDebug("XLinSpeak: Disk cache %s is used by another X-Plane.\n", store.dir);
+    return false;
+  }
+  fresh = fstat(store.index_fd, &st) != 0 || (size_t)st.st_size != store.map_len;
+  if(fresh && (ftruncate(store.index_fd, 0) != 0 || ftruncate(store.index_fd, (off_t)store.map_len) != 0)){
+    return false;
+  }
+  map = mmap(NULL, store.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, store.index_fd, 0);
+  if(map == MAP_FAILED){
+    return false;
+  }
+  store.hdr = (struct store_header *)map;
+  store.slots = (struct store_slot *)(store.hdr + 1);
+  if(!fresh && (memcmp(store.hdr->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0 ||
+                store.hdr->slots != STORE_SLOTS || store.hdr->file_first == 0 ||
+                store.hdr->file_cur < store.hdr->file_first ||
+                store.hdr->file_cur - store.hdr->file_first >= STORE_FILES)){
+    xcDebug("XLinSpeak: Disk cache index not understood, starting over.\n");
+    fresh = true;
+  }
+  if(fresh){
+    memset(map, 0, store.map_len);
+    memcpy(store.hdr->magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    store.hdr->slots = STORE_SLOTS;
+    store.hdr->file_first = 1;
+    store.hdr->file_cur = 1;
+    dir_clear();
+  }
+  return true;
+}
+
+//Drops entries of other voices and any pointing past the end of their file
+static void index_check(const uint64_t voices[], unsigned count)
+{
+  uint32_t i;
+  unsigned v;
+  store.hdr->live_bytes = 0;
+  for(i = 0; i < STORE_SLOTS; ++i){
+    struct store_slot *s = &store.slots[i];
+    struct store_file *f;
+    if(s->key == 0 || s->file == 0){
+      continue;
+    }
+    f = file_get(s->file);
+    for(v = 0; v < count && voices[v] != s->voice; ++v){
+    }
+    if(v == count){
+      store.stats.invalidated += 1;
+      s->file = 0;
+    }else if(f == NULL || s->off + s->len > f->size){
+      s->file = 0;
+    }else{
+      store.hdr->live_bytes += s->len;
+      store.stats.entries += 1;
+    }
+  }
+}
+
+static bool store_need_compact(void)
+{
+  return store.stats.bytes > store.budget || store.hdr->filled >= STORE_SLOTS / 4 * 3 ||
+         store.stats.bytes - store.hdr->live_bytes > store.budget / 2;
+}
+
+struct compact_item {
+  uint32_t slot;
+  uint64_t key;
+  uint64_t used;
+};
+
+static int compact_cmp(const void *a, const void *b)
+{
+  const struct compact_item *x = (const struct compact_item *)a;
+  const struct compact_item *y = (const struct compact_item *)b;
+  return x->used < y->used ? 1 : x->used > y->used ? -1 : 0;
+}
+
+//Copies one record into the current file, called with store.mtx held
+static bool compact_move(struct store_slot *s)
+{
+  struct store_file *from = file_get(s->file);
+  struct store_file *to = file_get(store.hdr->file_cur);
+  uint8_t *rec;
+  bool ok;
+  if(from == NULL || to == NULL){
+    return false;
+  }
+  rec = (uint8_t *)malloc(s->len);
+  if(rec == NULL){
+    return false;
+  }
+  ok = pread(from->fd, rec, s->len, (off_t)s->off) == (ssize_t)s->len &&
+       pwrite(to->fd, rec, s->len, (off_t)to->size) == (ssize_t)s->len;
+  free(rec);
+  if(ok){
+    s->file = to->id;
+    s->off = to->size;
+    to->size += s->len;
+    store.stats.bytes += s->len;
+  }
+  return ok;
+}
+
+//On the store thread with store.mtx held; lookups and appends go on
+//between the records it moves
+static void store_compact(void)
+{
+  uint32_t first = store.hdr->file_first;
+  uint32_t last = store.hdr->file_cur;
+  struct compact_item *items;
+  uint64_t keep = 0;
+  uint32_t i, n = 0, kept = 0;
+
+  if(file_open(last + 1) == NULL){
+    return;
+  }
+  store.hdr->file_cur = last + 1;
+  items = (struct compact_item *)malloc(STORE_SLOTS * sizeof(*items));
+  if(items == NULL){
+    return;
+  }
+  for(i = 0; i < STORE_SLOTS; ++i){
+    struct store_slot *s = &store.slots[i];
+    if(s->key != 0 && s->file != 0 && s->file <= last){
+      items[n].slot = i;
+      items[n].key = s->key;
+      items[n].used = s->used;
+      n += 1;
+    }
+  }
+  qsort(items, n, sizeof(*items), compact_cmp);
+  for(i = 0; i < n && !store.stop; ++i){
+    struct store_slot *s = &store.slots[items[i].slot];
+    //replaced or deleted while the lock was dropped
+    if(s->key != items[i].key || s->file == 0 || s->file > last){
+      continue;
+    }
+    if(keep + s->len > store.budget / 4 * 3 || kept >= STORE_SLOTS / 2 || !compact_move(s)){
+      slot_delete(s);
+      continue;
+    }
+    keep += s->len;
+    kept += 1;
+    pthread_mutex_unlock(&store.mtx);
+    pthread_mutex_lock(&store.mtx);
+  }
+  free(items);
+  if(store.stop){
+    return;
+  }
+  for(i = first; i <= last; ++i){
+    file_remove(i);
+  }
+  store.hdr->file_first = last + 1;
+  index_rebuild();
+  msync(store.hdr, store.map_len, MS_ASYNC);
+  store.stats.compactions += 1;
+  xcDebug("XLinSpeak: Disk cache compacted to %lu entries, %lu bytes.\n",
+          (unsigned long)store.stats.entries, (unsigned long)store.stats.bytes);
+}
+
+static void *store_worker(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&store.mtx);
+  while(!store.stop){
+    if(!store.compact){
+      pthread_cond_wait(&store.cv, &store.mtx);
+      continue;
+    }
+    store.compact = false;
+    store_compact();
+  }
+  pthread_mutex_unlock(&store.mtx);
+  return NULL;
+}
+
+static void store_release(void)
+{
+  unsigned i;
+  if(store.hdr != NULL){
+    msync(store.hdr, store.map_len, MS_SYNC);
+    munmap(store.hdr, store.map_len);
+    store.hdr = NULL;
+    store.slots = NULL;
+  }
+  for(i = 0; i < store.nfiles; ++i){
+    close(store.files[i].fd);
+  }
+  store.nfiles = 0;
+  if(store.index_fd >= 0){
+    close(store.index_fd);
+    store.index_fd = -1;
+  }
+}
+
+bool store_open(const char *dir, size_t budget, const uint64_t voices[], unsigned count)
+{
+  uint32_t id;
+
+  if(store.ready){
+    return true;
+  }
+  memset(&store.stats, 0, sizeof(store.stats));
+  store.budget = budget;
+  store.stats.budget = budget;
+  store.stop = false;
+  store.compact = false;
+  if(budget == 0 || dir == NULL || strlen(dir) >= sizeof(store.dir)){
+    return false;
+  }
+  strcpy(store.dir, dir);
+  if(mkdir(dir, 0755) != 0 && errno != EEXIST){
+    xcDebug("XLinSpeak: Can't create %s: %s\n", dir, strerror(errno));
+    return false;
+  }
+  if(!index_open()){
+    store_release();
+    return false;
+  }
+  for(id = store.hdr->file_first; id <= store.hdr->file_cur; ++id){
+    if(file_open(id) == NULL){
+      store_release();
+      return false;
+    }
+  }
+  index_check(voices, count);
+  pthread_mutex_init(&store.mtx, NULL);
+  pthread_cond_init(&store.cv, NULL);
+  store.compact = store.stats.invalidated > 0 || store_need_compact();
+  if(pthread_create(&store.thread, NULL, store_worker, NULL) != 0){
+    pthread_mutex_destroy(&store.mtx);
+    pthread_cond_destroy(&store.cv);
+    store_release();
+    return false;
+  }
+  store.ready = true;
+  return true;
+}
+
+void store_close(void)
+{
+  if(!store.ready){
+    return;
+  }
+  pthread_mutex_lock(&store.mtx);
+  store.stop = true;
+  pthread_cond_signal(&store.cv);
+  pthread_mutex_unlock(&store.mtx);
+  pthread_join(store.thread, NULL);
+  store.ready = false;
+  pthread_mutex_destroy(&store.mtx);
+  pthread_cond_destroy(&store.cv);
+  store_release();
+}
+
+bool store_get(uint64_t voice, uint64_t key, const char *text, struct pcm_buf *out)
+{
+  struct store_slot *s;
+  struct store_file *f;
+  uint8_t *rec = NULL;
+  uint32_t len = 0;
+  bool ok = false;
+
+  if(!store.ready){
+    return false;
+  }
+  key = slot_key(key);
+  pthread_mutex_lock(&store.mtx);
+  s = slot_find(voice, key);
+  f = s != NULL ? file_get(s->file) : NULL;
+  if(f != NULL){
+    len = s->len;
+    rec = (uint8_t *)malloc(len);
+    ok = rec != NULL && pread(f->fd, rec, len, (off_t)s->off) == (ssize_t)len;
+    if(ok){
+      s->used = ++store.hdr->clock;
+    }
+  }
+  pthread_mutex_unlock(&store.mtx);
+  //decoded outside the lock, the record is a private copy
+  ok = ok && record_decode(rec, len, voice, key, text, out);
+  free(rec);
+  pthread_mutex_lock(&store.mtx);
+  if(ok){
+    store.stats.hits += 1;
+  }else{
+    store.stats.misses += 1;
+  }
+  pthread_mutex_unlock(&store.mtx);
+  return ok;
+}
+
+bool store_has(uint64_t voice, uint64_t key)
+{
+  bool res;
+  if(!store.ready){
+    return false;
+  }
+  pthread_mutex_lock(&store.mtx);
+  res = slot_find(voice, slot_key(key)) != NULL;
+  pthread_mutex_unlock(&store.mtx);
+  return res;
+}
+
+void store_put(uint64_t voice, uint64_t key, const char *text, const struct pcm_buf *pcm)
+{
+  struct store_slot *s;
+  struct store_file *f;
+  uint8_t *rec;
+  uint32_t len = 0;
+
+  if(!store.ready || pcm == NULL || pcm->len == 0){
+    return;
+  }
+  key = slot_key(key);
+  rec = record_make(voice, key, text, pcm, &len);
+  if(rec == NULL){
+    return;
+  }
+  if(len > store.budget / 4){
+    free(rec);
+    return;
+  }
+  pthread_mutex_lock(&store.mtx);
+  s = slot_find(voice, key);
+  if(s != NULL){
+    slot_delete(s);
+  }
+  s = store.hdr->filled < STORE_SLOTS / 4 * 3 ? slot_free(key) : NULL;
+  f = file_get(store.hdr->file_cur);
+  if(s != NULL && f != NULL && pwrite(f->fd, rec, len, (off_t)f->size) == (ssize_t)len){
+    if(s->key == 0){
+      store.hdr->filled += 1;
+    }
+    s->key = key;
+    s->voice = voice;
+    s->off = f->size;
+    s->len = len;
+    s->used = ++store.hdr->clock;
+    s->file = f->id;
+    f->size += len;
+    store.hdr->live_bytes += len;
+    store.stats.bytes += len;
+    store.stats.entries += 1;
+    store.stats.puts += 1;
+  }
+  if(store_need_compact() && !store.compact){
+    store.compact = true;
+    pthread_cond_signal(&store.cv);
+  }
+  pthread_mutex_unlock(&store.mtx);
+  free(rec);
+}
+
+void store_get_stats(struct store_stats *st)
+{
+  if(!store.ready){
+    *st = store.stats;
+    return;
+  }
+  pthread_mutex_lock(&store.mtx);
+  *st = store.stats;
+  pthread_mutex_unlock(&store.mtx);
+}
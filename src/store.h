@@ -0,0 +1,33 @@
+#ifndef STORE__H
+#define STORE__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcm.h"
+
+struct store_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long puts;
+  unsigned long compactions;
+  unsigned long invalidated; //entries of voices no longer configured, at open
+  size_t entries;
+  size_t bytes;  //data files on disk
+  size_t budget;
+};
+
+//voices are the keys of the configured voices, entries of any other
+//voice are dropped. False if dir can't be used or another instance has it.
+bool store_open(const char *dir, size_t budget, const uint64_t voices[], unsigned count);
+void store_close(void);
+
+//key is the cache_key() of text for voice
+bool store_get(uint64_t voice, uint64_t key, const char *text, struct pcm_buf *out);
+//Index lookup only, the record may still turn out unusable
+bool store_has(uint64_t voice, uint64_t key);
+void store_put(uint64_t voice, uint64_t key, const char *text, const struct pcm_buf *pcm);
+void store_get_stats(struct store_stats *st);
+
+#endif
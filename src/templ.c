@@ -0,0 +1,213 @@
+/******************************************************************************
+Fixed parts and variable slots of templated ATC phrases, for splicing
+******************************************************************************/
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "templ.h"
+#include "utils.h"
+
+//Words looked at per segment
+#define TEMPL_TOKENS 128
+//Templates remembered, a power of two
+#define TEMPL_SEEN 4096
+
+enum token_kind {
+  TOKEN_FIXED = 0,
+  TOKEN_SPELLED, //one digit or letter, read on its own anyway
+  TOKEN_VALUE,   //a number or a code such as 27L, 121.5 or N123AB
+  TOKEN_JOIN     //variable only right after another variable word
+};
+
+struct token {
+  size_t start; //whole word
+  size_t len;
+  size_t core;  //without the punctuation around it
+  size_t core_len;
+  enum token_kind kind;
+};
+
+static const char *const spelled_words[] = {
+  "zero", "one", "two", "three", "tree", "four", "five", "fife", "six", "seven", "eight",
+  "nine", "niner", "alpha", "alfa", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+  "hotel", "india", "juliet", "juliett", "kilo", "lima", "mike", "november", "oscar",
+  "papa", "quebec", "romeo", "sierra", "tango", "uniform", "victor", "whiskey", "whisky",
+  "xray", "x-ray", "yankee", "zulu", NULL
+};
+
+static const char *const join_words[] = {
+  "point", "decimal", "left", "right", "center", "centre", NULL
+};
+
+static struct {
+  uint64_t keys[TEMPL_SEEN];
+  unsigned count;
+  pthread_mutex_t mtx;
+} seen = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+
+static bool word_in(const char *w, size_t len, const char *const list[])
+{
+  size_t i;
+  for(i = 0; list[i] != NULL; ++i){
+    if(strlen(list[i]) == len && strncasecmp(w, list[i], len) == 0){
+      return true;
+    }
+  }
+  return false;
+}
+
+static enum token_kind word_kind(const char *w, size_t len)
+{
+  size_t i;
+  if(len == 0){
+    return TOKEN_FIXED;
+  }
+  for(i = 0; i < len; ++i){
+    if(isdigit((unsigned char)w[i])){
+      return len == 1 ? TOKEN_SPELLED : TOKEN_VALUE;
+    }
+  }
+  if(word_in(w, len, spelled_words)){
+    return TOKEN_SPELLED;
+  }
+  if(word_in(w, len, join_words)){
+    return TOKEN_JOIN;
+  }
+  return TOKEN_FIXED;
+}
+
+static size_t tokenize(const char *text, size_t len, struct token tok[], size_t max)
+{
+  size_t pos = 0;
+  size_t n = 0;
+  while(pos < len){
+    struct token *t;
+    size_t end;
+    while(pos < len && isspace((unsigned char)text[pos])){
+      ++pos;
+    }
+    if(pos == len){
+      break;
+    }
+    if(n == max){
+      return 0;
+    }
+    t = &tok[n++];
+    for(end = pos; end < len && !isspace((unsigned char)text[end]); ++end){
+    }
+    t->start = pos;
+    t->len = end - pos;
+    t->core = pos;
+    while(t->core < end && ispunct((unsigned char)text[t->core])){
+      ++t->core;
+    }
+    while(end > t->core && ispunct((unsigned char)text[end - 1])){
+      --end;
+    }
+    t->core_len = end - t->core;
+    t->kind = word_kind(text + t->core, t->core_len);
+    if(t->kind == TOKEN_JOIN && (n == 1 || tok[n - 2].kind == TOKEN_FIXED)){
+      t->kind = TOKEN_FIXED;
+    }
+    pos = t->start + t->len;
+  }
+  return n;
+}
+
+static bool frag_add(struct templ_frag frags[], size_t *n, size_t max, size_t start, size_t end, bool slot)
+{
+  if(*n == max){
+    return false;
+  }
+  frags[*n].start = start;
+  frags[*n].len = end - start;
+  frags[*n].slot = slot;
+  *n += 1;
+  return true;
+}
+
+size_t templ_split(const char *text, size_t len, struct templ_frag frags[], size_t max)
+{
+  struct token tok[TEMPL_TOKENS];
+  size_t count = tokenize(text, len, tok, TEMPL_TOKENS);
+  size_t i = 0;
+  size_t n = 0;
+  bool fixed = false;
+  bool slot = false;
+
+  while(i < count){
+    size_t j = i;
+    if(tok[i].kind == TOKEN_FIXED){
+      while(j < count && tok[j].kind == TOKEN_FIXED){
+        ++j;
+      }
+      if(!frag_add(frags, &n, max, tok[i].start, tok[j - 1].start + tok[j - 1].len, false)){
+        return 0;
+      }
+      fixed = true;
+    }else{
+      bool spelled = true;
+      size_t k;
+      while(j < count && tok[j].kind != TOKEN_FIXED){
+        spelled = spelled && tok[j].kind != TOKEN_VALUE;
+        ++j;
+      }
+      if(spelled){
+        //each character is its own word anyway, so they splice without loss
+        for(k = i; k < j; ++k){
+          if(!frag_add(frags, &n, max, tok[k].core, tok[k].core + tok[k].core_len, true)){
+            return 0;
+          }
+        }
+      }else if(!frag_add(frags, &n, max, tok[i].core, tok[j - 1].core + tok[j - 1].core_len, true)){
+        return 0;
+      }
+      slot = true;
+    }
+    i = j;
+  }
+  return fixed && slot ? n : 0;
+}
+
+uint64_t templ_key(const char *text, const struct templ_frag frags[], size_t count)
+{
+  uint64_t h = FNV1A64_INIT;
+  size_t i;
+  for(i = 0; i < count; ++i){
+    if(!frags[i].slot){
+      h = fnv1a64(h, text + frags[i].start, frags[i].len);
+    }else if(i == 0 || !frags[i - 1].slot){
+      h = fnv1a64(h, "\1", 1);
+    }
+  }
+  return h;
+}
+
+bool templ_seen(uint64_t key)
+{
+  unsigned i;
+  bool res = false;
+  if(key == 0){
+    key = 1;
+  }
+  i = (unsigned)key & (TEMPL_SEEN - 1);
+  pthread_mutex_lock(&seen.mtx);
+  //a full table starts over rather than probing forever
+  if(seen.count >= TEMPL_SEEN / 2){
+    memset(seen.keys, 0, sizeof(seen.keys));
+    seen.count = 0;
+  }
+  while(seen.keys[i] != 0 && seen.keys[i] != key){
+    i = (i + 1) & (TEMPL_SEEN - 1);
+  }
+  if(seen.keys[i] == key){
+    res = true;
+  }else{
+    seen.keys[i] = key;
+    seen.count += 1;
+  }
+  pthread_mutex_unlock(&seen.mtx);
+  return res;
+}
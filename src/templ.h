@@ -0,0 +1,27 @@
+#ifndef TEMPL__H
+#define TEMPL__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//Most fragments one segment is cut into
+#define TEMPL_FRAGS 32
+
+//Byte range of one fragment; slots hold the variable parts
+struct templ_frag {
+  size_t start;
+  size_t len;
+  bool slot;
+};
+
+//Cuts text into fixed runs and variable slots (numbers, spelled digits and
+//letters, runway sides). Spelled slots are cut further into one fragment
+//per character. 0 unless there is at least one of each, or too many.
+size_t templ_split(const char *text, size_t len, struct templ_frag frags[], size_t max);
+//The fixed parts with every slot as one marker, so "runway 9" and "runway 2 7" match
+uint64_t templ_key(const char *text, const struct templ_frag frags[], size_t count);
+//Remembers key, true if it was seen before
+bool templ_seen(uint64_t key);
+
+#endif
@@ -0,0 +1,71 @@
+/******************************************************************************
+Splits text into sentence and clause sized pieces for synthesis
+******************************************************************************/
+#include <stdbool.h>
+#include <ctype.h>
+
+#include "text.h"
+
+static bool is_space(char c)
+{
+  return isspace((unsigned char)c) != 0;
+}
+
+size_t text_skip_space(const char *text, size_t len)
+{
+  size_t i = 0;
+  while(i < len && is_space(text[i])){
+    ++i;
+  }
+  return i;
+}
+
+//Punctuation only counts when followed by a space, so "121.5" stays whole
+static bool boundary_follows(const char *text, size_t len, size_t i)
+{
+  return (i + 1 == len) || is_space(text[i + 1]);
+}
+
+/*
+ * Length of the first segment of text. Sentences (. ! ? ;) always end a
+ * segment; clauses (, :) end one once it is at least soft bytes long.
+ * Nothing longer than hard is returned; such runs are cut at the last
+ * clause or word, never inside a UTF-8 sequence.
+ */
+size_t text_segment_len(const char *text, size_t len, size_t soft, size_t hard)
+{
+  size_t i;
+  size_t last_clause = 0;
+  size_t last_space = 0;
+
+  for(i = 0; i < len && i < hard; ++i){
+    char c = text[i];
+    if(c == '.' || c == '!' || c == '?' || c == ';'){
+      if(boundary_follows(text, len, i)){
+        return i + 1;
+      }
+    }else if(c == ',' || c == ':'){
+      if(boundary_follows(text, len, i)){
+        if(i + 1 >= soft){
+          return i + 1;
+        }
+        last_clause = i + 1;
+      }
+    }else if(is_space(c)){
+      last_space = i;
+    }
+  }
+  if(i == len){
+    return len;
+  }
+  if(last_clause > 0){
+    return last_clause;
+  }
+  if(last_space > 0){
+    return last_space;
+  }
+  while(i > 1 && ((unsigned char)text[i] & 0xC0) == 0x80){
+    --i;
+  }
+  return i;
+}
@@ -0,0 +1,9 @@
+#ifndef TEXT__H
+#define TEXT__H
+
+#include <stddef.h>
+
+size_t text_skip_space(const char *text, size_t len);
+size_t text_segment_len(const char *text, size_t len, size_t soft, size_t hard);
+
+#endif
@@ -0,0 +1,311 @@
+/******************************************************************************
+Energy based trimming of the silence Piper puts around every utterance
+******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "trim.h"
+
+//Energy is measured over blocks of this length
+#define TRIM_BLOCK_MS 10
+
+//Trimmer state over interleaved 16-bit PCM, fed block by block
+struct trim {
+  unsigned channels;
+  size_t block; //all sizes in samples, multiples of channels
+  size_t lead;    //silence kept before the voice
+  size_t pad;     //and after it
+  size_t fade_in;
+  size_t fade;
+  uint64_t threshold; //mean square
+  bool voiced;
+  size_t emitted;   //output so far, for the fade in
+  size_t tail_sent; //trailing silence already passed on
+  size_t tail_len;  //trailing silence seen so far
+  int16_t *hold;    //silence not decided on yet
+  size_t hold_len;
+  size_t hold_cap;
+  int16_t *part;    //incomplete block
+  size_t part_len;
+};
+
+static uint64_t sum_squares(const int16_t *x, size_t n)
+{
+  uint64_t sum = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  uint64_t lanes[2];
+  for(; i + 8 <= n; i += 8){
+    __m128i v = _mm_loadu_si128((const __m128i *)(x + i));
+    //pair sums reach 2^31, they are widened as unsigned
+    __m128i sq = _mm_madd_epi16(v, v);
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+  }
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+  for(; i < n; ++i){
+    sum += (uint64_t)((int32_t)x[i] * x[i]);
+  }
+  return sum;
+}
+
+static bool hold_append(struct trim *t, const int16_t *x, size_t n)
+{
+  if(t->hold_len + n > t->hold_cap){
+    size_t cap = t->hold_cap * 2 > t->hold_len + n ? t->hold_cap * 2 : t->hold_len + n;
+    int16_t *hold = (int16_t *)realloc(t->hold, cap * sizeof(int16_t));
+    if(hold == NULL){
+      return false;
+    }
+    t->hold = hold;
+    t->hold_cap = cap;
+  }
+  memcpy(t->hold + t->hold_len, x, n * sizeof(int16_t));
+  t->hold_len += n;
+  return true;
+}
+
+static void hold_drop(struct trim *t, size_t n)
+{
+  memmove(t->hold, t->hold + n, (t->hold_len - n) * sizeof(int16_t));
+  t->hold_len -= n;
+}
+
+//Copies n samples to out, fading in the start of the output
+static size_t emit(struct trim *t, const int16_t *x, size_t n, int16_t *out)
+{
+  memmove(out, x, n * sizeof(int16_t));
+  if(t->emitted < t->fade_in){
+    size_t end = t->fade_in - t->emitted < n ? t->fade_in - t->emitted : n;
+    size_t i;
+    for(i = 0; i < end; ++i){
+      size_t frame = (t->emitted + i) / t->channels;
+      out[i] = (int16_t)(out[i] * (int32_t)frame / (int32_t)(t->fade_in / t->channels));
+    }
+  }
+  t->emitted += n;
+  return n;
+}
+
+static size_t process_block(struct trim *t, const int16_t *x, size_t n, int16_t *out)
+{
+  size_t w = 0;
+  if(sum_squares(x, n) >= t->threshold * n){
+    //voice: whatever silence was held back stays
+    w += emit(t, t->hold, t->hold_len, out);
+    w += emit(t, x, n, out + w);
+    t->hold_len = 0;
+    t->tail_len = 0;
+    t->tail_sent = 0;
+    t->voiced = true;
+    return w;
+  }
+  if(!hold_append(t, x, n)){
+    //out of memory, give up trimming rather than losing audio
+    w += emit(t, t->hold, t->hold_len, out);
+    w += emit(t, x, n, out + w);
+    t->hold_len = 0;
+    return w;
+  }
+  if(!t->voiced){
+    //leading silence, only the last t->lead samples may be needed
+    if(t->hold_len > t->lead){
+      hold_drop(t, t->hold_len - t->lead);
+    }
+  }else{
+    //trailing silence up to the fade out is kept either way
+    size_t keep;
+    t->tail_len += n;
+    keep = t->tail_len < t->pad ? t->tail_len : t->pad;
+    if(keep > t->fade && keep - t->fade > t->tail_sent){
+      size_t send = keep - t->fade - t->tail_sent;
+      w += emit(t, t->hold, send, out);
+      hold_drop(t, send);
+      t->tail_sent += send;
+    }
+  }
+  return w;
+}
+
+static bool trim_begin(struct trim *t, const struct wav_info *info, const struct trim_cfg *cfg)
+{
+  unsigned ch = info->channels;
+  double amp = 32768.0 * pow(10.0, cfg->threshold_db / 20.0);
+  memset(t, 0, sizeof(*t));
+  if(info->format != 1 || info->bits_per_sample != 16 || ch == 0 || info->sample_rate == 0){
+    return false;
+  }
+  t->channels = ch;
+  t->block = (size_t)info->sample_rate * TRIM_BLOCK_MS / 1000 * ch;
+  t->pad = (size_t)info->sample_rate * cfg->pad_ms / 1000 * ch;
+  t->fade = (size_t)info->sample_rate * cfg->fade_ms / 1000 * ch;
+  if(t->fade > t->pad){
+    t->fade = t->pad;
+  }
+  //the crossfade of a join replaces both the pad and the fade
+  t->lead = cfg->joined_start ? 0 : t->pad;
+  t->fade_in = cfg->joined_start ? 0 : t->fade;
+  if(cfg->joined_end){
+    t->pad = 0;
+    t->fade = 0;
+  }
+  if(t->block == 0){
+    t->block = ch;
+  }
+  t->threshold = (uint64_t)(amp * amp);
+  t->part = (int16_t *)malloc(t->block * sizeof(int16_t));
+  return t->part != NULL;
+}
+
+//out needs room for n + t->hold_len + t->part_len samples and may be in
+//while nothing is held back. Returns the number of samples written.
+static size_t trim_feed(struct trim *t, const int16_t *in, size_t n, int16_t *out)
+{
+  size_t r = 0;
+  size_t w = 0;
+  if(t->part_len > 0){
+    size_t take = t->block - t->part_len < n ? t->block - t->part_len : n;
+    memcpy(t->part + t->part_len, in, take * sizeof(int16_t));
+    t->part_len += take;
+    r = take;
+    if(t->part_len < t->block){
+      return 0;
+    }
+    w += process_block(t, t->part, t->block, out);
+    t->part_len = 0;
+  }
+  for(; r + t->block <= n; r += t->block){
+    w += process_block(t, in + r, t->block, out + w);
+  }
+  memcpy(t->part, in + r, (n - r) * sizeof(int16_t));
+  t->part_len = n - r;
+  return w;
+}
+
+//Writes the kept part of what is still held back, at most t->hold_len + t->part_len
+static size_t trim_finish(struct trim *t, int16_t *out)
+{
+  size_t w = 0;
+  size_t keep, i, f;
+  if(t->part_len > 0){
+    w += process_block(t, t->part, t->part_len, out);
+    t->part_len = 0;
+  }
+  if(!t->voiced){
+    return 0;
+  }
+  keep = (t->tail_len < t->pad ? t->tail_len : t->pad) - t->tail_sent;
+  if(keep > t->hold_len){
+    keep = t->hold_len;
+  }
+  w += emit(t, t->hold, keep, out + w);
+  //fade out the kept padding, so a cut in noise doesn't click
+  f = t->fade < keep ? t->fade : keep;
+  for(i = 0; i < f; ++i){
+    int16_t *s = out + w - f + i;
+    size_t frame = i / t->channels;
+    *s = (int16_t)(*s * (int32_t)(f / t->channels - 1 - frame) / (int32_t)(f / t->channels));
+  }
+  t->hold_len = 0;
+  return w;
+}
+
+static void trim_end(struct trim *t)
+{
+  free(t->hold);
+  free(t->part);
+  memset(t, 0, sizeof(*t));
+}
+
+bool trim_split(const struct pcm_buf *pcm, const struct trim_cfg *cfg, size_t parts, size_t cuts[])
+{
+  struct trim t;
+  const int16_t *data = (const int16_t *)pcm->data;
+  size_t n = pcm->len / sizeof(int16_t);
+  size_t blocks, b, run_start = 0, found = 0, i;
+  bool quiet_run = false, voiced = false;
+  size_t *run_pos = NULL;
+  size_t *run_len = NULL;
+  bool ok = false;
+
+  if(parts < 2){
+    return parts == 1;
+  }
+  if(!trim_begin(&t, &pcm->info, cfg)){
+    trim_end(&t);
+    return false;
+  }
+  blocks = n / t.block;
+  run_pos = (size_t *)malloc((blocks / 2 + 1) * sizeof(size_t));
+  run_len = (size_t *)malloc((blocks / 2 + 1) * sizeof(size_t));
+  if(run_pos == NULL || run_len == NULL){
+    free(run_pos);
+    free(run_len);
+    trim_end(&t);
+    return false;
+  }
+  //Quiet runs between voiced blocks, the edges don't count
+  for(b = 0; b < blocks; ++b){
+    bool loud = sum_squares(data + b * t.block, t.block) >= t.threshold * t.block;
+    if(loud){
+      if(quiet_run && voiced){
+        run_pos[found] = run_start;
+        run_len[found] = b - run_start;
+        found += 1;
+      }
+      voiced = true;
+      quiet_run = false;
+    }else if(!quiet_run){
+      quiet_run = true;
+      run_start = b;
+    }
+  }
+  if(found >= parts - 1){
+    //keep the parts - 1 longest runs, in order of position
+    while(found > parts - 1){
+      size_t shortest = 0;
+      for(i = 1; i < found; ++i){
+        if(run_len[i] < run_len[shortest]){
+          shortest = i;
+        }
+      }
+      memmove(run_pos + shortest, run_pos + shortest + 1, (found - shortest - 1) * sizeof(size_t));
+      memmove(run_len + shortest, run_len + shortest + 1, (found - shortest - 1) * sizeof(size_t));
+      found -= 1;
+    }
+    for(i = 0; i < found; ++i){
+      cuts[i] = (run_pos[i] * t.block + run_len[i] * t.block / 2 / t.channels * t.channels) * sizeof(int16_t);
+    }
+    ok = true;
+  }
+  free(run_pos);
+  free(run_len);
+  trim_end(&t);
+  return ok;
+}
+
+bool trim_pcm(struct pcm_buf *pcm, const struct trim_cfg *cfg)
+{
+  struct trim t;
+  int16_t *data = (int16_t *)pcm->data;
+  size_t n;
+  if(!trim_begin(&t, &pcm->info, cfg)){
+    trim_end(&t);
+    return false;
+  }
+  //nothing is held yet, so the output can overwrite the input
+  n = trim_feed(&t, data, pcm->len / sizeof(int16_t), data);
+  n += trim_finish(&t, data + n);
+  trim_end(&t);
+  pcm->len = n * sizeof(int16_t);
+  return true;
+}
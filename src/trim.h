@@ -0,0 +1,24 @@
+#ifndef TRIM__H
+#define TRIM__H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcm.h"
+
+struct trim_cfg {
+  int threshold_db; //dBFS, blocks quieter than this are silence
+  unsigned pad_ms;  //silence kept before the first and after the last voiced block
+  unsigned fade_ms;
+  bool joined_start; //crossfaded with the segment before, cut right at the voice
+  bool joined_end;   //likewise with the segment after
+};
+
+//Byte offsets cutting pcm at its parts - 1 longest inner silences, false if
+//there are fewer. Piper puts such a pause between sentences.
+bool trim_split(const struct pcm_buf *pcm, const struct trim_cfg *cfg, size_t parts, size_t cuts[]);
+//Trims a whole segment in place, a no-op for anything but 16-bit PCM
+bool trim_pcm(struct pcm_buf *pcm, const struct trim_cfg *cfg);
+
+#endif
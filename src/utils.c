@@ -13,8 +13,28 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <spawn.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "utils.h"
+#include "pcm.h"
+#include "cache.h"
+#include "text.h"
+#include "audio.h"
+#include "conv.h"
+#include "trim.h"
+#include "pool.h"
+#include "store.h"
+#include "freq.h"
+#include "templ.h"
+#include "norm.h"
+#include "bcast.h"
 
 #define XPLM200
 #define APL 0
@@ -25,22 +45,91 @@
 #ifdef USE_SPEECHD
 #include <speech-dispatcher/libspeechd.h>
 #endif
-#ifdef USE_PULSE
-#include <pulse/simple.h>
-#include <pulse/error.h>
-#include <pulse/sample.h>
-#endif
 
 extern char **environ;
 
 #define TTS_QUEUE_CAP 64
-#define TTS_MAX_TEXT 4096
+//Messages in synthesis or playback a newer one may still cancel
+#define TTS_ACTIVE 32
+//Hook side hand-off: a preallocated ring of fixed size text slots
+#define TTS_SLOTS 128
+#define TTS_SLOT_TEXT 1024
+#define TTS_PUSH_TRIES 16
+//A burst of drops is logged once no more came for this long
+#define SAY_BURST_MS 100
+//Synthesis segments: clauses may end one past SOFT, nothing exceeds HARD
+#define TTS_SEGMENT_SOFT 80
+#define TTS_SEGMENT_HARD 400
+//Most short messages coalesced into one synthesis call
+#define TTS_MERGE_MAX 8
+//Opening words of a broadcast that name its station
+#define BCAST_STATION_WORDS 4
+
+/*
+ * speech_say() runs on X-Plane's own thread, so handing a string over must
+ * neither allocate nor lock. Producers reserve consecutive slots with a CAS
+ * on tail (giving up after TTS_PUSH_TRIES, which keeps the push wait-free),
+ * copy the text in and publish each slot through its sequence number. The
+ * only consumer, say_worker, reassembles strings longer than one slot.
+ */
+struct tts_slot {
+  atomic_uint seq;
+  int src;
+  int type;
+  unsigned len;
+  bool more; //the string continues in the next slot
+  char text[TTS_SLOT_TEXT];
+};
 
-struct tts_queue {
-  char *items[TTS_QUEUE_CAP];
+struct say_ring {
+  struct tts_slot slots[TTS_SLOTS];
+  atomic_uint tail;
+  unsigned head; //consumer only
+  atomic_bool sleeping;
+  atomic_bool stop;
+  atomic_ulong dropped;
+  int efd;
+};
+
+struct tts_item {
+  char *text;
+  int prio;
+  uint64_t queued_ms; //CLOCK_MONOTONIC
+  uint64_t key;       //supersede key, 0 for none
+  uint64_t bkey;      //broadcast key of repeated long messages, 0 for none
+};
+
+enum msg_fate {
+  MSG_PENDING = 0,
+  MSG_STARTED,
+  MSG_DROPPED,
+  MSG_CANCELLED //superseded by a newer message with the same key
+};
+
+//Shared by the segments of one message: whichever segment reaches a
+//worker first decides whether the message is still worth speaking
+struct tts_msg {
+  atomic_uint refs;
+  atomic_int fate;
+  atomic_bool played;
+  uint64_t queued_ms;
+  uint64_t key;
+};
+
+//One FIFO per priority class, TTS_QUEUE_CAP items in total
+struct tts_level {
+  struct tts_item items[TTS_QUEUE_CAP];
   int head;
   int tail;
   int count;
+};
+
+struct tts_queue {
+  struct tts_level levels[SPEECH_PRIO_COUNT];
+  int count;
+  struct tts_msg *active[TTS_ACTIVE]; //most recent messages past the queue
+  unsigned active_next;
+  unsigned long superseded;
   bool stop;
   pthread_mutex_t mtx;
   pthread_cond_t cv;
@@ -51,6 +140,67 @@ struct tts_cmd {
   int argc;
 };
 
+#define AUDIO_RING_CAP 4
+//Playback granularity, also the preemption reaction time
+#define PLAY_CHUNK_MS 50
+
+//One synthesized segment on its way to playback
+struct tts_audio {
+  struct pcm_buf pcm;
+  int prio;
+  unsigned gen;
+  struct tts_msg *msg; //holds a reference
+};
+
+//Synthesized audio on its way from tts_worker to play_worker.
+//Single producer, single consumer; the semaphores only park the
+//threads when the ring is empty or full.
+struct audio_ring {
+  struct tts_audio *slots[AUDIO_RING_CAP];
+  atomic_uint head;
+  atomic_uint tail;
+  sem_t items;
+  sem_t space;
+};
+
+struct piper_server {
+  unsigned id; //names the WAV files apart from other servers
+  const struct tts_cmd *cmd;
+  pid_t pid;
+  int in_fd;
+  int out_fd;
+  unsigned long seq;
+  char line[PATH_MAX];
+  size_t line_len;
+  char path[PATH_MAX];
+};
+
+//A Piper command line; priority classes may get voices of their own
+struct tts_voice {
+  struct tts_cmd piper_cmd;
+  struct tts_cmd server_cmd;
+  const char *model;
+  uint64_t key; //cache_key() salt
+};
+
+//One segment handed to the synthesis workers. Coalesced short messages
+//are parts of one segment: their texts follow each other in text, each
+//NUL terminated, and the audio is split back into one piece per part.
+struct tts_job {
+  struct tts_audio *audio[TTS_MERGE_MAX]; //NULL until synthesized
+  int prio;
+  unsigned gen;
+  unsigned long utt; //segments of one message share it
+  bool first;        //first segment of its message
+  bool last;         //final segment of its message
+  bool warm;         //only fills the caches, has no parts
+  struct bcast_seg *seg; //this segment in the last rendering of its message
+  unsigned parts;
+  struct tts_msg *msg[TTS_MERGE_MAX];
+  size_t part_at[TTS_MERGE_MAX]; //offset of each part in text
+  char text[];
+};
+
 enum tts_backend {
   TTS_NONE = 0,
   TTS_PIPER = 1,
@@ -58,62 +208,128 @@ enum tts_backend {
 };
 
 static struct tts_queue queue_state;
+static struct say_ring say_state = {.efd = -1};
+static pthread_t say_thread;
+static bool say_started = false;
 static pthread_t worker_thread;
 static bool worker_started = false;
+static struct audio_ring ring_state;
+static pthread_t play_thread;
+static bool play_started = false;
+static atomic_bool play_stop;
+
+//Bumped whenever a message of that class is queued. Audio of a lower
+//class remembers the sum over the classes above it and is dropped as
+//soon as that sum moves, i.e. something more important showed up.
+static atomic_uint prio_gen[SPEECH_PRIO_COUNT];
+static int type_prio[32];
+//Longest time a message may wait for synthesis, 0 for no limit
+static unsigned deadline_ms[SPEECH_PRIO_COUNT] = {5000, 10000, 20000, 60000};
+static atomic_ulong stale_dropped;
+//Short messages queued this close together are synthesized in one call
+static size_t coalesce_chars = 80;
+static uint64_t coalesce_ms = 2000;
+static unsigned long coalesce_calls = 0;
+static unsigned long coalesced = 0;
+static atomic_ulong coalesce_unsplit;
 static bool tts_ready = false;
 static enum tts_backend backend = TTS_NONE;
 
-static struct tts_cmd piper_cmd;
+#define TTS_VOICES (SPEECH_PRIO_COUNT + 1)
+static struct tts_voice voices[TTS_VOICES];
+static int voice_count = 0;
+static int prio_voice[SPEECH_PRIO_COUNT];
 static struct tts_cmd sink_cmd;
 
-#ifdef USE_PULSE
-static bool pulse_enabled = false;
-static pa_simple *pulse_stream = NULL;
-static pa_sample_spec pulse_spec;
-#endif
+static bool server_enabled = false;
+static int server_timeout_ms = 30000;
+//One persistent Piper per synthesis worker
+static struct piper_server servers[POOL_WORKERS_MAX];
+static int worker_voice[POOL_WORKERS_MAX];
+static unsigned worker_count = 0;
+static bool pool_started = false;
+static unsigned crossfade_ms = 10;
+//End of the last delivered segment, held back to crossfade into the next one
+static struct tts_audio *join_tail = NULL;
+static unsigned long join_utt = 0;
+static char run_dir[PATH_MAX - 64];
+
+static char store_dir[PATH_MAX];
+static bool store_enabled = false;
+//Frequent phrases are synthesized into the caches while nothing else is
+#define PREWARM_MAX 256
+static unsigned prewarm_count = 50;
+static uint64_t prewarm_idle_ms = 1000;
+static pthread_t prewarm_thread;
+static bool prewarm_started = false;
+static atomic_bool prewarm_stop;
+static atomic_ullong live_ms; //when a message was last taken from the queue
+static unsigned long prewarmed = 0;
+
+//Aviation shorthand spelled out before queueing
+static bool norm_enabled = false;
+
+//Segments of templated phrases built from cached fragments
+static bool splice_enabled = false;
+static unsigned splice_crossfade_ms = 5;
+//Trimming of each fragment before the crossfade
+#define SPLICE_TRIM_PAD_MS 20
+#define SPLICE_TRIM_FADE_MS 3
+//Fixed parts of recurring templates waiting to be synthesized while idle
+#define SPLICE_WANT_MAX 32
+static struct {
+  char *text[SPLICE_WANT_MAX];
+  int voice[SPLICE_WANT_MAX];
+  unsigned count;
+  pthread_mutex_t mtx;
+} splice_want = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+static atomic_ulong splice_segments;
+static atomic_ulong splice_fragments;
+static atomic_ulong splice_synthesized;
+
+static bool audio_enabled = false;
+//Output latency measured by the player after each write, see audio_latency()
+static unsigned long play_lat_sum = 0;
+static unsigned long play_lat_max = 0;
+static unsigned long play_lat_count = 0;
+static bool trim_enabled = false;
+static struct trim_cfg trim_config;
 
 #ifdef USE_SPEECHD
 static SPDConnection *conn = NULL;
 #endif
 
-static char *msg = NULL;
-static size_t msgSize = 0;
+//Log lines that fit are formatted on the stack, xcDebug() is called from
+//every thread of the plugin at once
+#define DEBUG_LINE 512
 
 static void xcDebugInt(const char *format, va_list va)
 {
+  char line[DEBUG_LINE];
+  char *buf;
   va_list vc;
   int res;
-  if(msg == NULL){
-    msgSize = 2;
-    msg = (char *)malloc(msgSize);
+
+  /*copy, in case we need another go*/
+  va_copy(vc, va);
+  res = vsnprintf(line, sizeof(line), format, vc);
+  va_end(vc);
+  if(res < 0){
+    XPLMDebugString("XLinSpeak: Problem with debug message formatting!\n");
+    return;
   }
-  if(msg == NULL){
-    XPLMDebugString("XLinSpeak: Couldn't allocate buffer for messages!\n");
+  if((size_t)res < sizeof(line)){
+    XPLMDebugString(line);
     return;
   }
-  while(1){ /*looping once, in case of string too big*/
-    /*copy, in case we need another go*/
-    va_copy(vc, va);
-    res = vsnprintf(msg, msgSize, format, vc);
-    va_end(vc);
-
-    if((res > -1) && ((size_t)res < msgSize)){
-      XPLMDebugString(msg);
-      return;
-    }else{
-      void *tmp;
-      msgSize *= 2;
-      if((tmp = realloc(msg, msgSize)) == NULL){
-        break;
-      }
-      msg = (char *)tmp;
-    }
+  buf = (char *)malloc((size_t)res + 1);
+  if(buf == NULL){
+    XPLMDebugString("XLinSpeak: Couldn't allocate buffer for messages!\n");
+    return;
   }
-
-  XPLMDebugString("XLinSpeak: Problem with debug message formatting!\n");
-  msg = NULL;
-  msgSize = 0;
-  return;
+  vsnprintf(buf, (size_t)res + 1, format, va);
+  XPLMDebugString(buf);
+  free(buf);
 }
 
 void xcDebug(const char *format, ...)
@@ -206,7 +422,7 @@ static bool argv_add_split(struct tts_cmd *cmd, const char *args)
   return true;
 }
 
-static bool env_is_true(const char *name)
+bool env_is_true(const char *name)
 {
   const char *val = getenv(name);
   if(val == NULL){
@@ -221,11 +437,42 @@ static bool env_is_true(const char *name)
   return false;
 }
 
-static bool build_piper_cmd(void)
+bool env_is_false(const char *name)
+{
+  const char *val = getenv(name);
+  if(val == NULL){
+    return false;
+  }
+  if((strcasecmp(val, "0") == 0) ||
+     (strcasecmp(val, "false") == 0) ||
+     (strcasecmp(val, "no") == 0) ||
+     (strcasecmp(val, "off") == 0)){
+    return true;
+  }
+  return false;
+}
+
+long env_long(const char *name, long def, long min, long max)
+{
+  const char *val = getenv(name);
+  char *end;
+  long res;
+  if(val == NULL || *val == '\0'){
+    return def;
+  }
+  errno = 0;
+  res = strtol(val, &end, 10);
+  if(errno != 0 || *end != '\0' || res < min || res > max){
+    xcDebug("XLinSpeak: Ignoring invalid %s=%s.\n", name, val);
+    return def;
+  }
+  return res;
+}
+
+static bool build_piper_cmd(struct tts_cmd *piper_cmd, const char *model)
 {
   const char *bin = getenv("PIPER_BIN");
   const char *args = getenv("PIPER_ARGS");
-  const char *model = getenv("PIPER_MODEL");
 
   if(bin == NULL || *bin == '\0'){
     bin = "piper";
@@ -234,21 +481,19 @@ static bool build_piper_cmd(void)
     args = "--output_file -";
   }
 
-  if(!argv_add(&piper_cmd, bin)){
+  if(!argv_add(piper_cmd, bin)){
     return false;
   }
-  if(!argv_add_split(&piper_cmd, args)){
+  if(!argv_add_split(piper_cmd, args)){
     return false;
   }
   if(model != NULL && *model != '\0'){
-    if(!argv_add(&piper_cmd, "--model")){
+    if(!argv_add(piper_cmd, "--model")){
       return false;
     }
-    if(!argv_add(&piper_cmd, model)){
+    if(!argv_add(piper_cmd, model)){
       return false;
     }
-  }else{
-    xcDebug("XLinSpeak: PIPER_MODEL not set, relying on PIPER_ARGS.\\n");
   }
   return true;
 }
@@ -268,6 +513,109 @@ static bool build_sink_cmd(void)
   return true;
 }
 
+//Piper options selecting the output side; the server picks its own
+static int output_opt_args(const char *arg)
+{
+  if((strcmp(arg, "--output_file") == 0) || (strcmp(arg, "--output-file") == 0) ||
+     (strcmp(arg, "-f") == 0) ||
+     (strcmp(arg, "--output_dir") == 0) || (strcmp(arg, "--output-dir") == 0) ||
+     (strcmp(arg, "-d") == 0)){
+    return 2;
+  }
+  if((strcmp(arg, "--output_raw") == 0) || (strcmp(arg, "--output-raw") == 0) ||
+     (strcmp(arg, "--json-input") == 0) || (strcmp(arg, "--json_input") == 0)){
+    return 1;
+  }
+  return 0;
+}
+
+static bool build_server_cmd(struct tts_voice *v)
+{
+  int i = 0;
+  while(i < v->piper_cmd.argc){
+    int skip = (i > 0) ? output_opt_args(v->piper_cmd.argv[i]) : 0;
+    if(skip > 0){
+      i += skip;
+      continue;
+    }
+    if(!argv_add(&v->server_cmd, v->piper_cmd.argv[i])){
+      return false;
+    }
+    ++i;
+  }
+  if(!argv_add(&v->server_cmd, "--json-input") ||
+     !argv_add(&v->server_cmd, "--output_dir") ||
+     !argv_add(&v->server_cmd, run_dir)){
+    return false;
+  }
+  return true;
+}
+
+//Private directory for the server's WAV files, preferably on tmpfs
+static bool run_dir_create(void)
+{
+  const char *bases[3];
+  int i;
+
+  bases[0] = getenv("XDG_RUNTIME_DIR");
+  bases[1] = "/dev/shm";
+  bases[2] = "/tmp";
+  for(i = 0; i < 3; ++i){
+    if(bases[i] == NULL || *bases[i] == '\0'){
+      continue;
+    }
+    snprintf(run_dir, sizeof(run_dir), "%s/xlinspeak-XXXXXX", bases[i]);
+    if(mkdtemp(run_dir) != NULL){
+      return true;
+    }
+  }
+  run_dir[0] = '\0';
+  return false;
+}
+
+static void run_dir_remove(void)
+{
+  DIR *dir;
+  struct dirent *ent;
+  char path[sizeof(run_dir) + 256];
+
+  if(run_dir[0] == '\0'){
+    return;
+  }
+  dir = opendir(run_dir);
+  if(dir != NULL){
+    while((ent = readdir(dir)) != NULL){
+      if(ent->d_name[0] == '.'){
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", run_dir, ent->d_name);
+      unlink(path);
+    }
+    closedir(dir);
+  }
+  rmdir(run_dir);
+  run_dir[0] = '\0';
+}
+
+static uint64_t mono_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static bool item_stale(int prio, uint64_t queued_ms, uint64_t now)
+{
+  return deadline_ms[prio] != 0 && now - queued_ms > deadline_ms[prio];
+}
+
+static void msg_release(struct tts_msg *m)
+{
+  if(atomic_fetch_sub(&m->refs, 1) == 1){
+    free(m);
+  }
+}
+
 static void queue_init(struct tts_queue *q)
 {
   memset(q, 0, sizeof(*q));
@@ -275,16 +623,29 @@ static void queue_init(struct tts_queue *q)
   pthread_cond_init(&q->cv, NULL);
 }
 
+static void level_drop_head(struct tts_level *l)
+{
+  free(l->items[l->head].text);
+  l->items[l->head].text = NULL;
+  l->head = (l->head + 1) % TTS_QUEUE_CAP;
+  l->count -= 1;
+}
+
 static void queue_destroy(struct tts_queue *q)
 {
-  int i;
+  int p;
   if(q == NULL){
     return;
   }
-  for(i = 0; i < q->count; ++i){
-    int idx = (q->head + i) % TTS_QUEUE_CAP;
-    free(q->items[idx]);
-    q->items[idx] = NULL;
+  for(p = 0; p < SPEECH_PRIO_COUNT; ++p){
+    while(q->levels[p].count > 0){
+      level_drop_head(&q->levels[p]);
+    }
+  }
+  for(p = 0; p < TTS_ACTIVE; ++p){
+    if(q->active[p] != NULL){
+      msg_release(q->active[p]);
+    }
   }
   pthread_mutex_destroy(&q->mtx);
   pthread_cond_destroy(&q->cv);
@@ -299,80 +660,204 @@ static void queue_stop(struct tts_queue *q)
   pthread_mutex_unlock(&q->mtx);
 }
 
-static void queue_push(struct tts_queue *q, const char *text)
+static bool queue_stopped(struct tts_queue *q)
 {
-  size_t len;
-  char *copy;
-  if(text == NULL || *text == '\0'){
-    return;
+  bool res;
+  pthread_mutex_lock(&q->mtx);
+  res = q->stop;
+  pthread_mutex_unlock(&q->mtx);
+  return res;
+}
+
+//A queued item with the same key gets the new text in place; a message
+//past the queue that hasn't started playing yet is cancelled
+static bool queue_supersede(struct tts_queue *q, char *text, int prio, uint64_t key)
+{
+  struct tts_level *l = &q->levels[prio];
+  int i;
+  for(i = 0; i < l->count; ++i){
+    struct tts_item *it = &l->items[(l->head + i) % TTS_QUEUE_CAP];
+    if(it->key == key){
+      free(it->text);
+      it->text = text;
+      it->queued_ms = mono_ms();
+      q->superseded += 1;
+      return true;
+    }
   }
-  len = strnlen(text, TTS_MAX_TEXT);
-  copy = (char *)malloc(len + 1);
-  if(copy == NULL){
-    return;
+  for(i = 0; i < TTS_ACTIVE; ++i){
+    struct tts_msg *m = q->active[i];
+    int fate = MSG_PENDING;
+    if(m == NULL || m->key != key || atomic_load(&m->played)){
+      continue;
+    }
+    if(atomic_compare_exchange_strong(&m->fate, &fate, MSG_CANCELLED)){
+      q->superseded += 1;
+      continue;
+    }
+    fate = MSG_STARTED;
+    if(atomic_compare_exchange_strong(&m->fate, &fate, MSG_CANCELLED)){
+      q->superseded += 1;
+    }
   }
-  memcpy(copy, text, len);
-  copy[len] = '\0';
+  return false;
+}
+
+//Takes ownership of text
+static void queue_push(struct tts_queue *q, char *text, int prio, uint64_t key, uint64_t bkey)
+{
+  struct tts_level *l = &q->levels[prio];
 
   pthread_mutex_lock(&q->mtx);
   if(q->stop){
     pthread_mutex_unlock(&q->mtx);
-    free(copy);
+    free(text);
+    return;
+  }
+  if(key != 0 && queue_supersede(q, text, prio, key)){
+    pthread_cond_signal(&q->cv);
+    pthread_mutex_unlock(&q->mtx);
     return;
   }
   if(q->count == TTS_QUEUE_CAP){
-    free(q->items[q->head]);
-    q->items[q->head] = NULL;
-    q->head = (q->head + 1) % TTS_QUEUE_CAP;
+    //Make room at the expense of the least important class
+    int p = SPEECH_PRIO_COUNT - 1;
+    while(q->levels[p].count == 0){
+      --p;
+    }
+    if(p < prio){
+      pthread_mutex_unlock(&q->mtx);
+      free(text);
+      return;
+    }
+    level_drop_head(&q->levels[p]);
     q->count -= 1;
   }
-  q->items[q->tail] = copy;
-  q->tail = (q->tail + 1) % TTS_QUEUE_CAP;
+  l->items[l->tail].text = text;
+  l->items[l->tail].prio = prio;
+  l->items[l->tail].queued_ms = mono_ms();
+  l->items[l->tail].key = key;
+  l->items[l->tail].bkey = bkey;
+  l->tail = (l->tail + 1) % TTS_QUEUE_CAP;
+  l->count += 1;
   q->count += 1;
   pthread_cond_signal(&q->cv);
   pthread_mutex_unlock(&q->mtx);
 }
 
-static char *queue_pop(struct tts_queue *q)
+//Highest priority first, FIFO within a class; items past their deadline are dropped
+static bool queue_pop(struct tts_queue *q, struct tts_item *item)
 {
-  char *item = NULL;
+  bool res = false;
+  unsigned long stale = 0;
+  int p;
   pthread_mutex_lock(&q->mtx);
-  while(q->count == 0 && !q->stop){
-    pthread_cond_wait(&q->cv, &q->mtx);
-  }
-  if(q->count > 0){
-    item = q->items[q->head];
-    q->items[q->head] = NULL;
-    q->head = (q->head + 1) % TTS_QUEUE_CAP;
-    q->count -= 1;
+  while(!res && !q->stop){
+    uint64_t now;
+    while(q->count == 0 && !q->stop){
+      pthread_cond_wait(&q->cv, &q->mtx);
+    }
+    now = mono_ms();
+    for(p = 0; p < SPEECH_PRIO_COUNT && !q->stop; ++p){
+      struct tts_level *l = &q->levels[p];
+      while(l->count > 0 && item_stale(p, l->items[l->head].queued_ms, now)){
+        level_drop_head(l);
+        q->count -= 1;
+        stale += 1;
+      }
+      if(l->count > 0){
+        *item = l->items[l->head];
+        l->items[l->head].text = NULL;
+        l->head = (l->head + 1) % TTS_QUEUE_CAP;
+        l->count -= 1;
+        q->count -= 1;
+        res = true;
+        break;
+      }
+    }
   }
   pthread_mutex_unlock(&q->mtx);
-  return item;
+  if(stale > 0){
+    atomic_fetch_add(&stale_dropped, stale);
+    xcDebug("XLinSpeak: Dropped %lu message(s) that waited too long.\n", stale);
+  }
+  return res;
 }
 
-static void write_all(int fd, const char *buf, size_t len)
+//One sentence of at most coalesce_chars, chars gets its length
+static bool item_short(const char *text, size_t *chars)
 {
-  size_t off = 0;
-  while(off < len){
-    ssize_t res = write(fd, buf + off, len - off);
-    if(res < 0){
-      if(errno == EINTR){
-        continue;
-      }
-      break;
+  size_t len = strlen(text);
+  size_t pos = text_skip_space(text, len);
+  size_t n;
+  if(len > coalesce_chars || pos == len){
+    return false;
+  }
+  n = text_segment_len(text + pos, len - pos, TTS_SEGMENT_SOFT, TTS_SEGMENT_HARD);
+  pos += n;
+  pos += text_skip_space(text + pos, len - pos);
+  *chars = len;
+  return n > 0 && pos == len;
+}
+
+//Takes the items queued right behind a short first one while they are
+//short too, were queued within coalesce_ms of it and fit coalesce_chars
+//together. Nothing is taken while a more important class is waiting.
+static unsigned queue_pop_merge(struct tts_queue *q, const struct tts_item *first,
+                                struct tts_item more[], unsigned max)
+{
+  struct tts_level *l = &q->levels[first->prio];
+  size_t total;
+  unsigned n = 0;
+  int p;
+
+  if(coalesce_chars == 0 || !item_short(first->text, &total)){
+    return 0;
+  }
+  pthread_mutex_lock(&q->mtx);
+  for(p = 0; p < first->prio; ++p){
+    if(q->levels[p].count > 0){
+      max = 0;
     }
-    if(res == 0){
+  }
+  while(n < max && l->count > 0 && !q->stop){
+    struct tts_item *it = &l->items[l->head];
+    size_t chars;
+    if(it->queued_ms - first->queued_ms > coalesce_ms || !item_short(it->text, &chars) ||
+       total + chars > coalesce_chars){
       break;
     }
-    off += (size_t)res;
+    total += chars;
+    more[n++] = *it;
+    it->text = NULL;
+    l->head = (l->head + 1) % TTS_QUEUE_CAP;
+    l->count -= 1;
+    q->count -= 1;
+  }
+  pthread_mutex_unlock(&q->mtx);
+  return n;
+}
+
+//Remembers a message taken from the queue, so a newer one can cancel it
+static void queue_track(struct tts_queue *q, struct tts_msg *m)
+{
+  struct tts_msg *old;
+  atomic_fetch_add(&m->refs, 1);
+  pthread_mutex_lock(&q->mtx);
+  old = q->active[q->active_next];
+  q->active[q->active_next] = m;
+  q->active_next = (q->active_next + 1) % TTS_ACTIVE;
+  pthread_mutex_unlock(&q->mtx);
+  if(old != NULL){
+    msg_release(old);
   }
 }
 
-static bool read_exact(int fd, void *buf, size_t len)
+bool write_all(int fd, const char *buf, size_t len)
 {
   size_t off = 0;
   while(off < len){
-    ssize_t res = read(fd, (uint8_t *)buf + off, len - off);
+    ssize_t res = write(fd, buf + off, len - off);
     if(res < 0){
       if(errno == EINTR){
         continue;
@@ -387,150 +872,7 @@ static bool read_exact(int fd, void *buf, size_t len)
   return true;
 }
 
-static bool skip_bytes(int fd, size_t len)
-{
-  uint8_t tmp[512];
-  while(len > 0){
-    size_t chunk = len > sizeof(tmp) ? sizeof(tmp) : len;
-    if(!read_exact(fd, tmp, chunk)){
-      return false;
-    }
-    len -= chunk;
-  }
-  return true;
-}
-
-static uint16_t le16(const uint8_t *p)
-{
-  return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
-}
-
-static uint32_t le32(const uint8_t *p)
-{
-  return (uint32_t)p[0] |
-         ((uint32_t)p[1] << 8) |
-         ((uint32_t)p[2] << 16) |
-         ((uint32_t)p[3] << 24);
-}
-
-struct wav_info {
-  uint16_t format;
-  uint16_t channels;
-  uint32_t sample_rate;
-  uint16_t bits_per_sample;
-};
-
-static bool wav_read_header(int fd, struct wav_info *info)
-{
-  uint8_t hdr[12];
-  bool got_fmt = false;
-  bool got_data = false;
-
-  if(!read_exact(fd, hdr, sizeof(hdr))){
-    return false;
-  }
-  if(memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0){
-    return false;
-  }
-
-  while(!got_data){
-    uint8_t chunk[8];
-    uint32_t size;
-    if(!read_exact(fd, chunk, sizeof(chunk))){
-      return false;
-    }
-    size = le32(chunk + 4);
-
-    if(memcmp(chunk, "fmt ", 4) == 0){
-      uint8_t fmt[16];
-      if(size < 16){
-        return false;
-      }
-      if(!read_exact(fd, fmt, 16)){
-        return false;
-      }
-      info->format = le16(fmt + 0);
-      info->channels = le16(fmt + 2);
-      info->sample_rate = le32(fmt + 4);
-      info->bits_per_sample = le16(fmt + 14);
-      got_fmt = true;
-      if(size > 16){
-        if(!skip_bytes(fd, size - 16)){
-          return false;
-        }
-      }
-      if(size & 1){
-        if(!skip_bytes(fd, 1)){
-          return false;
-        }
-      }
-    }else if(memcmp(chunk, "data", 4) == 0){
-      got_data = true;
-    }else{
-      if(!skip_bytes(fd, size)){
-        return false;
-      }
-      if(size & 1){
-        if(!skip_bytes(fd, 1)){
-          return false;
-        }
-      }
-    }
-  }
-
-  return got_fmt;
-}
-
-#ifdef USE_PULSE
-static bool pulse_open(const struct wav_info *info)
-{
-  int err;
-  pa_sample_spec spec;
-
-  if(info->format != 1){
-    xcDebug("XLinSpeak: Pulse only supports PCM WAV from Piper.\n");
-    return false;
-  }
-  if(info->bits_per_sample != 16){
-    xcDebug("XLinSpeak: Pulse only supports 16-bit PCM from Piper.\n");
-    return false;
-  }
-  if(info->channels == 0 || info->sample_rate == 0){
-    xcDebug("XLinSpeak: Invalid WAV header from Piper.\n");
-    return false;
-  }
-
-  spec.format = PA_SAMPLE_S16LE;
-  spec.rate = info->sample_rate;
-  spec.channels = (uint8_t)info->channels;
-
-  if(!pa_sample_spec_valid(&spec)){
-    xcDebug("XLinSpeak: Invalid Pulse sample spec.\n");
-    return false;
-  }
-
-  if(pulse_stream != NULL){
-    if(pulse_spec.rate == spec.rate &&
-       pulse_spec.channels == spec.channels &&
-       pulse_spec.format == spec.format){
-      return true;
-    }
-    pa_simple_free(pulse_stream);
-    pulse_stream = NULL;
-  }
-
-  pulse_stream = pa_simple_new(NULL, "XLinSpeak", PA_STREAM_PLAYBACK, NULL,
-                               "Piper", &spec, NULL, NULL, &err);
-  if(pulse_stream == NULL){
-    xcDebug("XLinSpeak: Pulse open failed: %s\n", pa_strerror(err));
-    return false;
-  }
-  pulse_spec = spec;
-  return true;
-}
-#endif
-
-static int set_cloexec(int fd)
+int set_cloexec(int fd)
 {
   int flags = fcntl(fd, F_GETFD);
   if(flags < 0){
@@ -539,11 +881,13 @@ static int set_cloexec(int fd)
   return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
 }
 
-static bool spawn_process(char *const argv[], int stdin_fd, int stdout_fd,
-                          const int *close_fds, size_t close_count,
-                          pid_t *pid_out)
+bool spawn_process(char *const argv[], int stdin_fd, int stdout_fd,
+                   const int *close_fds, size_t close_count,
+                   pid_t *pid_out)
 {
   posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t none;
   size_t i;
   int res;
 
@@ -554,6 +898,14 @@ static bool spawn_process(char *const argv[], int stdin_fd, int stdout_fd,
   if(posix_spawn_file_actions_init(&actions) != 0){
     return false;
   }
+  //Workers block SIGPIPE, children must not inherit that
+  if(posix_spawnattr_init(&attr) != 0){
+    posix_spawn_file_actions_destroy(&actions);
+    return false;
+  }
+  sigemptyset(&none);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
 
   if(stdin_fd >= 0){
     posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
@@ -565,8 +917,9 @@ static bool spawn_process(char *const argv[], int stdin_fd, int stdout_fd,
     posix_spawn_file_actions_addclose(&actions, close_fds[i]);
   }
 
-  res = posix_spawnp(pid_out, argv[0], &actions, NULL, argv, environ);
+  res = posix_spawnp(pid_out, argv[0], &actions, &attr, argv, environ);
   posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
 
   if(res != 0){
     errno = res;
@@ -575,27 +928,27 @@ static bool spawn_process(char *const argv[], int stdin_fd, int stdout_fd,
   return true;
 }
 
-static void speak_piper(const char *text)
+/*
+ * Persistent Piper process. Piper is started once with --json-input and an
+ * output directory, so the voice model stays loaded. Every utterance is one
+ * JSON line naming its own WAV file in run_dir; Piper prints that path on
+ * stdout once the file is complete, which marks the utterance boundary.
+ */
+static bool server_start(struct piper_server *s)
 {
   int inpipe[2];
   int outpipe[2];
-  pid_t piper_pid;
-  pid_t sink_pid;
   int close_all[4];
 
-  if(text == NULL || *text == '\0'){
-    return;
-  }
-
   if(pipe(inpipe) != 0){
-    xcDebug("XLinSpeak: Piper pipe(in) failed: %d\n", errno);
-    return;
+    xcDebug("XLinSpeak: Piper server pipe(in) failed: %d\n", errno);
+    return false;
   }
   if(pipe(outpipe) != 0){
-    xcDebug("XLinSpeak: Piper pipe(out) failed: %d\n", errno);
+    xcDebug("XLinSpeak: Piper server pipe(out) failed: %d\n", errno);
     close(inpipe[0]);
     close(inpipe[1]);
-    return;
+    return false;
   }
 
   set_cloexec(inpipe[0]);
@@ -608,120 +961,1942 @@ static void speak_piper(const char *text)
   close_all[2] = outpipe[0];
   close_all[3] = outpipe[1];
 
-  if(!spawn_process(piper_cmd.argv, inpipe[0], outpipe[1], close_all, 4, &piper_pid)){
-    xcDebug("XLinSpeak: Piper spawn failed: %d\n", errno);
+  if(!spawn_process(s->cmd->argv, inpipe[0], outpipe[1], close_all, 4, &s->pid)){
+    xcDebug("XLinSpeak: Piper server spawn failed: %d\n", errno);
     close(inpipe[0]);
     close(inpipe[1]);
     close(outpipe[0]);
     close(outpipe[1]);
-    return;
+    s->pid = -1;
+    return false;
   }
 
   close(inpipe[0]);
   close(outpipe[1]);
+  s->in_fd = inpipe[1];
+  s->out_fd = outpipe[0];
+  s->line_len = 0;
+  return true;
+}
 
-  write_all(inpipe[1], text, strlen(text));
-  write_all(inpipe[1], "\n", 1);
-  close(inpipe[1]);
+static void server_stop(struct piper_server *s)
+{
+  if(s->in_fd >= 0){
+    close(s->in_fd);
+    s->in_fd = -1;
+  }
+  if(s->out_fd >= 0){
+    close(s->out_fd);
+    s->out_fd = -1;
+  }
+  if(s->pid > 0){
+    kill(s->pid, SIGTERM);
+    waitpid(s->pid, NULL, 0);
+    s->pid = -1;
+  }
+}
 
-#ifdef USE_PULSE
-  if(pulse_enabled){
-    struct wav_info info;
-    uint8_t buf[4096];
-    ssize_t r;
-    int err;
-    bool ok = wav_read_header(outpipe[0], &info);
-
-    if(ok && pulse_open(&info)){
-      while((r = read(outpipe[0], buf, sizeof(buf))) > 0){
-        if(pa_simple_write(pulse_stream, buf, (size_t)r, &err) < 0){
-          xcDebug("XLinSpeak: Pulse write failed: %s\n", pa_strerror(err));
-          break;
-        }
+//Brings up a fresh instance right away, so the model loads while idle
+static void server_restart(struct piper_server *s)
+{
+  server_stop(s);
+  xcDebug("XLinSpeak: Restarting Piper server.\n");
+  server_start(s);
+}
+
+static bool server_alive(struct piper_server *s)
+{
+  int status;
+  pid_t res;
+  if(s->pid <= 0){
+    return false;
+  }
+  res = waitpid(s->pid, &status, WNOHANG);
+  if(res == 0){
+    return true;
+  }
+  if(res == s->pid){
+    if(WIFEXITED(status)){
+      xcDebug("XLinSpeak: Piper server exited with status %d.\n", WEXITSTATUS(status));
+    }else if(WIFSIGNALED(status)){
+      xcDebug("XLinSpeak: Piper server killed by signal %d.\n", WTERMSIG(status));
+    }
+    s->pid = -1;
+  }
+  return false;
+}
+
+//Reads one line from Piper's stdout into s->line, false on EOF or timeout
+static bool server_read_line(struct piper_server *s, int timeout_ms)
+{
+  while(1){
+    char *nl = memchr(s->line, '\n', s->line_len);
+    struct pollfd pfd;
+    ssize_t res;
+    int pres;
+
+    if(nl != NULL){
+      size_t used = (size_t)(nl - s->line) + 1;
+      *nl = '\0';
+      memcpy(s->path, s->line, used);
+      memmove(s->line, s->line + used, s->line_len - used);
+      s->line_len -= used;
+      return true;
+    }
+    if(s->line_len == sizeof(s->line)){
+      //Not a path we could have asked for, drop it
+      s->line_len = 0;
+    }
+
+    pfd.fd = s->out_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pres = poll(&pfd, 1, timeout_ms);
+    if(pres < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return false;
+    }
+    if(pres == 0){
+      xcDebug("XLinSpeak: Piper server timed out.\n");
+      return false;
+    }
+    res = read(s->out_fd, s->line + s->line_len, sizeof(s->line) - s->line_len);
+    if(res < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return false;
+    }
+    if(res == 0){
+      return false;
+    }
+    s->line_len += (size_t)res;
+  }
+}
+
+struct strbuf {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+static bool sb_put(struct strbuf *sb, const char *str, size_t n)
+{
+  if(sb->len + n + 1 > sb->cap){
+    size_t ncap = sb->cap * 2 + n + 1;
+    char *tmp = (char *)realloc(sb->buf, ncap);
+    if(tmp == NULL){
+      return false;
+    }
+    sb->buf = tmp;
+    sb->cap = ncap;
+  }
+  memcpy(sb->buf + sb->len, str, n);
+  sb->len += n;
+  sb->buf[sb->len] = '\0';
+  return true;
+}
+
+static bool sb_put_json(struct strbuf *sb, const char *str)
+{
+  const char *p;
+  for(p = str; *p; ++p){
+    char esc[2];
+    size_t n = 1;
+    unsigned char c = (unsigned char)*p;
+
+    if(c == '"' || c == '\\'){
+      esc[0] = '\\';
+      esc[1] = (char)c;
+      n = 2;
+    }else if(c < 0x20){
+      //Newlines would end the request early
+      esc[0] = ' ';
+    }else{
+      esc[0] = (char)c;
+    }
+    if(!sb_put(sb, esc, n)){
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool server_synth(struct piper_server *s, const char *text, struct pcm_buf *pcm)
+{
+  struct strbuf req = {NULL, 0, 0};
+  char out_file[sizeof(s->path)];
+  size_t dir_len = strlen(run_dir);
+  bool ok = false;
+  int fd;
+
+  if(!server_alive(s)){
+    server_restart(s);
+    if(s->pid <= 0){
+      return false;
+    }
+  }
+
+  s->seq += 1;
+  snprintf(out_file, sizeof(out_file), "%s/utt-%u-%lu.wav", run_dir, s->id, s->seq);
+  if(!sb_put(&req, "{\"text\": \"", 10) ||
+     !sb_put_json(&req, text) ||
+     !sb_put(&req, "\", \"output_file\": \"", 19) ||
+     !sb_put_json(&req, out_file) ||
+     !sb_put(&req, "\"}\n", 3)){
+    free(req.buf);
+    return false;
+  }
+  if(!write_all(s->in_fd, req.buf, req.len)){
+    xcDebug("XLinSpeak: Piper server write failed: %d\n", errno);
+    free(req.buf);
+    server_restart(s);
+    return false;
+  }
+  free(req.buf);
+
+  if(!server_read_line(s, server_timeout_ms)){
+    server_restart(s);
+    unlink(out_file);
+    return false;
+  }
+
+  //Only ever touch files inside our own run directory
+  if(strncmp(s->path, run_dir, dir_len) != 0 || s->path[dir_len] != '/' ||
+     strstr(s->path + dir_len, "/..") != NULL){
+    xcDebug("XLinSpeak: Unexpected Piper server output: %s\n", s->path);
+    unlink(out_file);
+    return false;
+  }
+
+  fd = open(s->path, O_RDONLY | O_CLOEXEC);
+  if(fd >= 0){
+    ok = pcm_read_fd(fd, pcm);
+    close(fd);
+  }
+  if(!ok){
+    xcDebug("XLinSpeak: Couldn't read Piper output %s.\n", s->path);
+  }
+  unlink(s->path);
+  if(strcmp(s->path, out_file) != 0){
+    unlink(out_file);
+  }
+  return ok;
+}
+
+static void server_close(void)
+{
+  int v;
+  for(v = 0; v < voice_count; ++v){
+    argv_free(&voices[v].server_cmd);
+  }
+  run_dir_remove();
+}
+
+//The servers themselves are started by their workers
+static bool server_init(void)
+{
+  int v;
+  unsigned i;
+  server_timeout_ms = (int)env_long("PIPER_TIMEOUT_MS", 30000, 100, 600000);
+  if(!run_dir_create()){
+    xcDebug("XLinSpeak: Couldn't create Piper run directory: %d\n", errno);
+    return false;
+  }
+  for(v = 0; v < voice_count; ++v){
+    if(!build_server_cmd(&voices[v])){
+      server_close();
+      return false;
+    }
+  }
+  for(i = 0; i < worker_count; ++i){
+    servers[i].id = i;
+    servers[i].cmd = &voices[worker_voice[i]].server_cmd;
+  }
+  return true;
+}
+
+//Spawns Piper for a single utterance and captures its WAV output
+static bool piper_once_synth(const struct tts_cmd *piper_cmd, const char *text, struct pcm_buf *pcm)
+{
+  int inpipe[2];
+  int outpipe[2];
+  pid_t piper_pid;
+  int close_all[4];
+  bool ok;
+
+  if(pipe(inpipe) != 0){
+    xcDebug("XLinSpeak: Piper pipe(in) failed: %d\n", errno);
+    return false;
+  }
+  if(pipe(outpipe) != 0){
+    xcDebug("XLinSpeak: Piper pipe(out) failed: %d\n", errno);
+    close(inpipe[0]);
+    close(inpipe[1]);
+    return false;
+  }
+
+  set_cloexec(inpipe[0]);
+  set_cloexec(inpipe[1]);
+  set_cloexec(outpipe[0]);
+  set_cloexec(outpipe[1]);
+
+  close_all[0] = inpipe[0];
+  close_all[1] = inpipe[1];
+  close_all[2] = outpipe[0];
+  close_all[3] = outpipe[1];
+
+  if(!spawn_process(piper_cmd->argv, inpipe[0], outpipe[1], close_all, 4, &piper_pid)){
+    xcDebug("XLinSpeak: Piper spawn failed: %d\n", errno);
+    close(inpipe[0]);
+    close(inpipe[1]);
+    close(outpipe[0]);
+    close(outpipe[1]);
+    return false;
+  }
+
+  close(inpipe[0]);
+  close(outpipe[1]);
+
+  write_all(inpipe[1], text, strlen(text));
+  write_all(inpipe[1], "\n", 1);
+  close(inpipe[1]);
+
+  ok = pcm_read_fd(outpipe[0], pcm);
+  if(!ok){
+    xcDebug("XLinSpeak: Piper WAV output invalid.\n");
+  }
+  close(outpipe[0]);
+  waitpid(piper_pid, NULL, 0);
+  return ok;
+}
+
+static unsigned higher_gen(int prio)
+{
+  unsigned sum = 0;
+  int p;
+  for(p = 0; p < prio; ++p){
+    sum += atomic_load(&prio_gen[p]);
+  }
+  return sum;
+}
+
+static bool audio_preempted(const struct tts_audio *audio)
+{
+  return higher_gen(audio->prio) != audio->gen || atomic_load(&play_stop) ||
+         (audio->msg != NULL && atomic_load(&audio->msg->fate) == MSG_CANCELLED);
+}
+
+static void audio_free(struct tts_audio *audio)
+{
+  pcm_free(&audio->pcm);
+  if(audio->msg != NULL){
+    msg_release(audio->msg);
+  }
+  free(audio);
+}
+
+static size_t play_chunk(const struct wav_info *info)
+{
+  size_t frame = (size_t)info->channels * (info->bits_per_sample / 8);
+  size_t frames = (size_t)info->sample_rate * PLAY_CHUNK_MS / 1000;
+  if(frame == 0){
+    frame = 1;
+  }
+  if(frames == 0){
+    frames = 1;
+  }
+  return frame * frames;
+}
+
+//Plays one segment, checking for preemption every PLAY_CHUNK_MS
+static void play_pcm(const struct tts_audio *audio)
+{
+  const struct pcm_buf *pcm = &audio->pcm;
+  size_t chunk = play_chunk(&pcm->info);
+  size_t off = 0;
+  bool preempted = false;
+  unsigned long lat;
+  uint8_t hdr[44];
+  int inpipe[2];
+  pid_t sink_pid;
+
+  if(audio_enabled){
+    if(!audio_open(&pcm->info)){
+      return;
+    }
+    while(off < pcm->len){
+      size_t n = pcm->len - off < chunk ? pcm->len - off : chunk;
+      if(audio_preempted(audio)){
+        preempted = true;
+        break;
+      }
+      if(!audio_write(pcm->data + off, n)){
+        break;
+      }
+      off += n;
+      if(audio_latency(&lat)){
+        play_lat_sum += lat;
+        play_lat_max = lat > play_lat_max ? lat : play_lat_max;
+        play_lat_count += 1;
+      }
+    }
+    while(!preempted && audio_playing()){
+      if(audio_preempted(audio)){
+        preempted = true;
+        break;
+      }
+      usleep(PLAY_CHUNK_MS * 1000 / 5);
+    }
+    if(preempted){
+      audio_flush();
+      xcDebug("XLinSpeak: Playback preempted.\n");
+    }
+    return;
+  }
+
+  if(pipe(inpipe) != 0){
+    xcDebug("XLinSpeak: Sink pipe failed: %d\n", errno);
+    return;
+  }
+  set_cloexec(inpipe[0]);
+  set_cloexec(inpipe[1]);
+  if(!spawn_process(sink_cmd.argv, inpipe[0], -1, inpipe, 2, &sink_pid)){
+    xcDebug("XLinSpeak: Sink spawn failed: %d\n", errno);
+    close(inpipe[0]);
+    close(inpipe[1]);
+    return;
+  }
+  close(inpipe[0]);
+
+  wav_make_header(hdr, &pcm->info, pcm->len);
+  if(!write_all(inpipe[1], (const char *)hdr, sizeof(hdr))){
+    xcDebug("XLinSpeak: Sink write failed: %d\n", errno);
+    off = pcm->len;
+  }
+  while(off < pcm->len){
+    size_t n = pcm->len - off < chunk ? pcm->len - off : chunk;
+    if(audio_preempted(audio)){
+      preempted = true;
+      break;
+    }
+    if(!write_all(inpipe[1], (const char *)pcm->data + off, n)){
+      xcDebug("XLinSpeak: Sink write failed: %d\n", errno);
+      break;
+    }
+    off += n;
+  }
+  close(inpipe[1]);
+  //The sink still holds up to a pipe full of audio
+  while(!preempted){
+    pid_t res = waitpid(sink_pid, NULL, WNOHANG);
+    if(res == sink_pid || (res < 0 && errno != EINTR)){
+      return;
+    }
+    if(audio_preempted(audio)){
+      preempted = true;
+      break;
+    }
+    usleep(PLAY_CHUNK_MS * 1000 / 5);
+  }
+  xcDebug("XLinSpeak: Playback preempted.\n");
+  kill(sink_pid, SIGTERM);
+  waitpid(sink_pid, NULL, 0);
+}
+
+static bool synth_piper(unsigned worker, const char *text, struct pcm_buf *pcm)
+{
+  const struct tts_voice *v = &voices[worker_voice[worker]];
+  uint64_t key;
+  bool ok = false;
+
+  key = cache_key(v->key, text);
+  if(cache_get(key, text, pcm)){
+    return true;
+  }
+  if(store_get(v->key, key, text, pcm)){
+    cache_put(key, text, pcm);
+    return true;
+  }
+  if(server_enabled){
+    ok = server_synth(&servers[worker], text, pcm);
+    if(!ok){
+      xcDebug("XLinSpeak: Piper server failed, falling back to one-shot Piper.\n");
+    }
+  }
+  if(!ok){
+    ok = piper_once_synth(&v->piper_cmd, text, pcm);
+  }
+  if(!ok){
+    return false;
+  }
+  cache_put(key, text, pcm);
+  store_put(v->key, key, text, pcm);
+  return true;
+}
+
+static bool synth_cached(unsigned worker, const char *text)
+{
+  const struct tts_voice *v = &voices[worker_voice[worker]];
+  uint64_t key = cache_key(v->key, text);
+  return cache_has(key, text) || store_has(v->key, key);
+}
+
+//Appends frag to pcm, crossfading over splice_crossfade_ms
+static bool splice_join(struct pcm_buf *pcm, struct pcm_buf *frag)
+{
+  struct pcm_buf tail = {0};
+  size_t frames = (size_t)frag->info.sample_rate * splice_crossfade_ms / 1000;
+  if(pcm->data != NULL && frames > 0 && pcm_split_tail(pcm, frames, &tail)){
+    bool ok = pcm_crossfade(frag, &tail) || pcm_append(pcm, &tail);
+    pcm_free(&tail);
+    if(!ok){
+      return false;
+    }
+  }
+  return pcm_append(pcm, frag);
+}
+
+//Queues a fixed part for the prewarm thread, unless it is already waiting
+static void splice_wish(unsigned worker, const char *piece)
+{
+  int voice = worker_voice[worker];
+  unsigned i;
+  pthread_mutex_lock(&splice_want.mtx);
+  for(i = 0; i < splice_want.count; ++i){
+    if(splice_want.voice[i] == voice && strcmp(splice_want.text[i], piece) == 0){
+      break;
+    }
+  }
+  if(i == splice_want.count && i < SPLICE_WANT_MAX){
+    splice_want.text[i] = strdup(piece);
+    if(splice_want.text[i] != NULL){
+      splice_want.voice[i] = voice;
+      splice_want.count += 1;
+    }
+  }
+  pthread_mutex_unlock(&splice_want.mtx);
+}
+
+//Takes the oldest wanted fixed part, the caller frees text
+static char *splice_wish_take(int *voice)
+{
+  char *text = NULL;
+  pthread_mutex_lock(&splice_want.mtx);
+  if(splice_want.count > 0){
+    text = splice_want.text[0];
+    *voice = splice_want.voice[0];
+    splice_want.count -= 1;
+    memmove(splice_want.text, splice_want.text + 1, splice_want.count * sizeof(splice_want.text[0]));
+    memmove(splice_want.voice, splice_want.voice + 1, splice_want.count * sizeof(splice_want.voice[0]));
+  }
+  pthread_mutex_unlock(&splice_want.mtx);
+  return text;
+}
+
+/*
+ * Builds a segment from the fixed parts and variable slots of a template,
+ * each synthesized and cached on its own, so only new slot values cost a
+ * Piper call. Taken when the whole segment isn't cached but all its fixed
+ * parts are. Missing fixed parts of a template that came up before are left
+ * to the prewarm thread, so a later sentence can be spliced. False leaves pcm
+ * empty and the segment to synth_piper().
+ */
+static bool synth_splice(unsigned worker, const char *text, struct pcm_buf *pcm)
+{
+  struct templ_frag frags[TEMPL_FRAGS];
+  struct trim_cfg cfg = trim_config;
+  size_t len = strlen(text);
+  size_t n = templ_split(text, len, frags, TEMPL_FRAGS);
+  size_t i;
+  unsigned long synthesized = 0;
+  bool known = true;
+  bool seen;
+  char *piece;
+
+  if(n == 0){
+    return false;
+  }
+  seen = templ_seen(templ_key(text, frags, n));
+  if(synth_cached(worker, text)){
+    return false;
+  }
+  piece = (char *)malloc(len + 1);
+  if(piece == NULL){
+    return false;
+  }
+  for(i = 0; i < n; ++i){
+    memcpy(piece, text + frags[i].start, frags[i].len);
+    piece[frags[i].len] = '\0';
+    if(!frags[i].slot && !synth_cached(worker, piece)){
+      known = false;
+      if(!seen){
+        break;
+      }
+      splice_wish(worker, piece);
+    }
+  }
+  cfg.pad_ms = SPLICE_TRIM_PAD_MS;
+  cfg.fade_ms = SPLICE_TRIM_FADE_MS;
+  for(i = 0; i < n && known; ++i){
+    struct pcm_buf frag = {0};
+    memcpy(piece, text + frags[i].start, frags[i].len);
+    piece[frags[i].len] = '\0';
+    if(!synth_cached(worker, piece)){
+      synthesized += 1;
+    }
+    if(!synth_piper(worker, piece, &frag) || !trim_pcm(&frag, &cfg) || !splice_join(pcm, &frag)){
+      pcm_free(&frag);
+      pcm_free(pcm);
+      known = false;
+      break;
+    }
+    pcm_free(&frag);
+  }
+  free(piece);
+  if(known){
+    atomic_fetch_add(&splice_segments, 1);
+    atomic_fetch_add(&splice_fragments, n);
+    atomic_fetch_add(&splice_synthesized, synthesized);
+  }
+  return known;
+}
+
+#ifdef USE_SPEECHD
+static bool speechd_init(void)
+{
+  conn = spd_open("XLinSpeak", "Main", "player", SPD_MODE_SINGLE);
+  if(conn == NULL){
+    xcDebug("XLinSpeak: Couldn't init speech-dispatcher!\n");
+    return false;
+  }
+  return true;
+}
+
+static void speechd_say(const char *str)
+{
+  if(conn != NULL){
+    spd_say(conn, SPD_MESSAGE, str);
+  }
+}
+
+static void speechd_close(void)
+{
+  if(conn != NULL){
+    spd_close(conn);
+    conn = NULL;
+  }
+}
+#endif
+
+static void ring_init(struct audio_ring *r)
+{
+  memset(r->slots, 0, sizeof(r->slots));
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  sem_init(&r->items, 0, 0);
+  sem_init(&r->space, 0, AUDIO_RING_CAP);
+}
+
+static void ring_destroy(struct audio_ring *r)
+{
+  sem_destroy(&r->items);
+  sem_destroy(&r->space);
+}
+
+static void sem_wait_intr(sem_t *sem)
+{
+  while(sem_wait(sem) != 0 && errno == EINTR){
+  }
+}
+
+//NULL is the end of stream marker
+static void ring_push(struct audio_ring *r, struct tts_audio *audio)
+{
+  unsigned tail;
+  sem_wait_intr(&r->space);
+  tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  r->slots[tail % AUDIO_RING_CAP] = audio;
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  sem_post(&r->items);
+}
+
+static struct tts_audio *ring_pop(struct audio_ring *r)
+{
+  unsigned head;
+  struct tts_audio *audio;
+  sem_wait_intr(&r->items);
+  head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  (void)atomic_load_explicit(&r->tail, memory_order_acquire);
+  audio = r->slots[head % AUDIO_RING_CAP];
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  sem_post(&r->space);
+  return audio;
+}
+
+static bool ring_empty(struct audio_ring *r)
+{
+  return atomic_load_explicit(&r->head, memory_order_relaxed) ==
+         atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+//A dead Piper or sink must surface as EPIPE, not kill the sim
+static void block_sigpipe(void)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+//The first segment to start decides for the whole message
+static bool msg_start(struct tts_msg *m, int prio)
+{
+  int fate = MSG_PENDING;
+  uint64_t now = mono_ms();
+  int decision = item_stale(prio, m->queued_ms, now) ? MSG_DROPPED : MSG_STARTED;
+  if(atomic_compare_exchange_strong(&m->fate, &fate, decision) && decision == MSG_DROPPED){
+    atomic_fetch_add(&stale_dropped, 1);
+    xcDebug("XLinSpeak: Dropped a message that waited %lu ms for synthesis.\n",
+            (unsigned long)(now - m->queued_ms));
+  }
+  return atomic_load(&m->fate) == MSG_STARTED;
+}
+
+//The texts of the live parts as sentences of one text
+static char *merge_text(const struct tts_job *job, const unsigned live[], unsigned n)
+{
+  struct strbuf sb = {0};
+  unsigned i;
+  for(i = 0; i < n; ++i){
+    const char *text = job->text + job->part_at[live[i]];
+    size_t len = strlen(text);
+    size_t pos = text_skip_space(text, len);
+    while(len > pos && isspace((unsigned char)text[len - 1])){
+      --len;
+    }
+    if(!sb_put(&sb, text + pos, len - pos) ||
+       (strchr(".!?", text[len - 1]) == NULL && !sb_put(&sb, ".", 1)) ||
+       (i + 1 < n && !sb_put(&sb, " ", 1))){
+      free(sb.buf);
+      return NULL;
+    }
+  }
+  return sb.buf;
+}
+
+//Cuts coalesced audio back into one piece per part at the pauses Piper
+//puts between sentences; if they can't be told apart the first part
+//keeps all of it
+static void synth_split(struct tts_job *job, const unsigned live[], unsigned n, struct tts_audio *audio)
+{
+  size_t cuts[TTS_MERGE_MAX];
+  size_t frame = (size_t)audio->pcm.info.channels * (audio->pcm.info.bits_per_sample / 8);
+  unsigned i;
+
+  job->audio[live[0]] = audio;
+  if(!trim_split(&audio->pcm, &trim_config, n, cuts)){
+    atomic_fetch_add(&coalesce_unsplit, 1);
+    xcDebug("XLinSpeak: Couldn't split the audio of %u coalesced messages.\n", n);
+    return;
+  }
+  for(i = n - 1; i > 0; --i){
+    struct tts_audio *piece = (struct tts_audio *)calloc(1, sizeof(*piece));
+    if(piece == NULL || !pcm_split_tail(&audio->pcm, (audio->pcm.len - cuts[i - 1]) / frame, &piece->pcm)){
+      //stays with the part before
+      free(piece);
+      continue;
+    }
+    piece->prio = audio->prio;
+    piece->gen = audio->gen;
+    piece->msg = job->msg[live[i]];
+    atomic_fetch_add(&piece->msg->refs, 1);
+    job->audio[live[i]] = piece;
+  }
+}
+
+//Renders one segment on a synthesis worker; preempted and stale segments are skipped
+static void synth_run(unsigned worker, struct pool_job *pj)
+{
+  struct tts_job *job = (struct tts_job *)pj->data;
+  struct tts_audio *audio;
+  struct wav_info fixed;
+  struct trim_cfg cfg;
+  unsigned live[TTS_MERGE_MAX];
+  unsigned n = 0;
+  unsigned i;
+  char *merged = NULL;
+  const char *text;
+  bool ok;
+
+  if(job->warm){
+    struct pcm_buf pcm = {0};
+    if(synth_piper(worker, job->text, &pcm)){
+      pcm_free(&pcm);
+    }
+    return;
+  }
+  if(higher_gen(job->prio) != job->gen){
+    return;
+  }
+  for(i = 0; i < job->parts; ++i){
+    if(msg_start(job->msg[i], job->prio)){
+      live[n++] = i;
+    }
+  }
+  if(n == 0){
+    return;
+  }
+  text = job->text + job->part_at[live[0]];
+  if(n > 1){
+    merged = merge_text(job, live, n);
+    if(merged == NULL){
+      return;
+    }
+    text = merged;
+  }
+  audio = (struct tts_audio *)calloc(1, sizeof(*audio));
+  if(audio == NULL){
+    free(merged);
+    return;
+  }
+  audio->prio = job->prio;
+  audio->gen = job->gen;
+  audio->msg = job->msg[live[0]];
+  atomic_fetch_add(&audio->msg->refs, 1);
+  if(n == 1 && bcast_get(job->seg, &audio->pcm)){
+    ok = true;
+  }else{
+    ok = (n == 1 && splice_enabled && synth_splice(worker, text, &audio->pcm)) ||
+         synth_piper(worker, text, &audio->pcm);
+    if(ok && n == 1){
+      bcast_put(job->seg, &audio->pcm);
+    }
+  }
+  free(merged);
+  if(!ok){
+    audio_free(audio);
+    return;
+  }
+  //converted here, so the player never has to reopen the output
+  if(audio_enabled && audio_format(&fixed) && !conv_pcm(&audio->pcm, &fixed)){
+    xcDebug("XLinSpeak: Can't convert %u Hz/%u ch/%u bit audio.\n", audio->pcm.info.sample_rate,
+            audio->pcm.info.channels, audio->pcm.info.bits_per_sample);
+    audio_free(audio);
+    return;
+  }
+  if(n > 1){
+    synth_split(job, live, n, audio);
+  }else{
+    job->audio[live[0]] = audio;
+  }
+  //joins within a message are crossfaded, so no silence is padded there
+  cfg = trim_config;
+  cfg.joined_start = !job->first && crossfade_ms > 0;
+  cfg.joined_end = !job->last && crossfade_ms > 0;
+  for(i = 0; i < job->parts && trim_enabled; ++i){
+    audio = job->audio[i];
+    if(audio != NULL && trim_pcm(&audio->pcm, &cfg) && audio->pcm.len == 0){
+      audio_free(audio);
+      job->audio[i] = NULL;
+    }
+  }
+}
+
+static void join_flush(void)
+{
+  if(join_tail != NULL){
+    ring_push(&ring_state, join_tail);
+    join_tail = NULL;
+  }
+}
+
+//Keeps the last crossfade_ms of a segment that has a successor coming
+static void join_hold(const struct tts_job *job, struct tts_audio *audio)
+{
+  struct tts_audio *tail;
+  size_t frames = (size_t)audio->pcm.info.sample_rate * crossfade_ms / 1000;
+  if(job->last || frames == 0){
+    return;
+  }
+  tail = (struct tts_audio *)calloc(1, sizeof(*tail));
+  if(tail == NULL){
+    return;
+  }
+  if(!pcm_split_tail(&audio->pcm, frames, &tail->pcm)){
+    free(tail);
+    return;
+  }
+  tail->prio = audio->prio;
+  tail->gen = audio->gen;
+  tail->msg = audio->msg;
+  atomic_fetch_add(&tail->msg->refs, 1);
+  join_tail = tail;
+  join_utt = job->utt;
+}
+
+//In submission order, whichever worker finished first
+static void synth_deliver(struct pool_job *pj)
+{
+  struct tts_job *job = (struct tts_job *)pj->data;
+  struct tts_audio *audio = job->audio[0];
+  unsigned i;
+  if(job->warm){
+    free(job);
+    return;
+  }
+  if(join_tail != NULL){
+    if(audio != NULL && job->utt == join_utt && pcm_crossfade(&audio->pcm, &join_tail->pcm)){
+      audio_free(join_tail);
+      join_tail = NULL;
+    }else{
+      join_flush();
+    }
+  }
+  for(i = 0; i < job->parts; ++i){
+    if(job->audio[i] != NULL){
+      if(i + 1 == job->parts){
+        join_hold(job, job->audio[i]);
+      }
+      ring_push(&ring_state, job->audio[i]);
+    }
+    msg_release(job->msg[i]);
+  }
+  bcast_release(job->seg);
+  free(job);
+}
+
+static void synth_drop(struct pool_job *pj)
+{
+  struct tts_job *job = (struct tts_job *)pj->data;
+  unsigned i;
+  for(i = 0; i < job->parts; ++i){
+    if(job->audio[i] != NULL){
+      audio_free(job->audio[i]);
+    }
+    msg_release(job->msg[i]);
+  }
+  bcast_release(job->seg);
+  free(job);
+}
+
+static void synth_start(unsigned worker)
+{
+  block_sigpipe();
+  if(server_enabled && !server_start(&servers[worker])){
+    xcDebug("XLinSpeak: Piper server %u didn't start, it is retried on first use.\n", worker);
+  }
+}
+
+static void synth_stop(unsigned worker)
+{
+  server_stop(&servers[worker]);
+}
+
+static const struct pool_ops synth_ops = {
+  synth_start, synth_stop, synth_run, synth_deliver, synth_drop
+};
+
+static unsigned long utt_next = 0;
+
+//A message cut short has the tail of its last segment held back for a
+//crossfade, this empty final segment makes synth_deliver() flush it
+static void say_end(int prio, unsigned gen, unsigned long utt)
+{
+  struct tts_job *job = (struct tts_job *)calloc(1, sizeof(*job) + 1);
+  if(job == NULL){
+    return;
+  }
+  job->prio = prio;
+  job->gen = gen;
+  job->utt = utt;
+  job->last = true;
+  if(!pool_submit(prio_voice[prio], job)){
+    free(job);
+  }
+}
+
+static struct tts_msg *msg_new(const struct tts_item *item)
+{
+  struct tts_msg *msg = (struct tts_msg *)calloc(1, sizeof(*msg));
+  if(msg == NULL){
+    return NULL;
+  }
+  atomic_init(&msg->refs, 1);
+  atomic_init(&msg->fate, MSG_PENDING);
+  atomic_init(&msg->played, false);
+  msg->queued_ms = item->queued_ms;
+  msg->key = item->key;
+  if(msg->key != 0){
+    queue_track(&queue_state, msg);
+  }
+  return msg;
+}
+
+//Splits text into segments for the workers, so the first sentence plays while the rest renders
+static void say_piper(const struct tts_item *item)
+{
+  const char *text = item->text;
+  size_t len = strlen(text);
+  size_t pos = text_skip_space(text, len);
+  unsigned gen = higher_gen(item->prio);
+  unsigned long utt = ++utt_next;
+  struct tts_msg *msg = msg_new(item);
+  struct bcast_render *render;
+  bool submitted = false;
+  bool ended = false;
+
+  if(msg == NULL){
+    return;
+  }
+  //segments unchanged since the last broadcast of this station are not synthesized again
+  render = bcast_begin(item->bkey);
+  while(pos < len && !queue_stopped(&queue_state)){
+    size_t n = text_segment_len(text + pos, len - pos, TTS_SEGMENT_SOFT, TTS_SEGMENT_HARD);
+    struct tts_job *job;
+    if(n == 0){
+      break;
+    }
+    if(higher_gen(item->prio) != gen){
+      xcDebug("XLinSpeak: Synthesis preempted.\n");
+      break;
+    }
+    if(atomic_load(&msg->fate) == MSG_CANCELLED){
+      xcDebug("XLinSpeak: Synthesis superseded by a newer message.\n");
+      break;
+    }
+    job = (struct tts_job *)calloc(1, sizeof(*job) + n + 1);
+    if(job == NULL){
+      break;
+    }
+    memcpy(job->text, text + pos, n);
+    job->text[n] = '\0';
+    freq_note(item->prio, job->text);
+    job->seg = bcast_add(render, job->text);
+    job->prio = item->prio;
+    job->gen = gen;
+    job->utt = utt;
+    job->first = !submitted;
+    job->parts = 1;
+    job->msg[0] = msg;
+    atomic_fetch_add(&msg->refs, 1);
+    pos += n;
+    pos += text_skip_space(text + pos, len - pos);
+    job->last = pos >= len;
+    if(!pool_submit(prio_voice[item->prio], job)){
+      msg_release(msg);
+      bcast_release(job->seg);
+      free(job);
+      break;
+    }
+    submitted = true;
+    ended = pos >= len;
+  }
+  if(submitted && !ended){
+    say_end(item->prio, gen, utt);
+  }
+  bcast_end(render, pos >= len);
+  msg_release(msg);
+}
+
+//Short messages from queue_pop_merge() go to one worker as one segment,
+//each keeps a tts_msg of its own for cancellation and deadlines
+static void say_coalesced(const struct tts_item items[], unsigned n)
+{
+  struct tts_job *job;
+  size_t size = 0;
+  size_t pos = 0;
+  unsigned i;
+
+  for(i = 0; i < n; ++i){
+    size += strlen(items[i].text) + 1;
+  }
+  job = (struct tts_job *)calloc(1, sizeof(*job) + size);
+  if(job == NULL){
+    for(i = 0; i < n; ++i){
+      say_piper(&items[i]);
+    }
+    return;
+  }
+  job->prio = items[0].prio;
+  job->gen = higher_gen(job->prio);
+  job->utt = ++utt_next;
+  job->first = true;
+  job->last = true;
+  for(i = 0; i < n; ++i){
+    size_t len = strlen(items[i].text);
+    struct tts_msg *msg = msg_new(&items[i]);
+    if(msg == NULL){
+      continue;
+    }
+    memcpy(job->text + pos, items[i].text, len + 1);
+    freq_note(items[i].prio, items[i].text);
+    job->part_at[job->parts] = pos;
+    job->msg[job->parts] = msg;
+    job->parts += 1;
+    pos += len + 1;
+  }
+  coalesce_calls += 1;
+  coalesced += job->parts;
+  if(job->parts == 0 || !pool_submit(prio_voice[job->prio], job)){
+    for(i = 0; i < job->parts; ++i){
+      msg_release(job->msg[i]);
+    }
+    free(job);
+  }
+}
+
+static void backend_say(const struct tts_item *item)
+{
+  switch(backend){
+    case TTS_PIPER:
+      say_piper(item);
+      break;
+    case TTS_SPEECHD:
+#ifdef USE_SPEECHD
+      speechd_say(item->text);
+#endif
+      break;
+    default:
+      break;
+  }
+}
+
+//Size, time and inode of a file, so a replaced model changes the key
+static uint64_t file_identity(uint64_t h, const char *path)
+{
+  struct stat st;
+  if(path == NULL || stat(path, &st) != 0){
+    return h;
+  }
+  h = fnv1a64(h, &st.st_size, sizeof(st.st_size));
+  h = fnv1a64(h, &st.st_mtim.tv_sec, sizeof(st.st_mtim.tv_sec));
+  h = fnv1a64(h, &st.st_mtim.tv_nsec, sizeof(st.st_mtim.tv_nsec));
+  return fnv1a64(h, &st.st_ino, sizeof(st.st_ino));
+}
+
+//Cached audio is only valid for the exact Piper command and model files that made it
+static void cache_start(void)
+{
+  long mb = env_long("PIPER_CACHE_MB", 32, 0, 4096);
+  int v, i;
+
+  for(v = 0; v < voice_count; ++v){
+    voices[v].key = FNV1A64_INIT;
+    for(i = 0; i < voices[v].piper_cmd.argc; ++i){
+      voices[v].key = fnv1a64(voices[v].key, voices[v].piper_cmd.argv[i],
+                              strlen(voices[v].piper_cmd.argv[i]) + 1);
+    }
+    if(voices[v].model != NULL){
+      char config[PATH_MAX];
+      snprintf(config, sizeof(config), "%s.json", voices[v].model);
+      voices[v].key = file_identity(voices[v].key, voices[v].model);
+      voices[v].key = file_identity(voices[v].key, config);
+    }
+  }
+  if(cache_init((size_t)mb << 20)){
+    xcDebug("XLinSpeak: PCM cache enabled (%ld MB).\n", mb);
+  }
+}
+
+//The threshold also finds the pauses between coalesced messages
+static void trim_start(void)
+{
+  trim_enabled = !env_is_false("PIPER_TRIM");
+  trim_config.threshold_db = (int)env_long("PIPER_TRIM_DB", -50, -96, -10);
+  trim_config.pad_ms = (unsigned)env_long("PIPER_TRIM_PAD_MS", 40, 0, 1000);
+  trim_config.fade_ms = (unsigned)env_long("PIPER_TRIM_FADE_MS", 5, 0, 100);
+  if(!trim_enabled){
+    return;
+  }
+  xcDebug("XLinSpeak: Trimming silence below %d dBFS, keeping %u ms.\n",
+          trim_config.threshold_db, trim_config.pad_ms);
+}
+
+//Disk cache and phrase counts, "" if there is none
+static const char *cache_dir(void)
+{
+  const char *dir = getenv("PIPER_DISK_CACHE_DIR");
+  return dir != NULL && *dir != '\0' ? dir : store_dir;
+}
+
+//The disk cache outlives the plugin, it starts after cache_start() set the voice keys
+static void store_start(void)
+{
+  long mb = env_long("PIPER_DISK_CACHE_MB", 256, 0, 65536);
+  const char *dir = cache_dir();
+  uint64_t keys[TTS_VOICES];
+  int v;
+
+  if(mb == 0 || *dir == '\0'){
+    return;
+  }
+  for(v = 0; v < voice_count; ++v){
+    keys[v] = voices[v].key;
+  }
+  store_enabled = store_open(dir, (size_t)mb << 20, keys, (unsigned)voice_count);
+  if(store_enabled){
+    struct store_stats st;
+    store_get_stats(&st);
+    xcDebug("XLinSpeak: Disk cache %s: %lu entries, %lu MB budget, %lu invalidated.\n", dir,
+            (unsigned long)st.entries, mb, st.invalidated);
+  }
+}
+
+static void store_stop(void)
+{
+  struct store_stats st;
+  if(!store_enabled){
+    return;
+  }
+  store_get_stats(&st);
+  xcDebug("XLinSpeak: Disk cache: %lu hits, %lu misses, %lu writes, %lu compactions, "
+          "%lu entries, %lu of %lu bytes.\n", st.hits, st.misses, st.puts, st.compactions,
+          (unsigned long)st.entries, (unsigned long)st.bytes, (unsigned long)st.budget);
+  store_close();
+  store_enabled = false;
+}
+
+static void cache_stop(void)
+{
+  struct cache_stats st;
+  cache_get_stats(&st);
+  xcDebug("XLinSpeak: PCM cache: %lu hits, %lu misses, %lu evictions, "
+          "%lu entries, %lu of %lu bytes.\n", st.hits, st.misses, st.evictions,
+          (unsigned long)st.entries, (unsigned long)st.bytes, (unsigned long)st.budget);
+  cache_close();
+}
+
+static const char *prio_names[SPEECH_PRIO_COUNT] = {"warning", "copilot", "atc", "atis"};
+//Classes whose messages replace a waiting one of the same kind
+static bool supersede_class[SPEECH_PRIO_COUNT] = {[SPEECH_ATIS] = true};
+
+//PIPER_PRIORITY_MAP="type:class,...", e.g. "0:atc,3:warning"
+static void priority_map_init(void)
+{
+  const char *map = getenv("PIPER_PRIORITY_MAP");
+  const char *p = map;
+  size_t i;
+
+  for(i = 0; i < sizeof(type_prio) / sizeof(type_prio[0]); ++i){
+    type_prio[i] = -1;
+  }
+  while(p != NULL && *p){
+    char *end;
+    long type = strtol(p, &end, 10);
+    int prio;
+    if(end == p || *end != ':'){
+      break;
+    }
+    p = end + 1;
+    for(prio = 0; prio < SPEECH_PRIO_COUNT; ++prio){
+      size_t n = strlen(prio_names[prio]);
+      if(strncasecmp(p, prio_names[prio], n) == 0 && (p[n] == ',' || p[n] == '\0')){
+        break;
+      }
+    }
+    if(prio == SPEECH_PRIO_COUNT || type < 0 ||
+       type >= (long)(sizeof(type_prio) / sizeof(type_prio[0]))){
+      break;
+    }
+    type_prio[type] = prio;
+    p = strchr(p, ',');
+    if(p != NULL){
+      ++p;
+    }
+  }
+  if(p != NULL && *p){
+    xcDebug("XLinSpeak: PIPER_PRIORITY_MAP not understood at '%s'.\n", p);
+  }
+}
+
+//PIPER_SUPERSEDE="class,...", "none" for no class
+static void supersede_init(void)
+{
+  const char *spec = getenv("PIPER_SUPERSEDE");
+  const char *p = spec;
+  int prio;
+
+  if(spec == NULL){
+    return;
+  }
+  for(prio = 0; prio < SPEECH_PRIO_COUNT; ++prio){
+    supersede_class[prio] = false;
+  }
+  if(strcasecmp(spec, "none") == 0){
+    return;
+  }
+  while(*p){
+    for(prio = 0; prio < SPEECH_PRIO_COUNT; ++prio){
+      size_t n = strlen(prio_names[prio]);
+      if(strncasecmp(p, prio_names[prio], n) == 0 && (p[n] == ',' || p[n] == '\0')){
+        break;
+      }
+    }
+    if(prio == SPEECH_PRIO_COUNT){
+      xcDebug("XLinSpeak: PIPER_SUPERSEDE not understood at '%s'.\n", p);
+      break;
+    }
+    supersede_class[prio] = true;
+    p += strlen(prio_names[prio]);
+    if(*p == ','){
+      ++p;
+    }
+  }
+}
+
+//PIPER_MODEL is the default voice, PIPER_MODEL_<CLASS> gives a class its own
+static bool voices_init(void)
+{
+  const char *models[TTS_VOICES];
+  int p, v;
+
+  models[0] = getenv("PIPER_MODEL");
+  if(models[0] != NULL && *models[0] == '\0'){
+    models[0] = NULL;
+  }
+  voice_count = 1;
+  for(p = 0; p < SPEECH_PRIO_COUNT; ++p){
+    char name[32];
+    const char *model;
+    size_t i;
+    snprintf(name, sizeof(name), "PIPER_MODEL_%s", prio_names[p]);
+    for(i = 12; name[i]; ++i){
+      name[i] = (char)toupper((unsigned char)name[i]);
+    }
+    model = getenv(name);
+    prio_voice[p] = 0;
+    if(model == NULL || *model == '\0'){
+      continue;
+    }
+    for(v = 0; v < voice_count; ++v){
+      if(models[v] != NULL && strcmp(models[v], model) == 0){
+        break;
+      }
+    }
+    if(v == voice_count){
+      models[voice_count++] = model;
+      xcDebug("XLinSpeak: %s voice: %s\n", prio_names[p], model);
+    }
+    prio_voice[p] = v;
+  }
+  for(v = 0; v < voice_count; ++v){
+    voices[v].model = models[v];
+    if(models[v] == NULL){
+      xcDebug("XLinSpeak: PIPER_MODEL not set, relying on PIPER_ARGS.\n");
+    }
+    if(!build_piper_cmd(&voices[v].piper_cmd, models[v])){
+      return false;
+    }
+  }
+  return true;
+}
+
+//PIPER_WORKERS Piper instances, spread over the voices, at least one each.
+//By default half the online cores, the sim needs the rest.
+static void workers_init(void)
+{
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  long n = cores > 1 ? cores / 2 : 1;
+  unsigned i;
+  if(n < voice_count){
+    n = voice_count;
+  }
+  if(n > POOL_WORKERS_MAX){
+    n = POOL_WORKERS_MAX;
+  }
+  n = env_long("PIPER_WORKERS", n, 1, POOL_WORKERS_MAX);
+  if(n < voice_count){
+    xcDebug("XLinSpeak: %d voices need %d synthesis workers.\n", voice_count, voice_count);
+    n = voice_count;
+  }
+  worker_count = (unsigned)n;
+  crossfade_ms = (unsigned)env_long("PIPER_CROSSFADE_MS", 10, 0, 100);
+  for(i = 0; i < worker_count; ++i){
+    worker_voice[i] = (int)(i % (unsigned)voice_count);
+  }
+}
+
+//PIPER_DEADLINE_MS="class:ms,...", e.g. "atc:15000,atis:0"; 0 never expires
+static void deadline_init(void)
+{
+  const char *spec = getenv("PIPER_DEADLINE_MS");
+  const char *p = spec;
+  while(p != NULL && *p){
+    char *end;
+    long ms;
+    int prio;
+    for(prio = 0; prio < SPEECH_PRIO_COUNT; ++prio){
+      size_t n = strlen(prio_names[prio]);
+      if(strncasecmp(p, prio_names[prio], n) == 0 && p[n] == ':'){
+        p += n + 1;
+        break;
+      }
+    }
+    if(prio == SPEECH_PRIO_COUNT){
+      break;
+    }
+    ms = strtol(p, &end, 10);
+    if(end == p || ms < 0 || ms > 3600000 || (*end != ',' && *end != '\0')){
+      break;
+    }
+    deadline_ms[prio] = (unsigned)ms;
+    p = *end == ',' ? end + 1 : end;
+  }
+  if(p != NULL && *p){
+    xcDebug("XLinSpeak: PIPER_DEADLINE_MS not understood at '%s'.\n", p);
+  }
+}
+
+/*
+ * Messages with equal keys supersede each other. The key names the kind of
+ * message, never its words: radio calls to one aircraft all start with its
+ * callsign and each one must be heard. Each station has only one current
+ * ATIS, so an ATIS replaces the previous one of its station (see
+ * broadcast_key()); other classes listed in PIPER_SUPERSEDE are keyed by
+ * hook source and X-Plane speech type.
+ */
+static uint64_t speech_key(int src, int type, int prio, uint64_t station)
+{
+  uint64_t h = FNV1A64_INIT;
+
+  if(!supersede_class[prio]){
+    return 0;
+  }
+  h = fnv1a64(h, &prio, sizeof(prio));
+  if(prio == SPEECH_ATIS){
+    h = fnv1a64(h, &station, sizeof(station));
+  }else if(type < 0){
+    return 0;
+  }else{
+    h = fnv1a64(h, &src, sizeof(src));
+    h = fnv1a64(h, &type, sizeof(type));
+  }
+  return h | 1;
+}
+
+/*
+ * The station of a broadcast, so the last rendering of each ATIS is kept
+ * apart: the hook source and the words that open it, up to "information",
+ * ATIS/AWOS/ASOS or the first number ("Boston Logan information Kilo").
+ */
+static uint64_t broadcast_key(const char *text, int src, int prio)
+{
+  static const char *stops[] = {
+    "information", "atis", "awos", "asos", "automated", "zero", "one", "two", "three", "tree",
+    "four", "five", "fife", "six", "seven", "eight", "nine", "niner"
+  };
+  uint64_t h = FNV1A64_INIT;
+  const char *end = text + strcspn(text, ",.;:");
+  const char *p = text;
+  unsigned words = 0;
+  size_t n, i;
+
+  if(prio != SPEECH_ATIS){
+    return 0;
+  }
+  h = fnv1a64(h, &src, sizeof(src));
+  while(words < BCAST_STATION_WORDS){
+    while(p < end && !isalnum((unsigned char)*p)){
+      ++p;
+    }
+    for(n = 0; p + n < end && (isalnum((unsigned char)p[n]) || p[n] == '-' || p[n] == '\''); ++n){
+      if(isdigit((unsigned char)p[n])){
+        return h | 1;
       }
-      pa_simple_drain(pulse_stream, &err);
-    }else{
-      xcDebug("XLinSpeak: Piper WAV header invalid or Pulse unavailable.\n");
-      while(read(outpipe[0], buf, sizeof(buf)) > 0){
-        /* discard */
+    }
+    if(n == 0){
+      break;
+    }
+    for(i = 0; i < sizeof(stops) / sizeof(stops[0]); ++i){
+      if(n == strlen(stops[i]) && strncasecmp(p, stops[i], n) == 0){
+        return h | 1;
       }
     }
-    close(outpipe[0]);
-    waitpid(piper_pid, NULL, 0);
-    return;
+    for(i = 0; i < n; ++i){
+      char c = (char)tolower((unsigned char)p[i]);
+      h = fnv1a64(h, &c, 1);
+    }
+    h = fnv1a64(h, " ", 1);
+    p += n;
+    words += 1;
   }
-#endif
+  return h | 1;
+}
 
-  if(!spawn_process(sink_cmd.argv, outpipe[0], -1, close_all, 4, &sink_pid)){
-    xcDebug("XLinSpeak: Sink spawn failed: %d\n", errno);
-    kill(piper_pid, SIGTERM);
-    waitpid(piper_pid, NULL, 0);
-    close(outpipe[0]);
-    return;
+static bool text_has_word(const char *text, const char *word)
+{
+  size_t n = strlen(word);
+  const char *p;
+  for(p = text; *p; ++p){
+    if((p == text || !isalpha((unsigned char)p[-1])) &&
+       strncasecmp(p, word, n) == 0 && !isalpha((unsigned char)p[n])){
+      return true;
+    }
   }
-
-  close(outpipe[0]);
-  waitpid(piper_pid, NULL, 0);
-  waitpid(sink_pid, NULL, 0);
+  return false;
 }
 
-#ifdef USE_SPEECHD
-static bool speechd_init(void)
+//"<airport> information Bravo ..." opens a broadcast; further on, as in
+//"advise you have information Bravo", it is a reference to one
+static bool atis_opening(const char *text)
 {
-  conn = spd_open("XLinSpeak", "Main", "player", SPD_MODE_SINGLE);
-  if(conn == NULL){
-    xcDebug("XLinSpeak: Couldn't init speech-dispatcher!\n");
-    return false;
+  static const char *letters[] = {
+    "alpha", "alfa", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliet", "juliett", "kilo", "lima", "mike", "november", "oscar", "papa",
+    "quebec", "romeo", "sierra", "tango", "uniform", "victor", "whiskey", "whisky",
+    "x-ray", "xray", "yankee", "zulu"
+  };
+  const char *end = text + strcspn(text, ",.;:");
+  const char *p, *q;
+  size_t n, i;
+
+  for(p = text; p + 11 < end; ++p){
+    if((p != text && isalpha((unsigned char)p[-1])) || strncasecmp(p, "information", 11) != 0 ||
+       !isspace((unsigned char)p[11])){
+      continue;
+    }
+    for(q = p + 11; isspace((unsigned char)*q); ++q){
+    }
+    for(n = 0; isalpha((unsigned char)q[n]) || q[n] == '-'; ++n){
+    }
+    if(n == 1){
+      return true;
+    }
+    for(i = 0; i < sizeof(letters) / sizeof(letters[0]); ++i){
+      if(n == strlen(letters[i]) && strncasecmp(q, letters[i], n) == 0){
+        return true;
+      }
+    }
   }
-  return true;
+  return false;
 }
 
-static void speechd_say(const char *str)
+static int speech_classify(const char *text, int src, int speech_type)
 {
-  if(conn != NULL){
-    spd_say(conn, SPD_MESSAGE, str);
+  static const char *atis_words[] = {"atis", "awos", "asos"};
+  static const char *warning_words[] = {"pull up", "terrain", "windshear", "stall",
+                                        "sink rate", "bank angle", "glideslope"};
+  size_t i;
+
+  if(speech_type >= 0 && speech_type < (int)(sizeof(type_prio) / sizeof(type_prio[0])) &&
+     type_prio[speech_type] >= 0){
+    return type_prio[speech_type];
+  }
+  if(src == SPEECH_SRC_NON_RADIO){
+    for(i = 0; i < sizeof(warning_words) / sizeof(warning_words[0]); ++i){
+      if(text_has_word(text, warning_words[i])){
+        return SPEECH_WARNING;
+      }
+    }
+    return SPEECH_COPILOT;
   }
+  for(i = 0; i < sizeof(atis_words) / sizeof(atis_words[0]); ++i){
+    if(text_has_word(text, atis_words[i])){
+      return SPEECH_ATIS;
+    }
+  }
+  if(atis_opening(text)){
+    return SPEECH_ATIS;
+  }
+  return SPEECH_ATC;
 }
 
-static void speechd_close(void)
+static bool say_ring_init(struct say_ring *r)
 {
-  if(conn != NULL){
-    spd_close(conn);
-    conn = NULL;
+  unsigned i;
+  for(i = 0; i < TTS_SLOTS; ++i){
+    atomic_init(&r->slots[i].seq, i);
+  }
+  atomic_init(&r->tail, 0);
+  r->head = 0;
+  atomic_init(&r->sleeping, false);
+  atomic_init(&r->stop, false);
+  atomic_init(&r->dropped, 0);
+  //Never closed: a hook call racing speech_close() may still signal it
+  if(r->efd < 0){
+    r->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  }
+  return r->efd >= 0;
+}
+
+static void say_ring_wake(struct say_ring *r)
+{
+  uint64_t one = 1;
+  while(write(r->efd, &one, sizeof(one)) < 0 && errno == EINTR){
   }
 }
-#endif
 
-static void backend_say(const char *text)
+//Hook path: no allocation, no locks, at most TTS_PUSH_TRIES attempts
+static bool say_ring_push(struct say_ring *r, const char *text, int src, int type)
 {
-  switch(backend){
-    case TTS_PIPER:
-      speak_piper(text);
-      break;
-    case TTS_SPEECHD:
-#ifdef USE_SPEECHD
-      speechd_say(text);
-#endif
+  size_t len = strlen(text);
+  unsigned need = (unsigned)((len + TTS_SLOT_TEXT - 1) / TTS_SLOT_TEXT);
+  unsigned pos;
+  unsigned i;
+  int tries;
+
+  if(need == 0){
+    return true;
+  }
+  //Anything longer than half the ring is cut short
+  if(need > TTS_SLOTS / 2){
+    need = TTS_SLOTS / 2;
+    len = (size_t)need * TTS_SLOT_TEXT;
+  }
+
+  pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  for(tries = 0; ; ++tries){
+    unsigned last = pos + need - 1;
+    unsigned seq;
+    if(tries == TTS_PUSH_TRIES){
+      atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+      return false;
+    }
+    //Slots are freed in order, the last one free means all are
+    seq = atomic_load_explicit(&r->slots[last % TTS_SLOTS].seq, memory_order_acquire);
+    if((int)(seq - last) < 0){
+      atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+      return false;
+    }
+    if(seq == last &&
+       atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + need,
+                                             memory_order_relaxed, memory_order_relaxed)){
       break;
-    default:
+    }
+    if(seq != last){
+      pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    }
+  }
+
+  for(i = 0; i < need; ++i){
+    struct tts_slot *slot = &r->slots[(pos + i) % TTS_SLOTS];
+    size_t off = (size_t)i * TTS_SLOT_TEXT;
+    size_t n = len - off < TTS_SLOT_TEXT ? len - off : TTS_SLOT_TEXT;
+    memcpy(slot->text, text + off, n);
+    slot->len = (unsigned)n;
+    slot->src = src;
+    slot->type = type;
+    slot->more = (i + 1 < need);
+    atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+  }
+
+  //Only a consumer that went to sleep on an empty ring needs the syscall
+  if(atomic_exchange(&r->sleeping, false)){
+    say_ring_wake(r);
+  }
+  return true;
+}
+
+//Consumer side; moves complete strings into the priority queue
+static void say_ring_drain(struct say_ring *r, struct strbuf *partial)
+{
+  while(1){
+    struct tts_slot *slot = &r->slots[r->head % TTS_SLOTS];
+    unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    bool more;
+    int src;
+    int type;
+    if(seq != r->head + 1){
       break;
+    }
+    more = slot->more;
+    src = slot->src;
+    type = slot->type;
+    if(!sb_put(partial, slot->text, slot->len)){
+      free(partial->buf);
+      partial->buf = NULL;
+      partial->len = 0;
+      partial->cap = 0;
+    }
+    atomic_store_explicit(&slot->seq, r->head + TTS_SLOTS, memory_order_release);
+    r->head += 1;
+
+    if(!more && partial->buf != NULL){
+      int prio;
+      uint64_t key, bkey;
+      //The spoken form is what gets classified, keyed and cached
+      char *spoken = norm_enabled ? norm_text(partial->buf) : NULL;
+      if(spoken != NULL){
+        free(partial->buf);
+        partial->buf = spoken;
+      }
+      prio = speech_classify(partial->buf, src, type);
+      bkey = broadcast_key(partial->buf, src, prio);
+      key = speech_key(src, type, prio, bkey);
+      queue_push(&queue_state, partial->buf, prio, key, bkey);
+      atomic_fetch_add(&prio_gen[prio], 1);
+      partial->buf = NULL;
+      partial->len = 0;
+      partial->cap = 0;
+    }
+  }
+}
+
+static void *say_worker(void *arg)
+{
+  struct say_ring *r = &say_state;
+  struct strbuf partial = {NULL, 0, 0};
+  unsigned long dropped = 0;
+  unsigned long logged = 0;
+  (void)arg;
+
+  while(!atomic_load(&r->stop)){
+    struct tts_slot *slot;
+    struct pollfd pfd;
+    uint64_t val;
+    unsigned long now;
+
+    say_ring_drain(r, &partial);
+    //one line per burst of drops, once a pass drops nothing more
+    now = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    if(now == dropped && dropped != logged){
+      xcDebug("XLinSpeak: Speech hand-off ring was full, %lu strings dropped (%lu in total).\n",
+              dropped - logged, dropped);
+      logged = dropped;
+    }
+    dropped = now;
+
+    atomic_store(&r->sleeping, true);
+    slot = &r->slots[r->head % TTS_SLOTS];
+    if(atomic_load(&slot->seq) == r->head + 1 || atomic_load(&r->stop)){
+      atomic_store(&r->sleeping, false);
+      continue;
+    }
+    pfd.fd = r->efd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, dropped != logged ? SAY_BURST_MS : -1) > 0){
+      while(read(r->efd, &val, sizeof(val)) < 0 && errno == EINTR){
+      }
+    }
   }
+  dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+  if(dropped != logged){
+    xcDebug("XLinSpeak: Speech hand-off ring was full, %lu strings dropped (%lu in total).\n",
+            dropped - logged, dropped);
+  }
+  free(partial.buf);
+  return NULL;
 }
 
+//Synthesis stage: renders queued text ahead of playback
 static void *tts_worker(void *arg)
 {
   (void)arg;
+  block_sigpipe();
   while(1){
-    char *text = queue_pop(&queue_state);
-    if(text == NULL){
+    struct tts_item items[TTS_MERGE_MAX];
+    unsigned n = 1;
+    unsigned i;
+    if(!queue_pop(&queue_state, &items[0])){
+      break;
+    }
+    atomic_store(&live_ms, mono_ms());
+    if(backend == TTS_PIPER){
+      n += queue_pop_merge(&queue_state, &items[0], items + 1, TTS_MERGE_MAX - 1);
+    }
+    if(n > 1){
+      say_coalesced(items, n);
+    }else{
+      backend_say(&items[0]);
+    }
+    for(i = 0; i < n; ++i){
+      free(items[i].text);
+    }
+  }
+  //outstanding segments are dropped, not played
+  if(pool_started){
+    pool_close();
+    pool_started = false;
+  }
+  join_flush();
+  if(play_started){
+    ring_push(&ring_state, NULL);
+  }
+  return NULL;
+}
+
+//Nothing queued or in synthesis, and no message taken for prewarm_idle_ms
+static bool speech_idle(void)
+{
+  bool idle;
+  pthread_mutex_lock(&queue_state.mtx);
+  idle = queue_state.count == 0;
+  pthread_mutex_unlock(&queue_state.mtx);
+  return idle && pool_pending() == 0 && mono_ms() - atomic_load(&live_ms) >= prewarm_idle_ms;
+}
+
+static bool prewarm_submit(int voice, int prio, const char *text)
+{
+  size_t len = strlen(text);
+  struct tts_job *job = (struct tts_job *)calloc(1, sizeof(*job) + len + 1);
+  if(job == NULL){
+    return false;
+  }
+  memcpy(job->text, text, len + 1);
+  job->prio = prio;
+  job->warm = true;
+  if(!pool_submit(voice, job)){
+    free(job);
+    return false;
+  }
+  return true;
+}
+
+//Renders the most frequent phrases of earlier sessions into the caches,
+//then the fixed parts synth_splice() is missing, one at a time and only
+//while speech_idle(), so a live message waits for one phrase at most
+static void *prewarm_worker(void *arg)
+{
+  static struct freq_phrase top[PREWARM_MAX];
+  size_t n = freq_top(top, prewarm_count, 2);
+  size_t i;
+  char *text;
+  int voice;
+  (void)arg;
+  for(i = 0; i < n; ++i){
+    while(!atomic_load(&prewarm_stop) && !speech_idle()){
+      usleep(50000);
+    }
+    if(atomic_load(&prewarm_stop) || !prewarm_submit(prio_voice[top[i].prio], top[i].prio, top[i].text)){
       break;
     }
-    backend_say(text);
+    prewarmed += 1;
+  }
+  for(i = 0; i < n; ++i){
+    free(top[i].text);
+  }
+  while(splice_enabled && !atomic_load(&prewarm_stop)){
+    usleep(50000);
+    if(!speech_idle() || (text = splice_wish_take(&voice)) == NULL){
+      continue;
+    }
+    if(prewarm_submit(voice, SPEECH_ATC, text)){
+      prewarmed += 1;
+    }
+    free(text);
+  }
+  return NULL;
+}
+
+static void prewarm_start(const char *dir)
+{
+  char path[PATH_MAX];
+  prewarm_count = (unsigned)env_long("PIPER_PREWARM", 50, 0, PREWARM_MAX);
+  prewarm_idle_ms = (uint64_t)env_long("PIPER_PREWARM_IDLE_MS", 1000, 0, 600000);
+  snprintf(path, sizeof(path), "%s/phrases", dir);
+  if((prewarm_count == 0 || *dir == '\0' || (mkdir(dir, 0755) != 0 && errno != EEXIST) ||
+      !freq_init(path)) && !splice_enabled){
+    return;
+  }
+  atomic_store(&prewarm_stop, false);
+  atomic_store(&live_ms, mono_ms());
+  prewarm_started = pthread_create(&prewarm_thread, NULL, prewarm_worker, NULL) == 0;
+}
+
+static void prewarm_stop_join(void)
+{
+  char *text;
+  int voice;
+  if(prewarm_started){
+    atomic_store(&prewarm_stop, true);
+    pthread_join(prewarm_thread, NULL);
+    prewarm_started = false;
+    xcDebug("XLinSpeak: Prewarmed %lu frequent phrase(s) and template part(s).\n", prewarmed);
+  }
+  while((text = splice_wish_take(&voice)) != NULL){
     free(text);
   }
+}
+
+//Playback stage: plays rendered audio while the next item is synthesized
+static void *play_worker(void *arg)
+{
+  (void)arg;
+  block_sigpipe();
+  while(1){
+    struct tts_audio *audio = ring_pop(&ring_state);
+    if(audio == NULL){
+      break;
+    }
+    if(!audio_preempted(audio)){
+      atomic_store(&audio->msg->played, true);
+      play_pcm(audio);
+    }
+    audio_free(audio);
+    //the output keeps running between segments, it only drains when starved
+    if(audio_enabled && ring_empty(&ring_state)){
+      audio_idle();
+    }
+  }
   return NULL;
 }
 
+static void backend_close(void)
+{
+  if(backend == TTS_PIPER){
+    struct pool_stats st;
+    struct bcast_stats bst;
+    int v;
+    pool_get_stats(&st);
+    xcDebug("XLinSpeak: %u synthesis worker(s): %lu segments, %lu stolen.\n",
+            worker_count, st.jobs, st.stolen);
+    xcDebug("XLinSpeak: %lu message(s) dropped past their deadline.\n", atomic_load(&stale_dropped));
+    if(splice_enabled){
+      xcDebug("XLinSpeak: %lu segment(s) spliced from %lu fragments, %lu of them synthesized.\n",
+              atomic_load(&splice_segments), atomic_load(&splice_fragments),
+              atomic_load(&splice_synthesized));
+    }
+    bcast_get_stats(&bst);
+    if(bst.reused + bst.rendered > 0){
+      xcDebug("XLinSpeak: %lu segment(s) of repeated long messages reused, %lu synthesized.\n",
+              bst.reused, bst.rendered);
+    }
+    xcDebug("XLinSpeak: %lu short message(s) coalesced into %lu synthesis call(s), %lu not split apart.\n",
+            coalesced, coalesce_calls, atomic_load(&coalesce_unsplit));
+    if(server_enabled){
+      server_close();
+      server_enabled = false;
+    }
+    cache_stop();
+    store_stop();
+    freq_close();
+    bcast_close();
+    for(v = 0; v < voice_count; ++v){
+      argv_free(&voices[v].piper_cmd);
+    }
+    voice_count = 0;
+    argv_free(&sink_cmd);
+  }
+
+  if(audio_enabled){
+    if(play_lat_count > 0){
+      xcDebug("XLinSpeak: Output latency: avg %lu ms, max %lu ms.\n",
+              play_lat_sum / play_lat_count / 1000, play_lat_max / 1000);
+    }
+    audio_close();
+    conv_close();
+    audio_enabled = false;
+  }
+
+#ifdef USE_SPEECHD
+  if(backend == TTS_SPEECHD){
+    speechd_close();
+  }
+#endif
+
+  backend = TTS_NONE;
+}
+
+//Where the disk cache lives unless PIPER_DISK_CACHE_DIR says otherwise
+void speech_set_cache_dir(const char *dir)
+{
+  snprintf(store_dir, sizeof(store_dir), "%s", dir);
+}
+
 bool speech_init(void)
 {
   if(tts_ready){
@@ -729,18 +2904,38 @@ bool speech_init(void)
   }
 
   queue_init(&queue_state);
-
-  if(build_piper_cmd() && build_sink_cmd()){
+  priority_map_init();
+  deadline_init();
+  norm_enabled = !env_is_false("PIPER_NORMALIZE");
+  supersede_init();
+  coalesce_chars = (size_t)env_long("PIPER_COALESCE_CHARS", 80, 0, TTS_SEGMENT_HARD);
+  coalesce_ms = (uint64_t)env_long("PIPER_COALESCE_MS", 2000, 0, 60000);
+  splice_enabled = env_is_true("PIPER_SPLICE");
+  splice_crossfade_ms = (unsigned)env_long("PIPER_SPLICE_FADE_MS", 5, 0, 50);
+
+  if(voices_init() && build_sink_cmd()){
     backend = TTS_PIPER;
-#ifdef USE_PULSE
-    pulse_enabled = env_is_true("PIPER_PULSE");
-    if(pulse_enabled){
-      xcDebug("XLinSpeak: Pulse backend enabled (PIPER_PULSE=1).\n");
-    }
-#endif
+    workers_init();
+    audio_enabled = audio_init(sink_cmd.argv);
     xcDebug("XLinSpeak: Piper backend enabled.\n");
+    cache_start();
+    store_start();
+    trim_start();
+    bcast_init((unsigned)env_long("PIPER_REPEAT_KEEP", 8, 0, 64));
+    if(!env_is_false("PIPER_SERVER")){
+      server_enabled = server_init();
+      if(server_enabled){
+        xcDebug("XLinSpeak: Persistent Piper server started (run dir %s).\n", run_dir);
+      }else{
+        xcDebug("XLinSpeak: Piper server unavailable, spawning Piper per utterance.\n");
+      }
+    }
   }else{
-    argv_free(&piper_cmd);
+    int v;
+    for(v = 0; v < voice_count; ++v){
+      argv_free(&voices[v].piper_cmd);
+    }
+    voice_count = 0;
     argv_free(&sink_cmd);
 #ifdef USE_SPEECHD
     if(speechd_init()){
@@ -760,33 +2955,76 @@ bool speech_init(void)
     return false;
   }
 
+  if(backend == TTS_PIPER){
+    ring_init(&ring_state);
+    atomic_store(&play_stop, false);
+    if(pthread_create(&play_thread, NULL, play_worker, NULL) != 0){
+      xcDebug("XLinSpeak: Couldn't start playback thread.\n");
+      ring_destroy(&ring_state);
+      queue_destroy(&queue_state);
+      backend_close();
+      return false;
+    }
+    play_started = true;
+    if(!pool_init(worker_count, worker_voice, getenv("PIPER_AFFINITY"), &synth_ops)){
+      xcDebug("XLinSpeak: Couldn't start synthesis workers.\n");
+      ring_push(&ring_state, NULL);
+      pthread_join(play_thread, NULL);
+      play_started = false;
+      ring_destroy(&ring_state);
+      queue_destroy(&queue_state);
+      backend_close();
+      return false;
+    }
+    pool_started = true;
+  }
+
   if(pthread_create(&worker_thread, NULL, tts_worker, NULL) != 0){
     xcDebug("XLinSpeak: Couldn't start TTS worker thread.\n");
-    queue_destroy(&queue_state);
-    if(backend == TTS_PIPER){
-      argv_free(&piper_cmd);
-      argv_free(&sink_cmd);
+    if(pool_started){
+      pool_close();
+      pool_started = false;
     }
-#ifdef USE_SPEECHD
-    if(backend == TTS_SPEECHD){
-      speechd_close();
+    if(play_started){
+      ring_push(&ring_state, NULL);
+      pthread_join(play_thread, NULL);
+      play_started = false;
+      ring_destroy(&ring_state);
     }
-#endif
-    backend = TTS_NONE;
+    queue_destroy(&queue_state);
+    backend_close();
     return false;
   }
 
   worker_started = true;
+
+  if(!say_ring_init(&say_state) ||
+     pthread_create(&say_thread, NULL, say_worker, NULL) != 0){
+    xcDebug("XLinSpeak: Couldn't start speech hand-off thread.\n");
+    tts_ready = true;
+    speech_close();
+    return false;
+  }
+  say_started = true;
+
+  if(backend == TTS_PIPER){
+    prewarm_start(cache_dir());
+  }
   tts_ready = true;
   return true;
 }
 
 void speech_say(char *str)
 {
-  if(!tts_ready || str == NULL){
+  speech_say_typed(str, SPEECH_SRC_RADIO, -1);
+}
+
+void speech_say_typed(char *str, int src, int speech_type)
+{
+  if(!tts_ready || str == NULL || *str == '\0'){
     return;
   }
-  queue_push(&queue_state, str);
+  say_ring_push(&say_state, str, src, speech_type);
 }
 
 void speech_close(void)
@@ -795,33 +3033,143 @@ void speech_close(void)
     return;
   }
   tts_ready = false;
+  prewarm_stop_join();
+  if(say_started){
+    atomic_store(&say_state.stop, true);
+    say_ring_wake(&say_state);
+    pthread_join(say_thread, NULL);
+    say_started = false;
+  }
   queue_stop(&queue_state);
+  atomic_store(&play_stop, true);
   if(worker_started){
     pthread_join(worker_thread, NULL);
     worker_started = false;
   }
+  if(play_started){
+    pthread_join(play_thread, NULL);
+    play_started = false;
+    ring_destroy(&ring_state);
+  }
 
+  xcDebug("XLinSpeak: %lu message(s) superseded by newer ones.\n", queue_state.superseded);
   queue_destroy(&queue_state);
+  backend_close();
+}
 
-  if(backend == TTS_PIPER){
-    argv_free(&piper_cmd);
-    argv_free(&sink_cmd);
+#ifdef BENCH_SAY
+/*
+ * Cycles spent in the hook path while several producer threads hammer the
+ * hand-off ring. A producer whose push was dropped backs off, so the ring
+ * stays mostly drained and the accepted pushes measure a real hand-off;
+ * dropped pushes are counted apart. Build with "make bench_say", run
+ * "./bench_say [threads]".
+ */
+#include <x86intrin.h>
+
+#define BENCH_CALLS 200000
+//Lets the consumer drain the ring after a drop
+#define BENCH_BACKOFF_US 200
+
+void XPLMDebugString(const char *s)
+{
+  fputs(s, stderr);
+}
+
+struct bench_thread {
+  pthread_t thread;
+  uint32_t *samples;      //accepted pushes
+  unsigned long dropped;
+  uint64_t dropped_cycles;
+};
+
+static void *bench_producer(void *arg)
+{
+  struct bench_thread *b = (struct bench_thread *)arg;
+  char text[] = "Cleared for takeoff runway two seven left, wind two seven zero at five.";
+  int i = 0;
+  while(i < BENCH_CALLS){
+    uint64_t t0 = __rdtsc();
+    //what speech_say() does past its checks, with the outcome
+    bool ok = say_ring_push(&say_state, text, SPEECH_SRC_RADIO, -1);
+    uint32_t cycles = (uint32_t)(__rdtsc() - t0);
+    if(ok){
+      b->samples[i++] = cycles;
+    }else{
+      b->dropped += 1;
+      b->dropped_cycles += cycles;
+      usleep(BENCH_BACKOFF_US);
+    }
   }
+  return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  struct bench_thread *b;
+  uint32_t *all;
+  uint64_t sum = 0;
+  uint64_t dropped_cycles = 0;
+  unsigned long dropped = 0;
+  size_t total;
+  size_t i;
+  int t;
 
-#ifdef USE_PULSE
-  if(pulse_stream != NULL){
-    int err;
-    pa_simple_drain(pulse_stream, &err);
-    pa_simple_free(pulse_stream);
-    pulse_stream = NULL;
+  if(threads < 1){
+    threads = 1;
   }
-#endif
+  queue_init(&queue_state);
+  priority_map_init();
+  if(!say_ring_init(&say_state) ||
+     pthread_create(&say_thread, NULL, say_worker, NULL) != 0){
+    return 1;
+  }
+  tts_ready = true;
 
-#ifdef USE_SPEECHD
-  if(backend == TTS_SPEECHD){
-    speechd_close();
+  b = (struct bench_thread *)calloc((size_t)threads, sizeof(*b));
+  total = (size_t)threads * BENCH_CALLS;
+  all = (uint32_t *)malloc(total * sizeof(uint32_t));
+  if(b == NULL || all == NULL){
+    return 1;
+  }
+  for(t = 0; t < threads; ++t){
+    b[t].samples = all + (size_t)t * BENCH_CALLS;
+    pthread_create(&b[t].thread, NULL, bench_producer, &b[t]);
+  }
+  for(t = 0; t < threads; ++t){
+    pthread_join(b[t].thread, NULL);
   }
-#endif
 
-  backend = TTS_NONE;
+  tts_ready = false;
+  atomic_store(&say_state.stop, true);
+  say_ring_wake(&say_state);
+  pthread_join(say_thread, NULL);
+
+  for(i = 0; i < total; ++i){
+    sum += all[i];
+  }
+  for(t = 0; t < threads; ++t){
+    dropped += b[t].dropped;
+    dropped_cycles += b[t].dropped_cycles;
+  }
+  qsort(all, total, sizeof(uint32_t), bench_cmp);
+  printf("speech_say, %d producer thread(s), %lu accepted pushes\n", threads, (unsigned long)total);
+  printf("  cycles/accepted push: mean %.0f, p50 %u, p99 %u, p99.9 %u, max %u\n",
+         (double)sum / (double)total, all[total / 2], all[total * 99 / 100],
+         all[total * 999 / 1000], all[total - 1]);
+  printf("  dropped (ring full, then backed off): %lu, mean %.0f cycles\n",
+         dropped, dropped ? (double)dropped_cycles / (double)dropped : 0.0);
+  queue_destroy(&queue_state);
+  free(all);
+  free(b);
+  return 0;
 }
+#endif
@@ -3,12 +3,54 @@
 
 #include <stdbool.h>
 #include <stdarg.h>
-
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//Priority classes, most important first
+enum speech_prio {
+  SPEECH_WARNING = 0,
+  SPEECH_COPILOT,
+  SPEECH_ATC,
+  SPEECH_ATIS,
+  SPEECH_PRIO_COUNT
+};
+
+//Which hooked X-Plane function a string came from
+enum speech_src {
+  SPEECH_SRC_RADIO = 0,
+  SPEECH_SRC_NON_RADIO
+};
+
+void speech_set_cache_dir(const char *dir);
 bool speech_init(void);
 void speech_say(char *str);
+void speech_say_typed(char *str, int src, int speech_type);
 void speech_close(void);
 void xcDebug(const char *format, ...);
 
+bool env_is_true(const char *name);
+bool env_is_false(const char *name);
+long env_long(const char *name, long def, long min, long max);
+bool write_all(int fd, const char *buf, size_t len);
+int set_cloexec(int fd);
+bool spawn_process(char *const argv[], int stdin_fd, int stdout_fd,
+                   const int *close_fds, size_t close_count,
+                   pid_t *pid_out);
+
+#define FNV1A64_INIT 0xcbf29ce484222325ULL
+
+static inline uint64_t fnv1a64(uint64_t h, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  size_t i;
+  for(i = 0; i < len; ++i){
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
 #endif
 
 
@@ -8,17 +8,33 @@
 #include <XPLMDefs.h>
 #include <XPLMDataAccess.h>
 #include <XPLMUtilities.h>
+#include <XPLMPlugin.h>
 #include "hook.h"
 #include "sec.h"
 
 struct function_ptrs ptrs[] = {
-  {.name = "_ZN10spch_class22SPEECH_synth_non_radioENSt3__112basic_stringIcNS0_11char_traitsIcEENS0_9allocatorIcEEEE11speech_typei", .address = 0, .hook = 1},
+  {.name = "_ZN10spch_class22SPEECH_synth_non_radioENSt3__112basic_stringIcNS0_11char_traitsIcEENS0_9allocatorIcEEEE11speech_typei", .address = 0, .hook = 3},
   {.name = "_ZN10spch_class18SPEECH_speakstringENSt3__112basic_stringIcNS0_11char_traitsIcEENS0_9allocatorIcEEEE11speech_typei", .address = 0, .hook = 1},
   {.name = "_ZN10soun_class18SPEECH_speakstringESs11speech_typei", .address = 0, .hook = 0},
   {.name = "_ZN10soun_class18SPEECH_speakstringESsi", .address = 0, .hook = 2}
 };
 
 
+//Resolved addresses and synthesized phrases are kept next to the plugin binary
+static void plugin_file_path(char *path, size_t len, const char *name)
+{
+  char plugin[2048] = "";
+  char *slash;
+  XPLMGetPluginInfo(XPLMGetMyID(), NULL, plugin, NULL, NULL);
+  slash = strrchr(plugin, '/');
+  if(slash != NULL){
+    *slash = '\0';
+    snprintf(path, len, "%s/%s", plugin, name);
+  }else{
+    snprintf(path, len, "%s", name);
+  }
+}
+
 PLUGIN_API int XPluginStart(
 						char *		outName,
 						char *		outSig,
@@ -28,15 +44,22 @@ PLUGIN_API int XPluginStart(
   strcpy(outSig, "XLinSpeak v04");
   strcpy(outDesc, "Speak up now");
 
-  xcDebug("XLinSpeak going to init tables...\n");
-  if(!locate_tables()){
-    xcDebug("Couldn't init tables!\n");
-    return 1;
-  }
-  xcDebug("XLinSpeak going to search for functions...\n");
-  if(!find_functions(ptrs, sizeof(ptrs) / sizeof(ptrs[0]))){
-    xcDebug("XLinSpeak Search for functions unsuccessful!\n");
-    return 1;
+  char cache[2048];
+  plugin_file_path(cache, sizeof(cache), "XLinSpeak.addr");
+  if(!addr_cache_load(cache, ptrs, sizeof(ptrs) / sizeof(ptrs[0]))){
+    xcDebug("XLinSpeak going to init tables...\n");
+    if(!locate_tables()){
+      xcDebug("Couldn't init tables!\n");
+      return 1;
+    }
+    xcDebug("XLinSpeak going to search for functions...\n");
+    bool found = find_functions(ptrs, sizeof(ptrs) / sizeof(ptrs[0]));
+    release_tables();
+    if(!found){
+      xcDebug("XLinSpeak Search for functions unsuccessful!\n");
+      return 1;
+    }
+    addr_cache_store(cache, ptrs, sizeof(ptrs) / sizeof(ptrs[0]));
   }
 
   unsigned int i;
@@ -47,6 +70,8 @@ PLUGIN_API int XPluginStart(
   }
 
   xcDebug("XLinSpeak Going to init speech.\n");
+  plugin_file_path(cache, sizeof(cache), "XLinSpeak.cache");
+  speech_set_cache_dir(cache);
   if(!speech_init()){
     xcDebug("XLinSpeak Speech not ready!\n");
     //speech_test();